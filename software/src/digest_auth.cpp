@@ -24,175 +24,423 @@
 */
 #include "digest_auth.h"
 
-#include "mbedtls/md5.h"
+#include <esp_random.h>
+#include <esp_rom_md5.h>
+
 #include "event_log.h"
-#include "build.h"
+#include "tools.h"
 
 extern EventLog logger;
 
-static bool getMD5(uint8_t * data, uint16_t len, char * output){//33 bytes or more
-    mbedtls_md5_context _ctx;
-  uint8_t i;
-  uint8_t * _buf = (uint8_t*)malloc(16);
-  if(_buf == NULL)
-    return false;
-  memset(_buf, 0x00, 16);
-
-  mbedtls_md5_init(&_ctx);
-  mbedtls_md5_starts_ret(&_ctx);
-  mbedtls_md5_update_ret(&_ctx, data, len);
-  mbedtls_md5_finish_ret(&_ctx, _buf);
-  for(i = 0; i < 16; i++) {
-    sprintf(output + (i * 2), "%02x", _buf[i]);
-  }
-  free(_buf);
-  return true;
+#define NONCE_LENGTH 32
+#define MD5_HEX_LENGTH (ESP_ROM_MD5_DIGEST_LEN * 2)
+
+struct DigestNonce {
+    char nonce[NONCE_LENGTH + 1];
+    uint32_t issued_ms;
+    uint32_t last_used_ms;
+
+    // Highest nonce count seen and a bitmap of the nonce counts max_nc - 0 to max_nc - 31 that were already used.
+    // Browsers send requests in parallel, so the nonce counts are not guaranteed to arrive in order.
+    uint32_t max_nc;
+    uint32_t nc_window;
+
+    // MD5 state after hashing "H(A1):nonce:" for the last successfully verified H(A1).
+    // This saves recalculating the first block of the response hash for each request of the session.
+    bool session_cached;
+    char ha1[MD5_HEX_LENGTH + 1];
+    md5_context_t session_ctx;
+};
+
+struct DigestHA2 {
+    char key[DIGEST_AUTH_HA2_KEY_LENGTH + 1];
+    char ha2[MD5_HEX_LENGTH + 1];
+};
+
+// Only accessed from the web server task.
+static DigestNonce nonces[DIGEST_AUTH_NONCE_COUNT] = {};
+static DigestHA2 ha2_cache[DIGEST_AUTH_HA2_CACHE_SIZE] = {};
+static size_t ha2_cache_next = 0;
+static bool last_nonce_stale = false;
+
+static void toHex(const uint8_t *data, size_t len, char *output)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; ++i) {
+        output[i * 2] = hex_digits[data[i] >> 4];
+        output[i * 2 + 1] = hex_digits[data[i] & 0x0F];
+    }
+    output[len * 2] = '\0';
 }
 
-static String genRandomString(){
-  uint8_t data[16] = {0};
-  uint32_t t = micros();
-  memcpy(data, &t, sizeof(t));
-  t = build_timestamp();
-  memcpy(data + 4, &t, sizeof(t));
-  uint32_t r = rand();
-  memcpy(data + 8, &r, sizeof(r));
-  r = rand();
-  memcpy(data + 12, &r, sizeof(r));
+// The MD5 implementation in the ROM is used: It does not allocate and the context is a POD that can be copied.
+static void md5Update(md5_context_t *ctx, const char *data)
+{
+    esp_rom_md5_update(ctx, data, strlen(data));
+}
 
-  char buf[33] = {0};
-  getMD5(data, 16, buf);
+static void md5Update(md5_context_t *ctx, const char *data, size_t len)
+{
+    esp_rom_md5_update(ctx, data, len);
+}
 
-  return String(buf);
+static void md5FinishHex(md5_context_t *ctx, char *output)
+{
+    uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+    esp_rom_md5_final(digest, ctx);
+    toHex(digest, sizeof(digest), output);
 }
 
-static String stringMD5(const String& in){
-  char * out = (char*)malloc(33);
-  if(out == NULL || !getMD5((uint8_t*)(in.c_str()), in.length(), out))
-    return "";
-  String res = String(out);
-  free(out);
-  return res;
+static void randomHex(char *output, size_t hex_len)
+{
+    uint8_t data[NONCE_LENGTH / 2];
+    esp_fill_random(data, hex_len / 2);
+    toHex(data, hex_len / 2, output);
+}
+
+static const char *issueNonce()
+{
+    DigestNonce *slot = &nonces[0];
+    for (size_t i = 0; i < DIGEST_AUTH_NONCE_COUNT; ++i) {
+        if (nonces[i].nonce[0] == '\0') {
+            slot = &nonces[i];
+            break;
+        }
+        if (a_after_b(slot->last_used_ms, nonces[i].last_used_ms))
+            slot = &nonces[i];
+    }
+
+    randomHex(slot->nonce, NONCE_LENGTH);
+
+    slot->issued_ms = millis();
+    slot->last_used_ms = slot->issued_ms;
+    slot->max_nc = 0;
+    slot->nc_window = 0;
+    slot->session_cached = false;
+
+    return slot->nonce;
+}
+
+static DigestNonce *findNonce(const char *nonce)
+{
+    if (strlen(nonce) != NONCE_LENGTH)
+        return nullptr;
+
+    for (size_t i = 0; i < DIGEST_AUTH_NONCE_COUNT; ++i) {
+        if (strcmp(nonce, nonces[i].nonce) == 0)
+            return &nonces[i];
+    }
+    return nullptr;
+}
+
+// Marks the nonce count as used. Returns false if it was used before or is too old to be tracked.
+static bool useNonceCount(DigestNonce *entry, uint32_t nc)
+{
+    if (nc == 0)
+        return false;
+
+    if (nc > entry->max_nc) {
+        uint32_t shift = nc - entry->max_nc;
+        entry->nc_window = shift >= 32 ? 0 : entry->nc_window << shift;
+        entry->nc_window |= 1;
+        entry->max_nc = nc;
+        return true;
+    }
+
+    uint32_t age = entry->max_nc - nc;
+    if (age >= 32 || (entry->nc_window & (1u << age)) != 0)
+        return false;
+
+    entry->nc_window |= 1u << age;
+    return true;
+}
+
+static bool parseNonceCount(const char *nc, uint32_t *result)
+{
+    if (strlen(nc) != 8)
+        return false;
+
+    char *end = nullptr;
+    *result = strtoul(nc, &end, 16);
+    return end == nc + 8;
+}
+
+// Status and API polling requests the same few URIs over and over again.
+static void getHA2(const char *method, const char *uri, char *output)
+{
+    char key[DIGEST_AUTH_HA2_KEY_LENGTH + 1];
+    int key_len = snprintf(key, sizeof(key), "%s:%s", method, uri);
+    bool cacheable = key_len > 0 && (size_t)key_len <= DIGEST_AUTH_HA2_KEY_LENGTH;
+
+    if (cacheable) {
+        for (size_t i = 0; i < DIGEST_AUTH_HA2_CACHE_SIZE; ++i) {
+            if (strcmp(ha2_cache[i].key, key) == 0) {
+                memcpy(output, ha2_cache[i].ha2, MD5_HEX_LENGTH + 1);
+                return;
+            }
+        }
+    }
+
+    md5_context_t ctx;
+    esp_rom_md5_init(&ctx);
+    md5Update(&ctx, method);
+    md5Update(&ctx, ":", 1);
+    md5Update(&ctx, uri);
+    md5FinishHex(&ctx, output);
+
+    if (!cacheable)
+        return;
+
+    DigestHA2 *slot = &ha2_cache[ha2_cache_next];
+    ha2_cache_next = (ha2_cache_next + 1) % DIGEST_AUTH_HA2_CACHE_SIZE;
+    memcpy(slot->key, key, key_len + 1);
+    memcpy(slot->ha2, output, MD5_HEX_LENGTH + 1);
+}
+
+static void getHA1(const char *username, const char *realm, const char *password, char *output)
+{
+    md5_context_t ctx;
+    esp_rom_md5_init(&ctx);
+    md5Update(&ctx, username);
+    md5Update(&ctx, ":", 1);
+    md5Update(&ctx, realm);
+    md5Update(&ctx, ":", 1);
+    md5Update(&ctx, password);
+    md5FinishHex(&ctx, output);
 }
 
 String requestDigestAuthentication(const char * realm){
+  char opaque[NONCE_LENGTH + 1];
+  randomHex(opaque, NONCE_LENGTH);
+
   String header = "realm=\"";
   if(realm == NULL)
     header.concat(DEFAULT_REALM);
   else
     header.concat(realm);
   header.concat( "\", qop=\"auth\", nonce=\"");
-  header.concat(genRandomString());
+  header.concat(issueNonce());
   header.concat("\", opaque=\"");
-  header.concat(genRandomString());
+  header.concat(opaque);
   header.concat("\"");
+  if (last_nonce_stale) {
+    header.concat(", stale=TRUE");
+    last_nonce_stale = false;
+  }
   return header;
 }
 
-AuthFields parseDigestAuth(const char *header)
+static bool nameIs(const char *name, size_t name_len, const char *expected)
+{
+    return strlen(expected) == name_len && memcmp(name, expected, name_len) == 0;
+}
+
+AuthFields parseDigestAuth(char *header)
 {
-    AuthFields result;
-    result.success = false;
+    AuthFields result = {"", "", "", "", "", "", "", "", "", false};
 
     if (header == nullptr) {
         logger.printfln("AUTH FAIL: missing required fields");
         return result;
     }
 
-    String myHeader = String(header);
-    int nextBreak = myHeader.indexOf(",");
-    if (nextBreak < 0) {
-        logger.printfln("AUTH FAIL: no variables");
-        return result;
-    }
+    bool found_variable = false;
+    char *p = header;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        if (*p == '\0')
+            break;
 
-    myHeader += ", ";
-    do {
-        String avLine = myHeader.substring(0, nextBreak);
-        avLine.trim();
-        myHeader = myHeader.substring(nextBreak + 1);
-        nextBreak = myHeader.indexOf(",");
+        const char *name = p;
+        while (*p != '\0' && *p != '=' && *p != ' ' && *p != '\t' && *p != ',')
+            ++p;
+        size_t name_len = p - name;
 
-        int eqSign = avLine.indexOf("=");
-        if (eqSign < 0) {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (*p != '=') {
             logger.printfln("AUTH FAIL: no = sign");
             return result;
         }
+        ++p;
+        while (*p == ' ' || *p == '\t')
+            ++p;
 
-        String varName = avLine.substring(0, eqSign);
-        avLine = avLine.substring(eqSign + 1);
-        if (avLine.startsWith("\"")) {
-            avLine = avLine.substring(1, avLine.length() - 1);
+        // Values are unquoted and terminated in place, so that the fields can point into the header.
+        const char *value = p;
+        if (*p == '"') {
+            value = ++p;
+            char *out = p;
+            while (*p != '\0' && *p != '"') {
+                if (*p == '\\' && p[1] != '\0')
+                    ++p;
+                *out++ = *p++;
+            }
+            if (*p != '"') {
+                logger.printfln("AUTH FAIL: unterminated quoted string");
+                return result;
+            }
+            ++p;
+            *out = '\0';
+        } else {
+            while (*p != '\0' && *p != ',' && *p != ' ' && *p != '\t')
+                ++p;
+            if (*p != '\0')
+                *p++ = '\0';
         }
 
-        if (varName.equals("username")) {
-            result.username = avLine;
-        } else if (varName.equals("realm")) {
-            result.realm = avLine;
-        } else if (varName.equals("nonce")) {
-            result.nonce = avLine;
-        } else if (varName.equals("opaque")) {
-            result.opaque = avLine;
-        } else if (varName.equals("uri")) {
-            result.uri = avLine;
-        } else if (varName.equals("response")) {
-            result.response = avLine;
-        } else if (varName.equals("qop")) {
-            result.qop = avLine;
-        } else if (varName.equals("nc")) {
-            result.nc = avLine;
-        } else if (varName.equals("cnonce")) {
-            result.cnonce = avLine;
+        found_variable = true;
+
+        if (nameIs(name, name_len, "username")) {
+            result.username = value;
+        } else if (nameIs(name, name_len, "realm")) {
+            result.realm = value;
+        } else if (nameIs(name, name_len, "nonce")) {
+            result.nonce = value;
+        } else if (nameIs(name, name_len, "opaque")) {
+            result.opaque = value;
+        } else if (nameIs(name, name_len, "uri")) {
+            result.uri = value;
+        } else if (nameIs(name, name_len, "response")) {
+            result.response = value;
+        } else if (nameIs(name, name_len, "qop")) {
+            result.qop = value;
+        } else if (nameIs(name, name_len, "nc")) {
+            result.nc = value;
+        } else if (nameIs(name, name_len, "cnonce")) {
+            result.cnonce = value;
         }
-    } while (nextBreak > 0);
+    }
+
+    if (!found_variable) {
+        logger.printfln("AUTH FAIL: no variables");
+        return result;
+    }
 
     result.success = true;
     return result;
 }
 
-bool checkDigestAuthentication(AuthFields fields, const char * method, const char * username, const char * password, const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri){
-    if (username == NULL || password == NULL || method == NULL) {
+bool checkDigestAuthentication(const AuthFields &fields, const char * method, const char * username, const char * password, const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri){
+    last_nonce_stale = false;
+
+    if (!fields.success || username == NULL || password == NULL || method == NULL) {
         logger.printfln("AUTH FAIL: missing required fields");
         return false;
     }
 
-    if (!fields.username.equals(username)) {
+    if (strcmp(fields.username, username) != 0) {
         logger.printfln("AUTH FAIL: username");
         return false;
     }
 
-    if (realm != NULL && !fields.realm.equals(realm)) {
+    if (realm != NULL && strcmp(fields.realm, realm) != 0) {
         logger.printfln("AUTH FAIL: realm");
         return false;
-    } else if (realm == NULL && !fields.realm.equals(DEFAULT_REALM) && !fields.realm.equals("asyncesp")) {
+    } else if (realm == NULL && strcmp(fields.realm, DEFAULT_REALM) != 0 && strcmp(fields.realm, "asyncesp") != 0) {
         logger.printfln("AUTH FAIL: realm");
         return false;
     }
 
-    if (nonce != NULL && !fields.nonce.equals(nonce)) {
+    if (nonce != NULL && strcmp(fields.nonce, nonce) != 0) {
         logger.printfln("AUTH FAIL: nonce");
         return false;
     }
 
-    if (opaque != NULL && !fields.opaque.equals(opaque)) {
+    if (opaque != NULL && strcmp(fields.opaque, opaque) != 0) {
         logger.printfln("AUTH FAIL: opaque");
         return false;
     }
-    if (uri != NULL && !fields.uri.equals(uri)) {
+    if (uri != NULL && strcmp(fields.uri, uri) != 0) {
         logger.printfln("AUTH FAIL: uri");
         return false;
     }
 
-    String ha1 = (passwordIsHash) ? String(password) : stringMD5(fields.username + ":" + fields.realm + ":" + String(password));
-    String ha2 = String(method) + ":" + fields.uri;
-    String response = ha1 + ":" + fields.nonce + ":" + fields.nc + ":" + fields.cnonce + ":" + fields.qop + ":" + stringMD5(ha2);
+    // We only ever offer qop="auth", so RFC 2069 style responses without nonce count are not accepted.
+    if (strcmp(fields.qop, "auth") != 0) {
+        logger.printfln("AUTH FAIL: qop");
+        return false;
+    }
+
+    uint32_t nc;
+    if (!parseNonceCount(fields.nc, &nc)) {
+        logger.printfln("AUTH FAIL: nonce count");
+        return false;
+    }
+
+    char ha1_buf[MD5_HEX_LENGTH + 1];
+    const char *ha1 = password;
+    if (!passwordIsHash) {
+        getHA1(fields.username, fields.realm, password, ha1_buf);
+        ha1 = ha1_buf;
+    }
+
+    DigestNonce *entry = nullptr;
+    bool stale = false;
+    if (nonce == NULL) {
+        entry = findNonce(fields.nonce);
+        stale = entry == nullptr || deadline_elapsed(entry->issued_ms + DIGEST_AUTH_NONCE_LIFETIME_MS);
+        if (stale)
+            entry = nullptr;
+    }
+
+    bool session_hit = entry != nullptr && entry->session_cached && strcmp(ha1, entry->ha1) == 0;
+
+    md5_context_t session_ctx;
+    if (session_hit) {
+        session_ctx = entry->session_ctx;
+    } else {
+        esp_rom_md5_init(&session_ctx);
+        md5Update(&session_ctx, ha1);
+        md5Update(&session_ctx, ":", 1);
+        md5Update(&session_ctx, fields.nonce);
+        md5Update(&session_ctx, ":", 1);
+    }
+
+    char ha2[MD5_HEX_LENGTH + 1];
+    getHA2(method, fields.uri, ha2);
+
+    md5_context_t ctx = session_ctx;
+    md5Update(&ctx, fields.nc);
+    md5Update(&ctx, ":", 1);
+    md5Update(&ctx, fields.cnonce);
+    md5Update(&ctx, ":", 1);
+    md5Update(&ctx, fields.qop);
+    md5Update(&ctx, ":", 1);
+    md5Update(&ctx, ha2, MD5_HEX_LENGTH);
+
+    char response[MD5_HEX_LENGTH + 1];
+    md5FinishHex(&ctx, response);
+
+    if (strcmp(fields.response, response) != 0) {
+        logger.printfln("AUTH FAIL: password");
+        return false;
+    }
+
+    if (stale) {
+        // The credentials are correct, but the nonce is unknown (for example after a reboot) or expired.
+        // Don't log this: The client will retry with the new nonce sent with stale=TRUE.
+        last_nonce_stale = true;
+        return false;
+    }
 
-    if (fields.response.equals(stringMD5(response))) {
+    if (entry == nullptr)
         return true;
+
+    if (!useNonceCount(entry, nc)) {
+        logger.printfln("AUTH FAIL: nonce count reused");
+        return false;
+    }
+
+    if (!session_hit && strlen(ha1) == MD5_HEX_LENGTH) {
+        entry->session_ctx = session_ctx;
+        memcpy(entry->ha1, ha1, MD5_HEX_LENGTH + 1);
+        entry->session_cached = true;
     }
 
-    logger.printfln("AUTH FAIL: password");
-    return false;
+    entry->last_used_ms = millis();
+    return true;
 }
 
 String generateDigestHash(const char * username, const char * password, const char * realm){
@@ -200,5 +448,7 @@ String generateDigestHash(const char * username, const char * password, const ch
     return "";
   }
 
-  return stringMD5(String(username) + ':' + realm + ':' + password);
+  char ha1[MD5_HEX_LENGTH + 1];
+  getHA1(username, realm, password, ha1);
+  return String(ha1);
 }
@@ -29,25 +29,41 @@
 
 #define DEFAULT_REALM "esp32-lib"
 
+// Number of nonces handed out in WWW-Authenticate challenges that are remembered
+// at the same time. The least recently used nonce is replaced if a new one is required.
+#define DIGEST_AUTH_NONCE_COUNT 16
+// Nonces older than this are rejected as stale. The client then retries
+// with a fresh nonce without asking the user for the credentials again.
+#define DIGEST_AUTH_NONCE_LIFETIME_MS (30 * 60 * 1000)
+// Number of cached H(A2) = MD5(method:uri) values and the maximum length of method:uri to be cached.
+#define DIGEST_AUTH_HA2_CACHE_SIZE 8
+#define DIGEST_AUTH_HA2_KEY_LENGTH 64
+
+// All fields point into the header passed to parseDigestAuth
+// and are only valid as long as the header buffer is.
 typedef struct AuthFields {
-    String username;
-    String realm;
-    String nonce;
-    String uri;
-    String response;
-    String qop;
-    String nc;
-    String cnonce;
+    const char *username;
+    const char *realm;
+    const char *nonce;
+    const char *uri;
+    const char *response;
+    const char *qop;
+    const char *nc;
+    const char *cnonce;
 
-    String opaque;
+    const char *opaque;
 
     bool success;
 } AuthFields;
 
-AuthFields parseDigestAuth(const char *header);
+// Parses the header in place: Values are unquoted and null-terminated inside of the header buffer.
+AuthFields parseDigestAuth(char *header);
 
+// Issues a new nonce. If the last failed check was only caused by a stale nonce, stale=TRUE is added to the challenge.
 String requestDigestAuthentication(const char * realm);
-bool checkDigestAuthentication(AuthFields fields, const char * method, const char * username, const char * password, const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri);
+// If nonce is NULL, the nonce sent by the client has to be one that was issued by requestDigestAuthentication
+// and the nonce count has to be unused. Otherwise the nonce sent by the client has to match the passed nonce.
+bool checkDigestAuthentication(const AuthFields &fields, const char * method, const char * username, const char * password, const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri);
 
 //for storing hashed versions on the device that can be authenticated against
 String generateDigestHash(const char * username, const char * password, const char * realm);
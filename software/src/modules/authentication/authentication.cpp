@@ -69,10 +69,10 @@ void Authentication::setup()
                 return false;
             }
 
-            auth = auth.substring(7);
-            AuthFields fields = parseDigestAuth(auth.c_str());
+            // Parsed in place after the "Digest " prefix.
+            AuthFields fields = parseDigestAuth(auth.begin() + 7);
 
-            if (fields.username != user)
+            if (!user.equals(fields.username))
                 return false;
 
             return checkDigestAuthentication(fields, req.methodString(), user.c_str(), digest_hash.c_str(), DEFAULT_REALM, true, nullptr, nullptr, nullptr);
@@ -39,9 +39,6 @@ extern API api;
 extern TaskScheduler task_scheduler;
 extern char local_uid_str[32];
 
-// Keep in sync with cm_networing.h
-#define MAX_CLIENTS 10
-
 #define CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE 128
 #define CHARGE_MANAGER_ERROR_EVSE_UNREACHABLE 129
 #define CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE 130
@@ -60,6 +57,21 @@ static char distribution_log[DISTRIBUTION_LOG_LEN] = {0};
 
 #define WATCHDOG_TIMEOUT_MS 30000
 
+// Every charger receives one update per CM_SEND_CYCLE_MS. The updates are spread
+// evenly over the cycle, sending at most every CM_SEND_MIN_INTERVAL_MS,
+// so that the cycle does not depend on the number of chargers.
+#define CM_SEND_CYCLE_MS 1000
+#define CM_SEND_MIN_INTERVAL_MS 100
+
+// The current is distributed if a charger state or the available current changed,
+// but at most once per DISTRIBUTION_MIN_INTERVAL_MS and at least once per DISTRIBUTION_INTERVAL_MS.
+#define DISTRIBUTION_MIN_INTERVAL_MS 1000
+#define DISTRIBUTION_INTERVAL_MS 10000
+
+// Time for chargers to adapt to a smaller limit before other chargers are unthrottled.
+// The standard requires cars to react in 5 seconds.
+#define THROTTLE_SETTLE_MS 10000
+
 #if MODULE_ENERGY_MANAGER_AVAILABLE()
 static void apply_enegry_manager_config(Config &conf)
 {
@@ -139,6 +151,16 @@ void ChargeManager::pre_setup()
     }};
 }
 
+template<typename T, typename U>
+static bool update_field(T &field, U value)
+{
+    if (field == (T)value)
+        return false;
+
+    field = value;
+    return true;
+}
+
 uint8_t get_charge_state(uint8_t charger_state, uint16_t supported_current, uint32_t charging_time, uint16_t target_allocated_current)
 {
     if (charger_state == 0) // not connected
@@ -192,9 +214,13 @@ void ChargeManager::start_manager_task()
                 logger.printfln("Received stale charger state from %s (%s). Reported EVSE uptime (%u) is the same as in the last state. Is the EVSE still reachable?",
                     chargers[client_id].get("name")->asEphemeralCStr(), chargers[client_id].get("host")->asEphemeralCStr(),
                     uptime);
-                if (deadline_elapsed(target.get("last_update")->asUint() + 10000)) {
-                    target.get("state")->updateUint(5);
-                    target.get("error")->updateUint(CHARGE_MANAGER_ERROR_EVSE_UNREACHABLE);
+                if (deadline_elapsed(charger_table.last_update[client_id] + 10000)) {
+                    bool changed = update_field(charger_table.state[client_id], 5);
+                    changed |= update_field(charger_table.error[client_id], CHARGE_MANAGER_ERROR_EVSE_UNREACHABLE);
+                    if (changed) {
+                        publish_charger(client_id);
+                        request_distribution();
+                    }
                 }
 
                 return;
@@ -202,60 +228,91 @@ void ChargeManager::start_manager_task()
 
             target.get("uptime")->updateUint(uptime);
 
+            // Only changes that influence the distribution request one.
+            bool changed = false;
+
             // A charger wants to charge if:
             // - the charging time is 0 (it has not charged this vehicle yet), no other slot blocks and we are still in charger state 1 (i.e. blocked by a slot, so the charge management slot)
             // - OR the charger waits for the vehicle to start charging
             // - OR the charger is already charging
             bool wants_to_charge = (charging_time == 0 && supported_current != 0 && charger_state == 1) || charger_state == 2 || charger_state == 3;
-            target.get("wants_to_charge")->updateBool(wants_to_charge);
 
             // A charger wants to charge and has low priority if it has already charged this vehicle and only the charge manager slot blocks.
             bool low_prio = charging_time != 0 && supported_current != 0 && charger_state == 1;
-            target.get("wants_to_charge_low_priority")->updateBool(low_prio);
 
-            target.get("is_charging")->updateBool(charger_state == 3);
-            target.get("allowed_current")->updateUint(allowed_charging_current);
-            target.get("supported_current")->updateUint(supported_current);
-            target.get("last_update")->updateUint(millis());
+            uint8_t flags = (wants_to_charge ? CHARGER_FLAG_WANTS_TO_CHARGE : 0)
+                          | (low_prio ? CHARGER_FLAG_WANTS_TO_CHARGE_LOW_PRIORITY : 0)
+                          | (charger_state == 3 ? CHARGER_FLAG_IS_CHARGING : 0);
+
+            changed |= update_field(charger_table.flags[client_id], flags);
+            changed |= update_field(charger_table.allowed_current[client_id], allowed_charging_current);
+            changed |= update_field(charger_table.supported_current[client_id], supported_current);
+            charger_table.last_update[client_id] = millis();
+
+            uint8_t &current_error = charger_table.error[client_id];
+            uint8_t last_error = current_error;
 
             if (error_state != 0) {
-                target.get("error")->updateUint(CHARGE_MANAGER_CLIENT_ERROR_START + error_state);
+                current_error = CHARGE_MANAGER_CLIENT_ERROR_START + error_state;
             }
 
-            auto current_error = target.get("error")->asUint();
             if (current_error < 128 || current_error == CHARGE_MANAGER_ERROR_EVSE_UNREACHABLE) {
-                target.get("error")->updateUint(0);
+                current_error = 0;
             }
 
-            current_error = target.get("error")->asUint();
+            changed |= current_error != last_error;
+
             if (current_error == 0 || current_error >= CHARGE_MANAGER_CLIENT_ERROR_START)
-                target.get("state")->updateUint(get_charge_state(charger_state,
-                                                                 supported_current,
-                                                                 charging_time,
-                                                                 target.get("allocated_current")->asUint()));
+                charger_table.state[client_id] = get_charge_state(charger_state,
+                                                                  supported_current,
+                                                                  charging_time,
+                                                                  charger_table.allocated_current[client_id]);
+
+            publish_charger(client_id);
             charge_manager_state.get("uptime")->updateUint(millis());
+
+            if (changed)
+                request_distribution();
     }, [this](uint8_t client_id, uint8_t error){
-        Config &target = charge_manager_state.get("chargers")->asArray()[client_id];
-        target.get("state")->updateUint(5);
-        target.get("error")->updateUint(error);
+        bool changed = update_field(charger_table.state[client_id], 5);
+        changed |= update_field(charger_table.error[client_id], error);
+        if (changed) {
+            publish_charger(client_id);
+            request_distribution();
+        }
     });
 
-    uint32_t cm_send_delay = 1000 / chargers.size();
+    // Split the cycle into ticks and send to the chargers whose turn is in the
+    // current tick. With up to CM_SEND_CYCLE_MS / CM_SEND_MIN_INTERVAL_MS
+    // chargers this is one charger per tick.
+    size_t charger_count = chargers.size();
+    size_t ticks = std::min(charger_count, (size_t)(CM_SEND_CYCLE_MS / CM_SEND_MIN_INTERVAL_MS));
+    uint32_t send_interval = CM_SEND_CYCLE_MS / ticks;
 
-    task_scheduler.scheduleWithFixedDelay([this, chargers](){
-        static int i = 0;
+    task_scheduler.scheduleWithFixedDelay([this, charger_count, ticks](){
+        static size_t tick = 0;
+        static size_t next = 0;
 
-        if (i >= chargers.size())
-            i = 0;
+        size_t end = charger_count * (tick + 1) / ticks;
 
-        Config &state = charge_manager_state.get("chargers")->asArray()[i];
-        if(cm_networking.send_manager_update(i, state.get("allocated_current")->asUint()))
-            ++i;
+        // Retry a charger in the next tick if the send buffer is full.
+        for (; next < end; ++next)
+            if (!cm_networking.send_manager_update(next, charger_table.allocated_current[next]))
+                break;
 
-    }, cm_send_delay, cm_send_delay);
-}
+        if (tick + 1 < ticks) {
+            ++tick;
+            return;
+        }
+
+        // Start the next cycle only when every charger got its update.
+        if (next < charger_count)
+            return;
 
-int idx_array[MAX_CLIENTS] = {0};
+        tick = 0;
+        next = 0;
+    }, send_interval, send_interval);
+}
 
 void ChargeManager::setup()
 {
@@ -278,18 +335,22 @@ void ChargeManager::setup()
     charge_manager_state.get("state")->updateUint(1);
 
     charge_manager_available_current.get("current")->updateUint(charge_manager_config_in_use.get("default_available_current")->asUint());
-    for (int i = 0; i < charge_manager_config_in_use.get("chargers")->asArray().size(); ++i) {
+
+    size_t charger_count = charge_manager_config_in_use.get("chargers")->asArray().size();
+    charger_table.resize(charger_count);
+    idx_array.resize(charger_count);
+    current_array.resize(charger_count);
+
+    for (int i = 0; i < charger_count; ++i) {
         charge_manager_state.get("chargers")->add();
         charge_manager_state.get("chargers")->get(i)->get("name")->updateString(charge_manager_config_in_use.get("chargers")->get(i)->get("name")->asString());
         idx_array[i] = i;
     }
 
-    for (int i = charge_manager_config_in_use.get("chargers")->asArray().size(); i < MAX_CLIENTS; ++i)
-        idx_array[i] = -1;
-
     start_manager_task();
 
-    task_scheduler.scheduleWithFixedDelay([this](){this->distribute_current();}, 10000, 10000);
+    last_distribution = millis();
+    task_scheduler.scheduleWithFixedDelay([this](){this->check_distribution();}, 100, 100);
 
     if (charge_manager_config_in_use.get("enable_watchdog")->asBool()) {
         task_scheduler.scheduleWithFixedDelay([this](){this->check_watchdog();}, 1000, 1000);
@@ -307,12 +368,54 @@ void ChargeManager::check_watchdog()
 
     logger.printfln("Charge manager watchdog triggered! Received no available current update for %d ms. Setting available current to %u mA", WATCHDOG_TIMEOUT_MS, default_available_current);
 
-    this->charge_manager_available_current.get("current")->updateUint(default_available_current);
+    if (this->charge_manager_available_current.get("current")->updateUint(default_available_current))
+        request_distribution();
 
     last_available_current_update = millis();
 }
 
-#define LOCAL_LOG(fmt, ...) if(verbose) local_log += snprintf(local_log, DISTRIBUTION_LOG_LEN - (local_log - distribution_log), "    " fmt "%c", __VA_ARGS__, '\0');
+void ChargeManager::publish_charger(size_t charger)
+{
+    Config &target = charge_manager_state.get("chargers")->asArray()[charger];
+
+    target.get("last_update")->updateUint(charger_table.last_update[charger]);
+    target.get("supported_current")->updateUint(charger_table.supported_current[charger]);
+    target.get("allowed_current")->updateUint(charger_table.allowed_current[charger]);
+    target.get("wants_to_charge")->updateBool(charger_table.flags[charger] & CHARGER_FLAG_WANTS_TO_CHARGE);
+    target.get("wants_to_charge_low_priority")->updateBool(charger_table.flags[charger] & CHARGER_FLAG_WANTS_TO_CHARGE_LOW_PRIORITY);
+    target.get("is_charging")->updateBool(charger_table.flags[charger] & CHARGER_FLAG_IS_CHARGING);
+    target.get("last_sent_config")->updateUint(charger_table.last_sent_config[charger]);
+    target.get("allocated_current")->updateUint(charger_table.allocated_current[charger]);
+    target.get("state")->updateUint(charger_table.state[charger]);
+    target.get("error")->updateUint(charger_table.error[charger]);
+}
+
+void ChargeManager::request_distribution()
+{
+    distribution_requested = true;
+}
+
+void ChargeManager::check_distribution()
+{
+    if (distribution_requested) {
+        if (!deadline_elapsed(last_distribution + DISTRIBUTION_MIN_INTERVAL_MS))
+            return;
+    } else if (!deadline_elapsed(last_distribution + DISTRIBUTION_INTERVAL_MS)) {
+        return;
+    }
+
+    distribution_requested = false;
+    last_distribution = millis();
+    distribute_current();
+}
+
+// Lines that don't fit into distribution_log anymore are dropped.
+#define LOCAL_LOG(fmt, ...) if(verbose) { \
+        size_t log_left = DISTRIBUTION_LOG_LEN - (local_log - distribution_log); \
+        int log_len = snprintf(local_log, log_left, "    " fmt "%c", __VA_ARGS__, '\0'); \
+        if (log_len > 0 && (size_t)log_len < log_left) \
+            local_log += log_len; \
+    }
 
 void ChargeManager::distribute_current()
 {
@@ -325,10 +428,12 @@ void ChargeManager::distribute_current()
     if (verbose)
         local_log += snprintf(local_log, DISTRIBUTION_LOG_LEN - (local_log - distribution_log), "Redistributing current%c", '\0');
 
-    auto &chargers = charge_manager_state.get("chargers")->asArray();
+    charger_table_t &chargers = charger_table;
     auto &configs = charge_manager_config_in_use.get("chargers")->asArray();
 
-    uint32_t current_array[MAX_CLIENTS] = {0};
+    size_t charger_count = chargers.count();
+
+    std::fill(current_array.begin(), current_array.end(), 0);
 
     // Handle unreachable EVSEs
     {
@@ -337,48 +442,47 @@ void ChargeManager::distribute_current()
         // If any EVSE is unreachable or in another error state, we set the available current to 0.
         // The distribution algorithm can then run normally and will block all chargers.
         bool unreachable_evse_found = false;
-        for (int i = 0; i < chargers.size(); ++i) {
-            auto &charger = chargers[i];
+        for (int i = 0; i < charger_count; ++i) {
             auto &charger_cfg = configs[i];
 
-            auto charger_error = charger.get("error")->asUint();
+            auto charger_error = chargers.error[i];
             if (charger_error != CM_NETWORKING_ERROR_NO_ERROR &&
                 charger_error != CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE &&
                 charger_error != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE &&
                 charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
                 unreachable_evse_found = true;
-                LOCAL_LOG("stage 0: %s (%s) reports error %u.", charger_cfg.get("name")->asEphemeralCStr(), charger_cfg.get("host")->asEphemeralCStr(), charger.get("error")->asUint());
+                LOCAL_LOG("stage 0: %s (%s) reports error %u.", charger_cfg.get("name")->asEphemeralCStr(), charger_cfg.get("host")->asEphemeralCStr(), chargers.error[i]);
 
                 print_local_log = !last_print_local_log_was_error;
                 last_print_local_log_was_error = true;
             }
 
             // Charger does not respond anymore
-            if (deadline_elapsed(charger.get("last_update")->asUint() + TIMEOUT_MS)) {
+            if (deadline_elapsed(chargers.last_update[i] + TIMEOUT_MS)) {
                 unreachable_evse_found = true;
                 LOCAL_LOG("stage 0: Can't reach EVSE of %s (%s): last_update too old.",charger_cfg.get("name")->asEphemeralCStr(), charger_cfg.get("host")->asEphemeralCStr());
 
-                if (chargers[i].get("state")->updateUint(5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
-                    chargers[i].get("error")->updateUint(CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE);
+                if (update_field(chargers.state[i], 5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
+                    chargers.error[i] = CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE;
                     print_local_log = !last_print_local_log_was_error;
                     last_print_local_log_was_error = true;
                 }
-            } else if (chargers[i].get("error")->asUint() == CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE) {
-                chargers[i].get("error")->updateUint(CM_NETWORKING_ERROR_NO_ERROR);
+            } else if (chargers.error[i] == CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE) {
+                chargers.error[i] = CM_NETWORKING_ERROR_NO_ERROR;
             }
 
             // Charger did not update the charging current in time
-            if(charger.get("allocated_current")->asUint() < charger.get("allowed_current")->asUint() && deadline_elapsed(charger.get("last_sent_config")->asUint() + TIMEOUT_MS)) {
+            if(chargers.allocated_current[i] < chargers.allowed_current[i] && deadline_elapsed(chargers.last_sent_config[i] + TIMEOUT_MS)) {
                 unreachable_evse_found = true;
                 LOCAL_LOG("stage 0: EVSE of %s (%s) did not react in time.", charger_cfg.get("name")->asEphemeralCStr(), charger_cfg.get("host")->asEphemeralCStr());
 
-                if (chargers[i].get("state")->updateUint(5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
-                    chargers[i].get("error")->updateUint(CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE);
+                if (update_field(chargers.state[i], 5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
+                    chargers.error[i] = CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE;
                     print_local_log = !last_print_local_log_was_error;
                     last_print_local_log_was_error = true;
                 }
-            } else if (chargers[i].get("error")->asUint() == CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE) {
-                chargers[i].get("error")->updateUint(CM_NETWORKING_ERROR_NO_ERROR);
+            } else if (chargers.error[i] == CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE) {
+                chargers.error[i] = CM_NETWORKING_ERROR_NO_ERROR;
             }
         }
 
@@ -404,8 +508,8 @@ void ChargeManager::distribute_current()
         // Sorting by the minimum current allows us to distribute the current "perfectly"
         // with a single pass over the chargers.
         int chargers_requesting_current = 0;
-        for (auto &charger : chargers) {
-            if (!charger.get("is_charging")->asBool() && !charger.get("wants_to_charge")->asBool()) {
+        for (int i = 0; i < charger_count; ++i) {
+            if ((chargers.flags[i] & (CHARGER_FLAG_IS_CHARGING | CHARGER_FLAG_WANTS_TO_CHARGE)) == 0) {
                 continue;
             }
             ++chargers_requesting_current;
@@ -417,13 +521,13 @@ void ChargeManager::distribute_current()
                   chargers_requesting_current == 1 ? "s" : "",
                   available_current);
 
-        std::stable_sort(idx_array, idx_array + chargers.size(), [&chargers](int left, int right) {
-            return chargers[left].get("supported_current")->asUint() < chargers[right].get("supported_current")->asUint();
+        std::stable_sort(idx_array.begin(), idx_array.end(), [&chargers](int left, int right) {
+            return chargers.supported_current[left] < chargers.supported_current[right];
         });
 
-        std::stable_sort(idx_array, idx_array + chargers.size(), [&chargers](int left, int right) {
-            bool left_charging = chargers[left].get("is_charging")->asBool();
-            bool right_charging = chargers[right].get("is_charging")->asBool();
+        std::stable_sort(idx_array.begin(), idx_array.end(), [&chargers](int left, int right) {
+            bool left_charging = chargers.flags[left] & CHARGER_FLAG_IS_CHARGING;
+            bool right_charging = chargers.flags[right] & CHARGER_FLAG_IS_CHARGING;
             return left_charging && !right_charging;
         });
     }
@@ -436,16 +540,16 @@ void ChargeManager::distribute_current()
         int chargers_allocated_current_to = 0;
 
         uint16_t current_to_set = charge_manager_config_in_use.get("minimum_current")->asUint();
-        for (int i = 0; i < chargers.size(); ++i) {
-            auto &charger = chargers[idx_array[i]];
+        for (int i = 0; i < charger_count; ++i) {
+            int charger = idx_array[i];
 
-            if (!charger.get("is_charging")->asBool() && !charger.get("wants_to_charge")->asBool()) {
+            if ((chargers.flags[charger] & (CHARGER_FLAG_IS_CHARGING | CHARGER_FLAG_WANTS_TO_CHARGE)) == 0) {
                 continue;
             }
 
-            auto &charger_cfg = configs[idx_array[i]];
+            auto &charger_cfg = configs[charger];
 
-            uint16_t supported_current = charger.get("supported_current")->asUint();
+            uint16_t supported_current = chargers.supported_current[charger];
             if (supported_current < current_to_set) {
                 LOCAL_LOG("stage 0: Can't unblock %s (%s): It only supports %u mA, but %u mA is the configured minimum current.",
                           charger_cfg.get("name")->asEphemeralCStr(),
@@ -464,7 +568,7 @@ void ChargeManager::distribute_current()
                 ++chargers_allocated_current_to;
             }
 
-            current_array[idx_array[i]] = current_to_set;
+            current_array[charger] = current_to_set;
             available_current -= current_to_set;
 
             LOCAL_LOG("stage 0: Calculated target for %s (%s) of %u mA. %u mA left.",
@@ -478,30 +582,31 @@ void ChargeManager::distribute_current()
             LOCAL_LOG("stage 0: %u mA still available. Recalculating targets.", available_current);
 
             int chargers_reallocated = 0;
-            for (int i = 0; i < chargers.size(); ++i) {
-                if (current_array[idx_array[i]] == 0)
+            for (int i = 0; i < charger_count; ++i) {
+                int charger = idx_array[i];
+
+                if (current_array[charger] == 0)
                     continue;
 
-                auto &charger = chargers[idx_array[i]];
                 uint16_t current_per_charger = MIN(32000, available_current / (chargers_allocated_current_to - chargers_reallocated));
 
-                uint16_t supported_current = charger.get("supported_current")->asUint();
+                uint16_t supported_current = chargers.supported_current[charger];
                 // Protect against overflow.
-                if (supported_current < current_array[idx_array[i]])
+                if (supported_current < current_array[charger])
                     continue;
 
-                uint16_t current_to_add = MIN(supported_current - current_array[idx_array[i]], current_per_charger);
+                uint16_t current_to_add = MIN(supported_current - current_array[charger], current_per_charger);
 
                 ++chargers_reallocated;
 
-                current_array[idx_array[i]] += current_to_add;
+                current_array[charger] += current_to_add;
                 available_current -= current_to_add;
 
-                auto &charger_cfg = configs[idx_array[i]];
+                auto &charger_cfg = configs[charger];
                 LOCAL_LOG("stage 0: Recalculated target for %s (%s) of %u mA. %u mA left.",
                           charger_cfg.get("name")->asEphemeralCStr(),
                           charger_cfg.get("host")->asEphemeralCStr(),
-                          current_array[idx_array[i]],
+                          current_array[charger],
                           available_current);
             }
         }
@@ -513,16 +618,16 @@ void ChargeManager::distribute_current()
             LOCAL_LOG("stage 0: %u mA still available. Attempting to wake up chargers that already charged their vehicle once.", available_current);
 
             uint16_t current_to_set = charge_manager_config_in_use.get("minimum_current")->asUint();
-            for (int i = 0; i < chargers.size(); ++i) {
-                auto &charger = chargers[idx_array[i]];
+            for (int i = 0; i < charger_count; ++i) {
+                int charger = idx_array[i];
 
-                if (!charger.get("wants_to_charge_low_priority")->asBool()) {
+                if ((chargers.flags[charger] & CHARGER_FLAG_WANTS_TO_CHARGE_LOW_PRIORITY) == 0) {
                     continue;
                 }
 
-                auto &charger_cfg = configs[idx_array[i]];
+                auto &charger_cfg = configs[charger];
 
-                uint16_t supported_current = charger.get("supported_current")->asUint();
+                uint16_t supported_current = chargers.supported_current[charger];
                 if (supported_current < current_to_set) {
                     LOCAL_LOG("stage 0: Can't unblock %s (%s): It only supports %u mA, but %u mA is the configured minimum current.",
                               charger_cfg.get("name")->asEphemeralCStr(),
@@ -541,7 +646,7 @@ void ChargeManager::distribute_current()
                     ++chargers_allocated_current_to;
                 }*/
 
-                current_array[idx_array[i]] = current_to_set;
+                current_array[charger] = current_to_set;
                 available_current -= current_to_set;
 
                 LOCAL_LOG("stage 0: Calculated target for %s (%s) of %u mA. %u mA left.",
@@ -560,13 +665,11 @@ void ChargeManager::distribute_current()
         // stage if even one charger needs to be throttled to be sure that the available current
         // is never exceeded.
         bool skip_stage_2 = false;
-        for (int i = 0; i < chargers.size(); ++i) {
-            auto &charger = chargers[i];
-
+        for (int i = 0; i < charger_count; ++i) {
             auto &charger_cfg = configs[i];
             uint16_t current_to_set = current_array[i];
 
-            bool will_throttle = current_to_set < charger.get("allocated_current")->asUint() || current_to_set < charger.get("allowed_current")->asUint();
+            bool will_throttle = current_to_set < chargers.allocated_current[i] || current_to_set < chargers.allowed_current[i];
 
             if (!will_throttle) {
                 continue;
@@ -577,10 +680,10 @@ void ChargeManager::distribute_current()
                       charger_cfg.get("host")->asEphemeralCStr(),
                       current_to_set);
 
-            if (charger.get("allocated_current")->updateUint(current_to_set)) {
+            if (update_field(chargers.allocated_current[i], current_to_set)) {
                 print_local_log = true;
-                if (charger.get("error")->asUint() != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
-                    charger.get("last_sent_config")->updateUint(millis());
+                if (chargers.error[i] != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
+                    chargers.last_sent_config[i] = millis();
             }
 
             // Skip stage 2 to wait for the charger to adapt to the now smaller limit.
@@ -588,23 +691,29 @@ void ChargeManager::distribute_current()
             // react in 5 seconds.
             // More correct would be to detect whether the throttled current limit
             // was accepted by the box more than 5 seconds ago (so that we can be sure the timing fits)
-            // However this is complicated and waiting a complete cycle (i.e. 10 seconds)
+            // However this is complicated and waiting THROTTLE_SETTLE_MS
             // works good enough.
+            // Measured from the start of this distribution, like the interval of check_distribution.
+            last_throttle = last_distribution;
             if (!skip_stage_2) {
                 LOCAL_LOG("%s", "stage 1: Throttled a charger. Skipping stage 2");
                 skip_stage_2 = true;
             }
         }
 
-        if (!skip_stage_2) {
-            for (int i = 0; i < chargers.size(); ++i) {
-                auto &charger = chargers[i];
+        // Distributions are triggered by state changes, so the last throttle can be more recent than one cycle.
+        if (!skip_stage_2 && last_throttle != 0 && !deadline_elapsed(last_throttle + THROTTLE_SETTLE_MS)) {
+            LOCAL_LOG("stage 1: Throttled a charger less than %u ms ago. Skipping stage 2", THROTTLE_SETTLE_MS);
+            skip_stage_2 = true;
+        }
 
+        if (!skip_stage_2) {
+            for (int i = 0; i < charger_count; ++i) {
                 auto &charger_cfg = configs[i];
                 uint16_t current_to_set = current_array[i];
 
                 // > instead of >= to only catch chargers that were not already modified in stage 1.
-                bool will_not_throttle = current_to_set > charger.get("allocated_current")->asUint() || current_to_set > charger.get("allowed_current")->asUint();
+                bool will_not_throttle = current_to_set > chargers.allocated_current[i] || current_to_set > chargers.allowed_current[i];
 
                 if (!will_not_throttle) {
                     continue;
@@ -615,10 +724,10 @@ void ChargeManager::distribute_current()
                           charger_cfg.get("host")->asEphemeralCStr(),
                           current_to_set);
 
-                if (charger.get("allocated_current")->updateUint(current_to_set)) {
+                if (update_field(chargers.allocated_current[i], current_to_set)) {
                     print_local_log = true;
-                    if (charger.get("error")->asUint() != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
-                        charger.get("last_sent_config")->updateUint(millis());
+                    if (chargers.error[i] != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
+                        chargers.last_sent_config[i] = millis();
                 }
             }
         } else {
@@ -626,6 +735,9 @@ void ChargeManager::distribute_current()
         }
     }
 
+    for (int i = 0; i < charger_count; ++i)
+        publish_charger(i);
+
     if (print_local_log) {
         local_log = distribution_log;
         size_t len = strlen(local_log);
@@ -646,6 +758,7 @@ void ChargeManager::register_urls()
     api.addState("charge_manager/available_current", &charge_manager_available_current, {}, 1000);
     api.addCommand("charge_manager/available_current_update", &charge_manager_available_current, {}, [this](){
         this->last_available_current_update = millis();
+        this->request_distribution();
     }, false);
 
 }
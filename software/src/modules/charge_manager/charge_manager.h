@@ -21,6 +21,40 @@
 
 #include "config.h"
 
+#include <vector>
+
+#define CHARGER_FLAG_IS_CHARGING 0x01
+#define CHARGER_FLAG_WANTS_TO_CHARGE 0x02
+#define CHARGER_FLAG_WANTS_TO_CHARGE_LOW_PRIORITY 0x04
+
+// The charger values distribute_current works on, one array per value
+// and indexed by charger. They are copied into charge_manager_state
+// after every change, which is only used to publish them.
+struct charger_table_t {
+    std::vector<uint32_t> last_update;
+    std::vector<uint32_t> last_sent_config;
+    std::vector<uint16_t> supported_current; // maximum current supported by the charger
+    std::vector<uint16_t> allowed_current; // last current limit reported by the charger
+    std::vector<uint16_t> allocated_current; // last current limit send to the charger
+    std::vector<uint8_t> flags; // CHARGER_FLAG_*
+    std::vector<uint8_t> state;
+    std::vector<uint8_t> error;
+
+    size_t count() const { return flags.size(); }
+
+    void resize(size_t count)
+    {
+        last_update.resize(count);
+        last_sent_config.resize(count);
+        supported_current.resize(count);
+        allowed_current.resize(count);
+        allocated_current.resize(count);
+        flags.resize(count);
+        state.resize(count);
+        error.resize(count);
+    }
+};
+
 class ChargeManager
 {
 public:
@@ -36,6 +70,9 @@ public:
     void start_evse_state_update();
     void send_current();
     void distribute_current();
+    void request_distribution();
+    void check_distribution();
+    void publish_charger(size_t charger);
     void start_manager_task();
     void check_watchdog();
 
@@ -51,4 +88,15 @@ public:
     String buf;
 
     uint32_t last_available_current_update = 0;
+
+    charger_table_t charger_table;
+
+    // Charger indices in distribution order and the current calculated for each charger.
+    std::vector<int> idx_array;
+    std::vector<uint32_t> current_array;
+
+    // Set if a charger state or the available current changed since the last distribution.
+    bool distribution_requested = false;
+    uint32_t last_distribution = 0;
+    uint32_t last_throttle = 0;
 };
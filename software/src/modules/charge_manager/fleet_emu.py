@@ -0,0 +1,132 @@
+import socket
+import struct
+import sys
+import time
+import ipaddress
+
+"""
+Emulates a fleet of chargers without a GUI, see box_emu.py for a single one.
+
+usage: fleet_emu.py first_address count
+
+Every charger listens on its own address (first_address, first_address + 1, ...)
+on port 34128, as the charge manager identifies chargers by their address.
+On Linux the whole 127.0.0.0/8 network is routed to the loopback interface,
+for other networks add the addresses to an interface first.
+
+Chargers have a vehicle connected that wants to charge with up to 32 A.
+A charger starts charging when it is allocated at least 6 A and stops when
+it is allocated 0 A. Every 5 seconds a summary of the received requests
+is printed.
+"""
+
+header_format = "<BBH"
+request_format = header_format + "H"
+response_format = header_format + "BBBIIHH?"
+
+request_len = struct.calcsize(request_format)
+
+protocol_version = 3
+
+class Charger:
+    def __init__(self, addr):
+        self.addr = addr
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind((addr, 34128))
+        self.sock.setblocking(False)
+
+        self.manager_addr = None
+        self.next_seq_num = 0
+        self.start = time.time()
+        self.charging_time_start = 0
+
+        self.iec61851_state = 1
+        self.charger_state = 1
+        self.allocated_current = 0
+
+        self.last_request = None
+        self.max_request_gap = 0
+        self.requests = 0
+
+    def receive(self):
+        while True:
+            try:
+                data, self.manager_addr = self.sock.recvfrom(request_len)
+            except BlockingIOError:
+                return
+
+            if len(data) != request_len:
+                continue
+
+            _seq_num, _version, _, self.allocated_current = struct.unpack(request_format, data)
+
+            now = time.time()
+            if self.last_request is not None:
+                self.max_request_gap = max(self.max_request_gap, now - self.last_request)
+            self.last_request = now
+            self.requests += 1
+
+            if self.allocated_current >= 6000 and self.charger_state != 3:
+                self.iec61851_state = 2
+                self.charger_state = 3
+                if self.charging_time_start == 0:
+                    self.charging_time_start = now
+            elif self.allocated_current == 0 and self.charger_state == 3:
+                self.iec61851_state = 1
+                self.charger_state = 1
+
+    def send(self):
+        if self.manager_addr is None:
+            return
+
+        uptime = int((time.time() - self.start) * 1000)
+        charging_time = 0 if self.charging_time_start == 0 else int((time.time() - self.charging_time_start) * 1000)
+
+        b = struct.pack(response_format,
+                        self.next_seq_num,
+                        protocol_version,
+                        0,
+                        self.iec61851_state,
+                        self.charger_state,
+                        0,
+                        uptime,
+                        charging_time,
+                        self.allocated_current,
+                        32000,
+                        True)
+
+        self.next_seq_num = (self.next_seq_num + 1) % 256
+        self.sock.sendto(b, self.manager_addr)
+
+first_addr = ipaddress.IPv4Address(sys.argv[1])
+count = int(sys.argv[2])
+
+chargers = [Charger(str(first_addr + i)) for i in range(count)]
+
+next_send = time.time()
+next_summary = time.time() + 5
+
+while True:
+    for c in chargers:
+        c.receive()
+
+    now = time.time()
+    if now >= next_send:
+        next_send += 1
+        for c in chargers:
+            c.send()
+
+    if now >= next_summary:
+        next_summary += 5
+        reached = sum(1 for c in chargers if c.manager_addr is not None)
+        charging = sum(1 for c in chargers if c.charger_state == 3)
+        allocated = sum(c.allocated_current for c in chargers)
+        max_gap = max(c.max_request_gap for c in chargers)
+        requests = sum(c.requests for c in chargers)
+        print("{}/{} chargers reached, {} charging, {:.3f} A allocated, {} requests, max. gap between requests {:.3f} s".format(
+            reached, count, charging, allocated / 1000.0, requests, max_gap))
+        for c in chargers:
+            c.max_request_gap = 0
+            c.requests = 0
+
+    time.sleep(0.01)
@@ -26,7 +26,9 @@
 #include "task_scheduler.h"
 #include "tools.h"
 
+#include <algorithm>
 #include <memory>
+#include <time.h>
 
 extern TaskScheduler task_scheduler;
 
@@ -51,11 +53,44 @@ static_assert(CHARGE_RECORD_SIZE == 16, "Unexpected size of ChargeStart + Charge
 
 #define CHARGE_RECORD_FOLDER "/charge-records"
 // 30 files with 256 records each: 7680 records @ ~ max. 10 records per day = ~ 2 years and one month of records.
+// This many files are always kept. More are kept if the flash has space for them, see updateMaxRecordFiles.
 #define CHARGE_RECORD_FILE_COUNT 30
+#define CHARGE_RECORD_MAX_FILE_COUNT 256
 #define CHARGE_RECORD_MAX_FILE_SIZE 4096
+// A record file and its index are counted with one block each.
+#define CHARGE_RECORD_FILE_FLASH_SIZE (2 * CHARGE_RECORD_MAX_FILE_SIZE)
+
+// Record file indices kept in RAM.
+#define CHARGE_RECORD_INDEX_CACHE_SIZE 32
 
 #define CHARGE_RECORD_LAST_CHARGES_SIZE 30
 
+// Combinations of month and user in the totals of a charge log query
+#define CHARGE_LOG_QUERY_MAX_MONTHS 512
+
+#define CHARGE_RECORD_INDEX_VERSION 1
+
+struct ChargeRecordIndexHeader {
+    uint8_t version = CHARGE_RECORD_INDEX_VERSION;
+    uint8_t has_unknown_timestamps = 0;
+    uint16_t total_count = 0;
+    uint32_t record_bytes = 0;
+    uint32_t first_timestamp_minutes = 0;
+    uint32_t last_timestamp_minutes = 0;
+    uint32_t users[8] = {0};
+} __attribute__((packed));
+
+static_assert(sizeof(ChargeRecordIndexHeader) == 48, "Unexpected size of ChargeRecordIndexHeader");
+
+struct ChargeRecordIndexTotal {
+    uint8_t user_id = 0;
+    uint16_t charges = 0;
+    uint32_t charge_duration = 0;
+    float energy_charged = 0.0f;
+} __attribute__((packed));
+
+static_assert(sizeof(ChargeRecordIndexTotal) == 11, "Unexpected size of ChargeRecordIndexTotal");
+
 void ChargeTracker::pre_setup()
 {
     last_charges = Config::Array({},
@@ -76,7 +111,8 @@ void ChargeTracker::pre_setup()
     });
 
     state = Config::Object({
-        {"tracked_charges", Config::Uint16(0)},
+        {"tracked_charges", Config::Uint32(0)},
+        {"max_tracked_charges", Config::Uint32(0)},
         {"first_charge_timestamp", Config::Uint32(0)}
     });
 
@@ -90,6 +126,11 @@ String ChargeTracker::chargeRecordFilename(uint32_t i)
     return String(CHARGE_RECORD_FOLDER) + "/charge-record-" + i + ".bin";
 }
 
+String ChargeTracker::chargeRecordIndexFilename(uint32_t i)
+{
+    return String(CHARGE_RECORD_FOLDER) + "/charge-record-" + i + ".idx";
+}
+
 void ChargeTracker::startCharge(uint32_t timestamp_minutes, float meter_start, uint8_t user_id, uint32_t evse_uptime, uint8_t auth_type, Config::ConfVariant auth_info) {
     std::lock_guard<std::mutex> lock{records_mutex};
     ChargeStart cs;
@@ -101,12 +142,16 @@ void ChargeTracker::startCharge(uint32_t timestamp_minutes, float meter_start, u
         logger.printfln("Last charge record file %s is full. Creating the new file %s", file.name(), new_file_name.c_str());
         file.close();
 
+        updateMaxRecordFiles();
         removeOldRecords();
         updateState();
 
         file = LittleFS.open(new_file_name, "w", true);
     }
 
+    // Bring the index up to date before the record file changes.
+    ChargeRecordIndex *index = getRecordIndex(this->last_charge_record);
+
     if ((file.size() % CHARGE_RECORD_SIZE) != 0) {
         logger.printfln("Can't track start of charge: Last charge end was not tracked or file is damaged! Offset is %u bytes. Expected 0", file.size() % CHARGE_RECORD_SIZE);
         // TODO: for robustness we would have to write the last end here? Yes, but only if % == 9. Also write duration 0, so we know this is a "faked" end. Still write the correct meter state.
@@ -123,6 +168,15 @@ void ChargeTracker::startCharge(uint32_t timestamp_minutes, float meter_start, u
     file.write(buf, sizeof(cs));
     logger.printfln("Tracked start of charge.");
 
+    if (index != nullptr) {
+        if ((index->users[user_id / 32] & (1u << (user_id % 32))) == 0)
+            ++user_refs[user_id];
+
+        indexRecord(index, buf, sizeof(cs));
+        index->record_bytes = file.size();
+        writeRecordIndex(*index);
+    }
+
     current_charge.get("user_id")->updateInt(user_id);
     current_charge.get("meter_start")->updateFloat(meter_start);
     current_charge.get("evse_uptime_start")->updateUint(evse_uptime);
@@ -139,6 +193,9 @@ void ChargeTracker::endCharge(uint32_t charge_duration_seconds, float meter_end)
 
     {
         File file = LittleFS.open(chargeRecordFilename(this->last_charge_record), "a");
+        // Bring the index up to date before the record file changes.
+        getRecordIndex(this->last_charge_record);
+
         if ((file.size() % CHARGE_RECORD_SIZE) != sizeof(ChargeStart)) {
             logger.printfln("Can't track end of charge: Last charge start was not tracked or file is damaged! Offset is %u bytes. Expected %u", file.size() % CHARGE_RECORD_SIZE, sizeof(ChargeStart));
             // TODO: How to handle this case? Add a charge start with the same meter value as the last end?
@@ -162,6 +219,20 @@ void ChargeTracker::endCharge(uint32_t charge_duration_seconds, float meter_end)
         last_charges.remove(0);
 
     File f = LittleFS.open(chargeRecordFilename(this->last_charge_record));
+    f.seek(-CHARGE_RECORD_SIZE, SeekMode::SeekEnd);
+
+    // The start of this record is already part of the index. Adding the
+    // complete record only adds its totals.
+    uint8_t record[CHARGE_RECORD_SIZE] = {0};
+    if (f.read(record, sizeof(record)) == sizeof(record)) {
+        ChargeRecordIndex *index = getRecordIndex(this->last_charge_record);
+        if (index != nullptr) {
+            indexRecord(index, record, sizeof(record));
+            index->record_bytes = f.size();
+            writeRecordIndex(*index);
+        }
+    }
+
     f.seek(-CHARGE_RECORD_SIZE, SeekMode::SeekEnd);
     this->readNRecords(&f, 1);
 
@@ -177,70 +248,293 @@ void ChargeTracker::endCharge(uint32_t charge_duration_seconds, float meter_end)
 
 bool ChargeTracker::is_user_tracked(uint8_t user_id)
 {
-    const size_t user_id_offset = offsetof(ChargeStart, user_id);
-
-    for (int file = this->first_charge_record; file <= this->last_charge_record; ++file) {
-        File f = LittleFS.open(chargeRecordFilename(file));
-        size_t size = f.size();
-        // LittleFS caches internally, so we can read single bytes without a huge performance loss.
-        for (size_t i = 0; i < size; i += CHARGE_RECORD_SIZE) {
-            f.seek(i + user_id_offset);
-            int read_user_id = f.read();
-            if (read_user_id < 0)
+    std::lock_guard<std::mutex> lock{records_mutex};
+    return user_refs[user_id] != 0;
+}
+
+ChargeRecordUserTotals ChargeTracker::getUserTotals(uint8_t user_id)
+{
+    std::lock_guard<std::mutex> lock{records_mutex};
+
+    ChargeRecordUserTotals result = {user_id, 0, 0, 0.0f};
+    ChargeRecordIndex scratch;
+
+    for (uint32_t file = this->first_charge_record; file <= this->last_charge_record; ++file) {
+        const ChargeRecordIndex *index = peekRecordIndex(file, &scratch);
+        if (index == nullptr)
+            continue;
+
+        for (const ChargeRecordUserTotals &totals : index->totals) {
+            if (totals.user_id != user_id)
                 continue;
-            if (user_id == read_user_id)
-                return true;
+
+            result.charges += totals.charges;
+            result.charge_duration += totals.charge_duration;
+            result.energy_charged += totals.energy_charged;
         }
     }
-    return false;
+
+    return result;
 }
 
-void ChargeTracker::removeOldRecords()
+bool ChargeTracker::recordFileInRange(uint32_t file, uint32_t start_minutes, uint32_t end_minutes)
 {
-    const size_t user_id_offset = offsetof(ChargeStart, user_id);
+    const ChargeRecordIndex *index = getRecordIndex(file);
+    if (index == nullptr)
+        return false;
 
-    uint32_t users_to_delete[8] = {0}; // one bit per user
+    if (index->has_unknown_timestamps)
+        return true;
 
-    while (this->last_charge_record - this->first_charge_record >= 30) {
-        String name = chargeRecordFilename(this->first_charge_record);
-        logger.printfln("Got %u charge records. Dropping the first one (%s)", this->last_charge_record - this->first_charge_record, name.c_str());
-        {
-            File f = LittleFS.open(name, "r");
-            size_t size = f.size();
-            for (size_t i = 0; i < size; i += CHARGE_RECORD_SIZE) {
-                f.seek(i + user_id_offset);
-                int x = f.read();
-                if (x < 0)
-                    continue;
-                uint8_t user_id = x;
-                users_to_delete[user_id / 32] |= (1 << (user_id % 32));
-            }
+    return index->first_timestamp_minutes != 0
+        && index->first_timestamp_minutes <= end_minutes
+        && index->last_timestamp_minutes >= start_minutes;
+}
+
+ChargeRecordIndex *ChargeTracker::getRecordIndex(uint32_t file)
+{
+    for (ChargeRecordIndex &index : record_index)
+        if (index.file == file)
+            return &index;
+
+    ChargeRecordIndex index;
+    if (!readRecordIndex(file, &index))
+        return nullptr;
+
+    if (record_index.size() >= CHARGE_RECORD_INDEX_CACHE_SIZE)
+        record_index.erase(record_index.begin());
+
+    record_index.push_back(std::move(index));
+    return &record_index.back();
+}
+
+const ChargeRecordIndex *ChargeTracker::peekRecordIndex(uint32_t file, ChargeRecordIndex *scratch)
+{
+    for (const ChargeRecordIndex &index : record_index)
+        if (index.file == file)
+            return &index;
+
+    return readRecordIndex(file, scratch) ? scratch : nullptr;
+}
+
+bool ChargeTracker::readRecordIndex(uint32_t file, ChargeRecordIndex *index)
+{
+    String name = chargeRecordFilename(file);
+    if (!LittleFS.exists(name))
+        return false;
+
+    size_t record_bytes;
+    {
+        File f = LittleFS.open(name);
+        record_bytes = f.size();
+    }
+
+    index->file = file;
+
+    if (!loadRecordIndex(index, record_bytes)) {
+        rebuildRecordIndex(index);
+        writeRecordIndex(*index);
+    }
+
+    return true;
+}
+
+bool ChargeTracker::loadRecordIndex(ChargeRecordIndex *index, size_t record_bytes)
+{
+    File f = LittleFS.open(chargeRecordIndexFilename(index->file));
+    if (!f)
+        return false;
+
+    ChargeRecordIndexHeader header;
+    if (f.read((uint8_t *)&header, sizeof(header)) != sizeof(header))
+        return false;
+
+    // The index is written after the record file. If the ESP was reset in between,
+    // the index is outdated.
+    if (header.version != CHARGE_RECORD_INDEX_VERSION
+     || header.record_bytes != record_bytes
+     || f.size() != sizeof(header) + header.total_count * sizeof(ChargeRecordIndexTotal))
+        return false;
+
+    index->record_bytes = header.record_bytes;
+    index->first_timestamp_minutes = header.first_timestamp_minutes;
+    index->last_timestamp_minutes = header.last_timestamp_minutes;
+    index->has_unknown_timestamps = header.has_unknown_timestamps != 0;
+    memcpy(index->users, header.users, sizeof(index->users));
+
+    index->totals.clear();
+    index->totals.reserve(header.total_count);
+    for (size_t i = 0; i < header.total_count; ++i) {
+        ChargeRecordIndexTotal total;
+        if (f.read((uint8_t *)&total, sizeof(total)) != sizeof(total))
+            return false;
+        index->totals.push_back({total.user_id, total.charges, total.charge_duration, total.energy_charged});
+    }
+
+    return true;
+}
+
+void ChargeTracker::rebuildRecordIndex(ChargeRecordIndex *index)
+{
+    index->record_bytes = 0;
+    index->first_timestamp_minutes = 0;
+    index->last_timestamp_minutes = 0;
+    index->has_unknown_timestamps = false;
+    memset(index->users, 0, sizeof(index->users));
+    index->totals.clear();
+
+    File f = LittleFS.open(chargeRecordFilename(index->file));
+    size_t size = f.size();
+
+    // Read 16 records at once instead of seeking to every user ID.
+    uint8_t buf[16 * CHARGE_RECORD_SIZE];
+    size_t offset = 0;
+    while (offset < size) {
+        size_t read = f.read(buf, sizeof(buf));
+        if (read == 0)
+            break;
+
+        for (size_t i = 0; i + sizeof(ChargeStart) <= read; i += CHARGE_RECORD_SIZE)
+            indexRecord(index, buf + i, std::min(read - i, (size_t)CHARGE_RECORD_SIZE));
+
+        offset += read;
+    }
+
+    index->record_bytes = size;
+}
+
+void ChargeTracker::writeRecordIndex(const ChargeRecordIndex &index)
+{
+    ChargeRecordIndexHeader header;
+    header.has_unknown_timestamps = index.has_unknown_timestamps ? 1 : 0;
+    header.total_count = index.totals.size();
+    header.record_bytes = index.record_bytes;
+    header.first_timestamp_minutes = index.first_timestamp_minutes;
+    header.last_timestamp_minutes = index.last_timestamp_minutes;
+    memcpy(header.users, index.users, sizeof(header.users));
+
+    size_t len = sizeof(header) + index.totals.size() * sizeof(ChargeRecordIndexTotal);
+    std::unique_ptr<uint8_t[]> buf{new uint8_t[len]};
+
+    memcpy(buf.get(), &header, sizeof(header));
+    for (size_t i = 0; i < index.totals.size(); ++i) {
+        ChargeRecordIndexTotal total;
+        total.user_id = index.totals[i].user_id;
+        total.charges = index.totals[i].charges;
+        total.charge_duration = index.totals[i].charge_duration;
+        total.energy_charged = index.totals[i].energy_charged;
+        memcpy(buf.get() + sizeof(header) + i * sizeof(total), &total, sizeof(total));
+    }
+
+    File f = LittleFS.open(chargeRecordIndexFilename(index.file), "w");
+    if (f.write(buf.get(), len) != len)
+        logger.printfln("Failed to write charge record index %s", f.name());
+}
+
+void ChargeTracker::indexRecord(ChargeRecordIndex *index, const uint8_t *record, size_t record_len)
+{
+    ChargeStart cs;
+    memcpy(&cs, record, sizeof(cs));
+
+    index->users[cs.user_id / 32] |= (1u << (cs.user_id % 32));
+
+    if (cs.timestamp_minutes == 0) {
+        index->has_unknown_timestamps = true;
+    } else {
+        if (index->first_timestamp_minutes == 0 || cs.timestamp_minutes < index->first_timestamp_minutes)
+            index->first_timestamp_minutes = cs.timestamp_minutes;
+        if (cs.timestamp_minutes > index->last_timestamp_minutes)
+            index->last_timestamp_minutes = cs.timestamp_minutes;
+    }
+
+    // A started charge only counts once it has ended.
+    if (record_len < CHARGE_RECORD_SIZE)
+        return;
+
+    ChargeEnd ce;
+    memcpy(&ce, record + sizeof(cs), sizeof(ce));
+
+    ChargeRecordUserTotals *totals = nullptr;
+    for (ChargeRecordUserTotals &t : index->totals) {
+        if (t.user_id == cs.user_id) {
+            totals = &t;
+            break;
         }
-        LittleFS.remove(name);
-        ++this->first_charge_record;
     }
 
-    //users_to_delete has now set a bit for every user_id that was used in the deleted charge records.
-    //Clear this bit for every user that is still used in the current charge records.
-    for (int file = this->first_charge_record; file < this->last_charge_record; ++file) {
-        File f = LittleFS.open(chargeRecordFilename(file));
-        size_t size = f.size();
-        // LittleFS caches internally, so we can read single bytes without a huge performance loss.
-        for (size_t i = 0; i < size; i += CHARGE_RECORD_SIZE) {
-            f.seek(i + user_id_offset);
-            int x = f.read();
-            if (x < 0)
-                continue;
-            uint8_t user_id = x;
-            users_to_delete[user_id / 32] &= ~(1 << (user_id % 32));
+    if (totals == nullptr) {
+        index->totals.push_back({cs.user_id, 0, 0, 0.0f});
+        totals = &index->totals.back();
+    }
+
+    ++totals->charges;
+    totals->charge_duration += ce.charge_duration;
+    if (!isnan(cs.meter_start) && !isnan(ce.meter_end))
+        totals->energy_charged += ce.meter_end - cs.meter_start;
+}
+
+void ChargeTracker::removeRecordIndex(uint32_t file)
+{
+    for (size_t i = 0; i < record_index.size(); ++i) {
+        if (record_index[i].file == file) {
+            record_index.erase(record_index.begin() + i);
+            break;
         }
     }
 
-    // Now only users that are save to remove remain.
-    for (int user_id = 0; user_id < 256; ++user_id) {
-        if ((users_to_delete[user_id / 32] & (1 << (user_id % 32))) != 0) {
-            users.remove_from_username_file(user_id);
+    LittleFS.remove(chargeRecordIndexFilename(file));
+}
+
+void ChargeTracker::updateMaxRecordFiles()
+{
+    // The records may use half of the space that is either free or already used by them.
+    // Other data written later shrinks this limit, the oldest records are then removed first.
+    size_t files = this->last_charge_record - this->first_charge_record + 1;
+    size_t free_bytes = LittleFS.totalBytes() - LittleFS.usedBytes();
+
+    max_record_files = (files + free_bytes / CHARGE_RECORD_FILE_FLASH_SIZE) / 2;
+    max_record_files = std::max((size_t)CHARGE_RECORD_FILE_COUNT, std::min((size_t)CHARGE_RECORD_MAX_FILE_COUNT, max_record_files));
+}
+
+void ChargeTracker::countUserRefs()
+{
+    memset(user_refs, 0, sizeof(user_refs));
+    ChargeRecordIndex scratch;
+
+    for (uint32_t file = this->first_charge_record; file <= this->last_charge_record; ++file) {
+        const ChargeRecordIndex *index = peekRecordIndex(file, &scratch);
+        if (index == nullptr)
+            continue;
+
+        for (int user_id = 0; user_id < 256; ++user_id)
+            if ((index->users[user_id / 32] & (1u << (user_id % 32))) != 0)
+                ++user_refs[user_id];
+    }
+}
+
+void ChargeTracker::removeOldRecords()
+{
+    while (this->last_charge_record - this->first_charge_record >= max_record_files) {
+        String name = chargeRecordFilename(this->first_charge_record);
+        logger.printfln("Got %u charge records. Dropping the first one (%s)", this->last_charge_record - this->first_charge_record, name.c_str());
+
+        // user_refs counts the record files that contain a user. A user that
+        // is in none of the remaining files is not needed anymore.
+        ChargeRecordIndex scratch;
+        const ChargeRecordIndex *index = peekRecordIndex(this->first_charge_record, &scratch);
+        if (index != nullptr) {
+            for (int user_id = 0; user_id < 256; ++user_id) {
+                if ((index->users[user_id / 32] & (1u << (user_id % 32))) == 0 || user_refs[user_id] == 0)
+                    continue;
+
+                if (--user_refs[user_id] == 0)
+                    users.remove_from_username_file(user_id);
+            }
         }
+
+        removeRecordIndex(this->first_charge_record);
+        LittleFS.remove(name);
+        ++this->first_charge_record;
     }
 }
 
@@ -254,9 +548,8 @@ bool ChargeTracker::setupRecords()
     File folder = LittleFS.open(CHARGE_RECORD_FOLDER);
     File f;
 
-    uint32_t found_blobs[32] = {0};
-    size_t found_blobs_size = sizeof(found_blobs) / sizeof(found_blobs[0]);
-    int found_blob_counter = 0;
+    std::vector<uint32_t> found_blobs;
+    std::vector<uint32_t> found_indices;
 
     while (f = folder.openNextFile()) {
         String name = String(f.name());
@@ -265,6 +558,11 @@ bool ChargeTracker::setupRecords()
             continue;
         }
 
+        if (name.startsWith("charge-record-") && name.endsWith(".idx")) {
+            found_indices.push_back(name.substring(14, name.length() - 4).toInt());
+            continue;
+        }
+
         if (!name.startsWith("charge-record-") || !name.endsWith(".bin")) {
             logger.printfln("Unexpected file %s in charge record folder", name.c_str());
             continue;
@@ -276,28 +574,32 @@ bool ChargeTracker::setupRecords()
             continue;
         }
 
-        if (found_blob_counter > found_blobs_size) {
-            logger.printfln("Too many charge records found!");
-            return false;
-        }
-
-        found_blobs[found_blob_counter] = suffix;
-        ++found_blob_counter;
+        found_blobs.push_back(suffix);
     }
 
-    if (found_blob_counter == 0) {
+    // Indices of record files that were removed (for example by an older firmware) are useless.
+    auto remove_stale_indices = [this, &found_indices]() {
+        for (uint32_t index : found_indices)
+            if (index < this->first_charge_record || index > this->last_charge_record)
+                LittleFS.remove(chargeRecordIndexFilename(index));
+    };
+
+    if (found_blobs.empty()) {
         this->first_charge_record = 1;
         this->last_charge_record = 1;
+        remove_stale_indices();
+        memset(user_refs, 0, sizeof(user_refs));
+        updateMaxRecordFiles();
         return true;
     }
 
-    std::sort(found_blobs, found_blobs + found_blob_counter);
+    std::sort(found_blobs.begin(), found_blobs.end());
 
-    uint32_t first = found_blobs[0];
-    uint32_t last = found_blobs[found_blob_counter - 1];
+    uint32_t first = found_blobs.front();
+    uint32_t last = found_blobs.back();
 
-    logger.printfln("Found %u records. First is %u, last is %u", found_blob_counter, first, last);
-    for (int i = 0; i < found_blob_counter - 1; ++i) {
+    logger.printfln("Found %u records. First is %u, last is %u", found_blobs.size(), first, last);
+    for (size_t i = 0; i < found_blobs.size() - 1; ++i) {
         if (found_blobs[i] + 1 != found_blobs[i + 1]) {
             logger.printfln("Non-consecutive charge records found! (Next after %u is %u. Expected was %u", found_blobs[i], found_blobs[i+1], found_blobs[i] + 1);
             return false;
@@ -310,7 +612,7 @@ bool ChargeTracker::setupRecords()
         }
     }
 
-    String last_file_name = chargeRecordFilename(found_blobs[found_blob_counter - 1]);
+    String last_file_name = chargeRecordFilename(last);
     f = LittleFS.open(last_file_name, "a");
     size_t last_file_size = f.size();
     logger.printfln("Last charge record size is %u (%u, %u)", last_file_size, f.size(), (last_file_size % CHARGE_RECORD_SIZE));
@@ -323,6 +625,9 @@ bool ChargeTracker::setupRecords()
     this->first_charge_record = first;
     this->last_charge_record = last;
 
+    remove_stale_indices();
+    countUserRefs();
+    updateMaxRecordFiles();
     removeOldRecords();
     return true;
 }
@@ -364,6 +669,7 @@ void ChargeTracker::updateState()
 {
     auto records = this->last_charge_record - this->first_charge_record + 1;
     state.get("tracked_charges")->updateUint((records - 1) * (CHARGE_RECORD_MAX_FILE_SIZE / CHARGE_RECORD_SIZE) + completeRecordsInLastFile());
+    state.get("max_tracked_charges")->updateUint(max_record_files * (CHARGE_RECORD_MAX_FILE_SIZE / CHARGE_RECORD_SIZE));
 
     File f = LittleFS.open(chargeRecordFilename(this->first_charge_record));
     ChargeStart cs;
@@ -409,6 +715,122 @@ void ChargeTracker::setup()
     updateState();
 }
 
+struct ChargeRecordFilter {
+    int16_t user_id = -1; // -1: all users
+    uint32_t start_minutes = 0;
+    uint32_t end_minutes = UINT32_MAX;
+
+    bool filters_time() const
+    {
+        return start_minutes != 0 || end_minutes != UINT32_MAX;
+    }
+};
+
+// Calls fn(const ChargeStart &, const ChargeEnd &) for every complete record that matches filter,
+// oldest first. Record files that can't contain a match according to their index are skipped,
+// all others are read sequentially in blocks of records.
+// records_mutex is only held while a block is read, fn is called without it. fn can thus
+// send a response without blocking the charge tracking in the main loop on a slow client.
+template <typename F>
+static void scan_records(ChargeTracker *tracker, const ChargeRecordFilter &filter, F fn)
+{
+    uint8_t buf[32 * CHARGE_RECORD_SIZE];
+
+    uint32_t file;
+    {
+        std::lock_guard<std::mutex> lock{tracker->records_mutex};
+        file = tracker->first_charge_record;
+    }
+
+    for (;; ++file) {
+        size_t offset = 0;
+
+        for (;;) {
+            size_t read;
+            {
+                std::lock_guard<std::mutex> lock{tracker->records_mutex};
+
+                if (file > tracker->last_charge_record)
+                    return;
+
+                // Removed in the meantime if this was the oldest record file.
+                if (file < tracker->first_charge_record)
+                    break;
+
+                if (offset == 0) {
+                    const ChargeRecordIndex *index = tracker->getRecordIndex(file);
+                    if (index == nullptr)
+                        break;
+
+                    if (filter.user_id >= 0 && (index->users[filter.user_id / 32] & (1u << (filter.user_id % 32))) == 0)
+                        break;
+
+                    if (filter.filters_time() && !tracker->recordFileInRange(file, filter.start_minutes, filter.end_minutes))
+                        break;
+                }
+
+                File f = LittleFS.open(tracker->chargeRecordFilename(file));
+                if (!f || !f.seek(offset))
+                    break;
+
+                read = f.read(buf, sizeof(buf));
+            }
+
+            // A started charge at the end of the last file is not a complete record.
+            read -= read % CHARGE_RECORD_SIZE;
+            if (read == 0)
+                break;
+
+            offset += read;
+
+            for (size_t i = 0; i < read; i += CHARGE_RECORD_SIZE) {
+                ChargeStart cs;
+                ChargeEnd ce;
+                memcpy(&cs, buf + i, sizeof(cs));
+                memcpy(&ce, buf + i + sizeof(cs), sizeof(ce));
+
+                if (filter.user_id >= 0 && cs.user_id != filter.user_id)
+                    continue;
+
+                // Charges without timestamp can't be assigned to a time range.
+                if (filter.filters_time() && (cs.timestamp_minutes == 0 || cs.timestamp_minutes < filter.start_minutes || cs.timestamp_minutes > filter.end_minutes))
+                    continue;
+
+                fn(cs, ce);
+            }
+        }
+    }
+}
+
+static bool parse_query_uint(WebServerRequest &request, const char *key, uint32_t max, uint32_t *value, bool *valid)
+{
+    char buf[16];
+    if (!request.queryValue(key, buf, sizeof(buf)))
+        return false;
+
+    char *end;
+    unsigned long parsed = strtoul(buf, &end, 10);
+    if (end == buf || *end != '\0' || parsed > max) {
+        *valid = false;
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
+static void write_float(WebServerChunkWriter &writer, float value, bool null_if_nan)
+{
+    if (isnan(value)) {
+        if (null_if_nan)
+            writer.write("null", 4);
+        return;
+    }
+
+    char buf[24];
+    writer.write(buf, snprintf(buf, sizeof(buf), "%.3f", value));
+}
+
 void ChargeTracker::register_urls()
 {
     api.addPersistentConfig("charge_tracker/config", &config, {}, 1000);
@@ -440,6 +862,169 @@ void ChargeTracker::register_urls()
         return request.endChunkedResponse();
     });
 
+    // Filters the charge log by user_id and start timestamp (start and end, in minutes).
+    // format=csv lists the matching charges, the default (format=json) returns
+    // their totals and the totals per user and month.
+    server.on("/charge_tracker/charge_log_query", HTTP_GET, [this](WebServerRequest request) {
+        ChargeRecordFilter filter;
+        bool valid = true;
+        uint32_t value;
+
+        if (parse_query_uint(request, "user_id", 255, &value, &valid))
+            filter.user_id = value;
+        if (parse_query_uint(request, "start", UINT32_MAX, &value, &valid))
+            filter.start_minutes = value;
+        if (parse_query_uint(request, "end", UINT32_MAX, &value, &valid))
+            filter.end_minutes = value;
+
+        char format[8] = "json";
+        request.queryValue("format", format, sizeof(format));
+        bool csv = strcmp(format, "csv") == 0;
+
+        if (!valid || (!csv && strcmp(format, "json") != 0))
+            return request.send(400, "text/plain", "Invalid query");
+
+        if (csv) {
+            request.beginChunkedResponse(200, "text/csv; charset=utf-8");
+            WebServerChunkWriter writer{&request};
+
+            writer.write("start,timestamp_minutes,charge_duration,user_id,meter_start,meter_end,energy_charged\r\n");
+
+            scan_records(this, filter, [&writer](const ChargeStart &cs, const ChargeEnd &ce) {
+                if (cs.timestamp_minutes != 0) {
+                    time_t t = (time_t)cs.timestamp_minutes * 60;
+                    struct tm tm;
+                    localtime_r(&t, &tm);
+
+                    char date[24];
+                    writer.write(date, strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm));
+                }
+                writer.write(',');
+                writer.writeInt(cs.timestamp_minutes);
+                writer.write(',');
+                writer.writeInt(ce.charge_duration);
+                writer.write(',');
+                writer.writeInt(cs.user_id);
+                writer.write(',');
+                write_float(writer, cs.meter_start, false);
+                writer.write(',');
+                write_float(writer, ce.meter_end, false);
+                writer.write(',');
+                write_float(writer, (isnan(cs.meter_start) || isnan(ce.meter_end)) ? NAN : ce.meter_end - cs.meter_start, false);
+                writer.write("\r\n", 2);
+            });
+
+            writer.flush();
+            return request.endChunkedResponse();
+        }
+
+        struct totals_t {
+            uint32_t charges = 0;
+            uint32_t charge_duration = 0;
+            float energy_charged = 0.0f;
+
+            void add(const ChargeStart &cs, const ChargeEnd &ce)
+            {
+                ++charges;
+                charge_duration += ce.charge_duration;
+                if (!isnan(cs.meter_start) && !isnan(ce.meter_end))
+                    energy_charged += ce.meter_end - cs.meter_start;
+            }
+        };
+
+        // Key: months since year 0 (0 if the charge has no timestamp) << 8 | user ID.
+        struct month_totals_t {
+            uint32_t key;
+            totals_t totals;
+        };
+
+        // Sorted by key, so ordered by month, then by user. The full history can have
+        // thousands of combinations of month and user, so their number is capped.
+        auto per_month = std::unique_ptr<month_totals_t[]>(new month_totals_t[CHARGE_LOG_QUERY_MAX_MONTHS]);
+        if (per_month == nullptr) {
+            return request.send(507);
+        }
+
+        totals_t all;
+        size_t month_count = 0;
+        bool too_many_months = false;
+
+        scan_records(this, filter, [&all, &per_month, &month_count, &too_many_months](const ChargeStart &cs, const ChargeEnd &ce) {
+            uint32_t month = 0;
+            if (cs.timestamp_minutes != 0) {
+                time_t t = (time_t)cs.timestamp_minutes * 60;
+                struct tm tm;
+                localtime_r(&t, &tm);
+                month = (tm.tm_year + 1900) * 12 + tm.tm_mon;
+            }
+
+            uint32_t key = month << 8 | cs.user_id;
+            month_totals_t *end = per_month.get() + month_count;
+            month_totals_t *entry = std::lower_bound(per_month.get(), end, key, [](const month_totals_t &m, uint32_t k) {
+                return m.key < k;
+            });
+
+            if (entry == end || entry->key != key) {
+                if (month_count == CHARGE_LOG_QUERY_MAX_MONTHS) {
+                    too_many_months = true;
+                    return;
+                }
+
+                // The records are ordered by time, so this is an append most of the time.
+                std::move_backward(entry, end, end + 1);
+                entry->key = key;
+                entry->totals = totals_t{};
+                ++month_count;
+            }
+
+            all.add(cs, ce);
+            entry->totals.add(cs, ce);
+        });
+
+        if (too_many_months)
+            return request.send(400, "text/plain", "Too many months and users. Narrow the query with user_id, start and end");
+
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        WebServerChunkWriter writer{&request};
+
+        auto write_totals = [&writer](const totals_t &totals) {
+            writer.write("\"charges\":");
+            writer.writeInt(totals.charges);
+            writer.write(",\"charge_duration\":");
+            writer.writeInt(totals.charge_duration);
+            writer.write(",\"energy_charged\":");
+            write_float(writer, totals.energy_charged, true);
+        };
+
+        writer.write('{');
+        write_totals(all);
+        writer.write(",\"months\":[");
+
+        for (size_t i = 0; i < month_count; ++i) {
+            const month_totals_t &entry = per_month[i];
+            uint32_t month = entry.key >> 8;
+
+            writer.write(i == 0 ? "{\"month\":" : ",{\"month\":");
+
+            if (month == 0) {
+                writer.write("null", 4);
+            } else {
+                char buf[16];
+                writer.write(buf, snprintf(buf, sizeof(buf), "\"%04u-%02u\"", month / 12, month % 12 + 1));
+            }
+
+            writer.write(",\"user_id\":");
+            writer.writeInt(entry.key & 0xFF);
+            writer.write(',');
+            write_totals(entry.totals);
+            writer.write('}');
+        }
+
+        writer.write("]}", 2);
+        writer.flush();
+        return request.endChunkedResponse();
+    });
+
     api.addState("charge_tracker/last_charges", &last_charges, {}, 1000);
     api.addState("charge_tracker/current_charge", &current_charge, {}, 1000);
     api.addState("charge_tracker/state", &state, {}, 1000);
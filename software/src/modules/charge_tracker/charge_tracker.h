@@ -21,6 +21,8 @@
 
 #include <LittleFS.h>
 
+#include <vector>
+
 #include "config.h"
 
 #define CHARGE_TRACKER_AUTH_TYPE_NONE 0
@@ -28,6 +30,25 @@
 #define CHARGE_TRACKER_AUTH_TYPE_NFC 2
 #define CHARGE_TRACKER_AUTH_TYPE_NFC_INJECTION 3
 
+struct ChargeRecordUserTotals {
+    uint8_t user_id;
+    uint16_t charges;
+    uint32_t charge_duration; // seconds
+    float energy_charged; // kWh. Charges without meter values are not included.
+};
+
+// Summary of one charge record file. It is stored next to the record file
+// and rebuilt from it if it is missing or does not match the record file.
+struct ChargeRecordIndex {
+    uint32_t file;
+    uint32_t record_bytes; // Size of the record file when the index was updated.
+    uint32_t first_timestamp_minutes; // 0 if no record has a timestamp
+    uint32_t last_timestamp_minutes;
+    bool has_unknown_timestamps; // At least one charge was started before the clock was synced.
+    uint32_t users[8]; // one bit per user ID
+    std::vector<ChargeRecordUserTotals> totals; // of complete records
+};
+
 class ChargeTracker
 {
 public:
@@ -43,12 +64,33 @@ public:
     uint32_t last_charge_record;
 
     String chargeRecordFilename(uint32_t i);
+    String chargeRecordIndexFilename(uint32_t i);
     void startCharge(uint32_t timestamp_minutes, float meter_start, uint8_t user_id, uint32_t evse_uptime, uint8_t auth_type, Config::ConfVariant auth_info);
     void endCharge(uint32_t charge_duration_seconds, float meter_end);
+    void updateMaxRecordFiles();
+    void countUserRefs();
     void removeOldRecords();
     bool setupRecords();
     void updateState();
     bool is_user_tracked(uint8_t user_id);
+    ChargeRecordUserTotals getUserTotals(uint8_t user_id);
+
+    // False if the record file contains no charge started in [start_minutes, end_minutes].
+    // Charges without timestamp can be in any file that contains them.
+    bool recordFileInRange(uint32_t file, uint32_t start_minutes, uint32_t end_minutes);
+
+    // Returns nullptr if the record file does not exist. The pointer is valid until the next call.
+    ChargeRecordIndex *getRecordIndex(uint32_t file);
+    // Same as getRecordIndex, but an index that is not cached is read into scratch instead of the cache.
+    // For walks over all record files, that would otherwise replace the whole cache.
+    const ChargeRecordIndex *peekRecordIndex(uint32_t file, ChargeRecordIndex *scratch);
+    // Reads the index from its file, rebuilds it if it is outdated. False if the record file does not exist.
+    bool readRecordIndex(uint32_t file, ChargeRecordIndex *index);
+    bool loadRecordIndex(ChargeRecordIndex *index, size_t record_bytes);
+    void rebuildRecordIndex(ChargeRecordIndex *index);
+    void writeRecordIndex(const ChargeRecordIndex &index);
+    void indexRecord(ChargeRecordIndex *index, const uint8_t *record, size_t record_len);
+    void removeRecordIndex(uint32_t file);
 
     size_t completeRecordsInLastFile();
     bool currentlyCharging();
@@ -62,4 +104,13 @@ public:
     ConfigRoot config;
 
     std::mutex records_mutex;
+
+    // Loaded lazily, at most one index per record file.
+    std::vector<ChargeRecordIndex> record_index;
+
+    // How many record files are kept. Depends on the free space of the flash.
+    size_t max_record_files = 0;
+
+    // Number of record files that contain a charge of the user.
+    uint16_t user_refs[256] = {0};
 };
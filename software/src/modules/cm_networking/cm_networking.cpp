@@ -181,6 +181,10 @@ void CMNetworking::register_manager(std::vector<String> &&hosts,
 {
     hostnames = hosts;
 
+    resolve_state.assign(names.size(), RESOLVE_STATE_UNKNOWN);
+    dest_addrs.assign(names.size(), sockaddr_in{});
+    last_seen_seq_num.assign(names.size(), 255);
+
     for (int i = 0; i < names.size(); ++i) {
         dest_addrs[i].sin_addr.s_addr = 0;
         resolve_state[i] = RESOLVE_STATE_UNKNOWN;
@@ -194,87 +198,85 @@ void CMNetworking::register_manager(std::vector<String> &&hosts,
         return;
 
     task_scheduler.scheduleWithFixedDelay([this, names, manager_callback, manager_error_callback](){
-        static uint8_t last_seen_seq_num[MAX_CLIENTS];
-        static bool initialized = false;
-        if (!initialized) {
-            memset(last_seen_seq_num, 255, MAX_CLIENTS);
-            initialized = true;
-        }
-
-        response_packet recv_buf[2] = {};
-        struct sockaddr_in source_addr;
-        socklen_t socklen = sizeof(source_addr);
-
-        int len = recvfrom(manager_sock, recv_buf, sizeof(recv_buf), 0, (sockaddr *)&source_addr, &socklen);
-
-        if (len < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK)
-                logger.printfln("recvfrom failed: errno %d", errno);
-            return;
-        }
+        // Every charger sends about one response per second. Handle everything
+        // that was received since the last run, but don't block the main loop
+        // for too long if more packets than expected arrive.
+        for (size_t packets = 0; packets < 2 * names.size(); ++packets) {
+            response_packet recv_buf[2] = {};
+            struct sockaddr_in source_addr;
+            socklen_t socklen = sizeof(source_addr);
+
+            int len = recvfrom(manager_sock, recv_buf, sizeof(recv_buf), 0, (sockaddr *)&source_addr, &socklen);
+
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    logger.printfln("recvfrom failed: errno %d", errno);
+                return;
+            }
 
-        if (len != sizeof(response_packet)) {
-            logger.printfln("Received datagram of wrong size %d from %s", len, inet_ntoa(source_addr.sin_addr));
-            return;
-        }
+            if (len != sizeof(response_packet)) {
+                logger.printfln("Received datagram of wrong size %d from %s", len, inet_ntoa(source_addr.sin_addr));
+                continue;
+            }
 
-        int charger_idx = -1;
-        for(int i = 0; i < names.size(); ++i)
-            if (source_addr.sin_family == dest_addrs[i].sin_family &&
-                source_addr.sin_port == dest_addrs[i].sin_port &&
-                source_addr.sin_addr.s_addr == dest_addrs[i].sin_addr.s_addr) {
-                charger_idx = i;
-                break;
+            int charger_idx = -1;
+            for(int i = 0; i < names.size(); ++i)
+                if (source_addr.sin_family == dest_addrs[i].sin_family &&
+                    source_addr.sin_port == dest_addrs[i].sin_port &&
+                    source_addr.sin_addr.s_addr == dest_addrs[i].sin_addr.s_addr) {
+                    charger_idx = i;
+                    break;
+                }
+
+            // Don't log in the first 20 seconds after startup: We are probably still resolving hostnames.
+            if (charger_idx == -1) {
+                if (deadline_elapsed(20000))
+                    logger.printfln("Received packet from unknown %s. Is the config complete?", inet_ntoa(source_addr.sin_addr));
+                continue;
             }
 
-        // Don't log in the first 20 seconds after startup: We are probably still resolving hostnames.
-        if (charger_idx == -1) {
-            if (deadline_elapsed(20000))
-                logger.printfln("Received packet from unknown %s. Is the config complete?", inet_ntoa(source_addr.sin_addr));
-            return;
-        }
+            response_packet response;
+            memcpy(&response, recv_buf, sizeof(response));
 
-        response_packet response;
-        memcpy(&response, recv_buf, sizeof(response));
+            if (response.header.seq_num <= last_seen_seq_num[charger_idx] && last_seen_seq_num[charger_idx] - response.header.seq_num < 5) {
+                logger.printfln("Received stale (out of order?) packet from %s (%s). Last seen seq_num is %u, Received seq_num is %u",
+                    names[charger_idx].c_str(),
+                    inet_ntoa(source_addr.sin_addr),
+                    last_seen_seq_num[charger_idx],
+                    response.header.seq_num);
+                continue;
+            }
 
-        if (response.header.seq_num <= last_seen_seq_num[charger_idx] && last_seen_seq_num[charger_idx] - response.header.seq_num < 5) {
-            logger.printfln("Received stale (out of order?) packet from %s (%s). Last seen seq_num is %u, Received seq_num is %u",
-                names[charger_idx].c_str(),
-                inet_ntoa(source_addr.sin_addr),
-                last_seen_seq_num[charger_idx],
-                response.header.seq_num);
-            return;
-        }
+            if (response.header.version != PROTOCOL_VERSION) {
+                manager_error_callback(charger_idx, CM_NETWORKING_ERROR_FW_MISMATCH);
+                logger.printfln("Received packet from %s (%s) with incompatible firmware. Our protocol version is %u, received packet had %u",
+                    names[charger_idx].c_str(),
+                    inet_ntoa(source_addr.sin_addr),
+                    PROTOCOL_VERSION,
+                    response.header.version);
+                continue;
+            }
 
-        if (response.header.version != PROTOCOL_VERSION) {
-            manager_error_callback(charger_idx, CM_NETWORKING_ERROR_FW_MISMATCH);
-            logger.printfln("Received packet from %s (%s) with incompatible firmware. Our protocol version is %u, received packet had %u",
-                names[charger_idx].c_str(),
-                inet_ntoa(source_addr.sin_addr),
-                PROTOCOL_VERSION,
-                response.header.version);
-            return;
-        }
+            last_seen_seq_num[charger_idx] = response.header.seq_num;
 
-        last_seen_seq_num[charger_idx] = response.header.seq_num;
+            if (!response.managed) {
+                manager_error_callback(charger_idx, CM_NETWORKING_ERROR_NOT_MANAGED);
+                logger.printfln("%s (%s) reports managed is not activated!",
+                    names[charger_idx].c_str(),
+                    inet_ntoa(source_addr.sin_addr));
+                continue;
+            }
 
-        if (!response.managed) {
-            manager_error_callback(charger_idx, CM_NETWORKING_ERROR_NOT_MANAGED);
-            logger.printfln("%s (%s) reports managed is not activated!",
-                names[charger_idx].c_str(),
-                inet_ntoa(source_addr.sin_addr));
-            return;
+            manager_callback(charger_idx,
+                             response.iec61851_state,
+                             response.charger_state,
+                             response.error_state,
+                             response.uptime,
+                             response.charging_time,
+                             response.allowed_charging_current,
+                             response.supported_current);
         }
-
-        manager_callback(charger_idx,
-                         response.iec61851_state,
-                         response.charger_state,
-                         response.error_state,
-                         response.uptime,
-                         response.charging_time,
-                         response.allowed_charging_current,
-                         response.supported_current);
-        }, 100, 100);
+    }, 100, 100);
 }
 
 bool CMNetworking::send_manager_update(uint8_t client_id, uint16_t allocated_current)
@@ -30,12 +30,19 @@
 #include "TFJson.h"
 
 #include <functional>
+#include <vector>
 
 #define CHARGE_MANAGER_PORT 34127
 #define CHARGE_MANAGEMENT_PORT (CHARGE_MANAGER_PORT + 1)
 
-// Keep in sync with charge_manager.cpp
+// Keep in sync with max_controlled_chargers in charge_manager/main.tsx
+// A charge_manager/config with 64 chargers needs about 7.5 KB. Only the builds for the
+// ESP32 Ethernet Brick (the ones with PSRAM) have HTTP and MQTT receive buffers that large.
+#ifdef BOARD_HAS_PSRAM
+#define MAX_CLIENTS 64
+#else
 #define MAX_CLIENTS 10
+#endif
 
 // Increment when changing packet structs
 #define PROTOCOL_VERSION 3
@@ -129,8 +136,10 @@ private:
     #define RESOLVE_STATE_NOT_RESOLVED 1
     #define RESOLVE_STATE_RESOLVED 2
 
-    uint8_t resolve_state[MAX_CLIENTS] = {};
-    struct sockaddr_in dest_addrs[MAX_CLIENTS] = {};
+    // Sized once in register_manager: dns_callback keeps pointers into resolve_state.
+    std::vector<uint8_t> resolve_state;
+    std::vector<struct sockaddr_in> dest_addrs;
+    std::vector<uint8_t> last_seen_seq_num;
     std::vector<String> hostnames;
 
     int client_sock;
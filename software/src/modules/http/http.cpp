@@ -28,7 +28,10 @@ extern API api;
 extern WebServer server;
 extern TaskScheduler task_scheduler;
 
-#if MODULE_ESP32_ETHERNET_BRICK_AVAILABLE()
+#if MODULE_ESP32_ETHERNET_BRICK_AVAILABLE() && MODULE_CHARGE_MANAGER_AVAILABLE()
+// Fits a charge_manager/config with 64 chargers, see MAX_CLIENTS.
+#define RECV_BUF_SIZE 10240
+#elif MODULE_ESP32_ETHERNET_BRICK_AVAILABLE()
 #define RECV_BUF_SIZE 4096
 #else
 #define RECV_BUF_SIZE 2048
@@ -19,6 +19,8 @@
 
 #include "meter.h"
 
+#include <string.h>
+
 #include "api.h"
 #include "event_log.h"
 #include "tools.h"
@@ -63,11 +65,47 @@ void Meter::pre_setup()
     });
 }
 
+void Meter::beginSnapshotUpdate()
+{
+    // Single writer: Only the main loop updates the snapshot.
+    snapshot_seq.store(snapshot_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void Meter::endSnapshotUpdate()
+{
+    snapshot_seq.store(snapshot_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void Meter::getSnapshot(MeterSnapshot *out)
+{
+    for (;;) {
+        uint32_t seq = snapshot_seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            // The writer can be interrupted by us. Let it finish.
+            vTaskDelay(1);
+            continue;
+        }
+
+        memcpy(out, &snapshot, sizeof(*out));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (snapshot_seq.load(std::memory_order_relaxed) == seq) {
+            out->sequence = seq / 2;
+            return;
+        }
+    }
+}
+
 void Meter::updateMeterState(uint8_t new_state, uint8_t new_type)
 {
     state.get("state")->updateUint(new_state);
     state.get("type")->updateUint(new_type);
 
+    beginSnapshotUpdate();
+    snapshot.available = new_state == 2;
+    endSnapshotUpdate();
+
     if (new_state == 2) {
         this->setupMeter(new_type);
     }
@@ -77,6 +115,10 @@ void Meter::updateMeterState(uint8_t new_state)
 {
     state.get("state")->updateUint(new_state);
 
+    beginSnapshotUpdate();
+    snapshot.available = new_state == 2;
+    endSnapshotUpdate();
+
     if (new_state == 2) {
         this->setupMeter(state.get("type")->asUint());
     }
@@ -92,11 +134,14 @@ void Meter::updateMeterValues(float power, float energy_rel, float energy_abs)
     if (!meter_setup_done)
         return;
 
-    values.get("power")->updateFloat(power);
-    values.get("energy_rel")->updateFloat(energy_rel);
-    values.get("energy_abs")->updateFloat(energy_abs);
+    beginSnapshotUpdate();
+    snapshot.power = power;
+    snapshot.energy_rel = energy_rel;
+    snapshot.energy_abs = energy_abs;
+    endSnapshotUpdate();
 
     power_hist.add_sample(power);
+    power_tiers.add_sample(power);
 }
 
 void Meter::updateMeterPhases(bool phases_connected[3], bool phases_active[3])
@@ -104,11 +149,10 @@ void Meter::updateMeterPhases(bool phases_connected[3], bool phases_active[3])
     if (!meter_setup_done)
         return;
 
-    for (int i = 0; i < 3; ++i)
-        phases.get("phases_active")->get(i)->updateBool(phases_active[i]);
-
-    for (int i = 0; i < 3; ++i)
-        phases.get("phases_connected")->get(i)->updateBool(phases_connected[i]);
+    beginSnapshotUpdate();
+    memcpy(snapshot.phases_connected, phases_connected, sizeof(snapshot.phases_connected));
+    memcpy(snapshot.phases_active, phases_active, sizeof(snapshot.phases_active));
+    endSnapshotUpdate();
 }
 
 void Meter::updateMeterAllValues(int idx, float val)
@@ -116,7 +160,17 @@ void Meter::updateMeterAllValues(int idx, float val)
     if (!meter_setup_done)
         return;
 
-    all_values.get(idx)->updateFloat(val);
+    if (idx < 0 || idx >= METER_ALL_VALUES_COUNT)
+        return;
+
+    beginSnapshotUpdate();
+    snapshot.all_values[idx] = val;
+    endSnapshotUpdate();
+
+#if defined(BOARD_HAS_PSRAM)
+    if (idx >= METER_ALL_VALUES_CURRENT_L1_A && idx <= METER_ALL_VALUES_CURRENT_L3_A)
+        current_tiers[idx - METER_ALL_VALUES_CURRENT_L1_A].add_sample(val);
+#endif
 }
 
 void Meter::updateMeterAllValues(float values[METER_ALL_VALUES_COUNT])
@@ -124,8 +178,14 @@ void Meter::updateMeterAllValues(float values[METER_ALL_VALUES_COUNT])
     if (!meter_setup_done)
         return;
 
-    for (int i = 0; i < METER_ALL_VALUES_COUNT; ++i)
-        all_values.get(i)->updateFloat(values[i]);
+    beginSnapshotUpdate();
+    memcpy(snapshot.all_values, values, sizeof(snapshot.all_values));
+    endSnapshotUpdate();
+
+#if defined(BOARD_HAS_PSRAM)
+    for (int i = 0; i < 3; ++i)
+        current_tiers[i].add_sample(values[METER_ALL_VALUES_CURRENT_L1_A + i]);
+#endif
 }
 
 void Meter::registerResetCallback(std::function<void(void)> cb)
@@ -145,6 +205,11 @@ void Meter::setupMeter(uint8_t meter_type)
     }
 
     power_hist.setup();
+    power_tiers.setup();
+#if defined(BOARD_HAS_PSRAM)
+    for (TieredHistory &tiers : current_tiers)
+        tiers.setup();
+#endif
 
     for (int i = all_values.count(); i < METER_ALL_VALUES_COUNT; ++i) {
         all_values.add();
@@ -182,8 +247,41 @@ void Meter::register_urls()
     }, true);
 
     power_hist.register_urls("meter/");
+    power_tiers.register_urls("meter/");
+#if defined(BOARD_HAS_PSRAM)
+    for (TieredHistory &tiers : current_tiers)
+        tiers.register_urls("meter/");
+#endif
+}
+
+void Meter::publishSnapshot()
+{
+    // Only the main loop writes the snapshot, so it can be read directly here.
+    values.get("power")->updateFloat(snapshot.power);
+    values.get("energy_rel")->updateFloat(snapshot.energy_rel);
+    values.get("energy_abs")->updateFloat(snapshot.energy_abs);
+
+    for (int i = 0; i < 3; ++i)
+        phases.get("phases_active")->get(i)->updateBool(snapshot.phases_active[i]);
+
+    for (int i = 0; i < 3; ++i)
+        phases.get("phases_connected")->get(i)->updateBool(snapshot.phases_connected[i]);
+
+    for (int i = 0; i < METER_ALL_VALUES_COUNT; ++i)
+        all_values.get(i)->updateFloat(snapshot.all_values[i]);
 }
 
 void Meter::loop()
 {
+    if (!meter_setup_done)
+        return;
+
+    // The config tree is only a published copy of the snapshot.
+    // Update it once per loop, not once per value.
+    uint32_t seq = snapshot_seq.load(std::memory_order_relaxed);
+    if (seq == published_seq)
+        return;
+
+    published_seq = seq;
+    publishSnapshot();
 }
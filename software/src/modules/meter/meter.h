@@ -19,9 +19,12 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "config.h"
 
 #include "value_history.h"
+#include "tiered_history.h"
 
 #define METER_ALL_VALUES_COUNT 85
 
@@ -116,6 +119,18 @@
 #define METER_ALL_VALUES_TOTAL_KVARH_L2 83
 #define METER_ALL_VALUES_TOTAL_KVARH_L3 84
 
+// Plain copy of the meter state and values.
+struct MeterSnapshot {
+    uint32_t sequence; // increases with every update
+    bool available; // meter/state["state"] is 2
+    float power;
+    float energy_rel;
+    float energy_abs;
+    bool phases_connected[3];
+    bool phases_active[3];
+    float all_values[METER_ALL_VALUES_COUNT];
+};
+
 class Meter
 {
 public:
@@ -137,6 +152,11 @@ public:
 
     void setupMeter(uint8_t meter_type);
 
+    // Copies the current values without locking and without going through the
+    // config tree. May be called from any task. The update functions above
+    // must only be called from one task (the main loop).
+    void getSnapshot(MeterSnapshot *out);
+
     bool initialized = false;
     bool meter_setup_done = false;
 
@@ -147,6 +167,22 @@ public:
     ConfigRoot last_reset;
 
     ValueHistory power_hist;
+    TieredHistory power_tiers{"power", 1.0f}; // W
+
+#if defined(BOARD_HAS_PSRAM)
+    // Phase currents (METER_ALL_VALUES_CURRENT_L1_A to L3_A) in 10 mA
+    TieredHistory current_tiers[3] = {{"current_l1", 100.0f}, {"current_l2", 100.0f}, {"current_l3", 100.0f}};
+#endif
 
     std::vector<std::function<void(void)>> reset_callbacks;
+
+private:
+    void beginSnapshotUpdate();
+    void endSnapshotUpdate();
+    void publishSnapshot();
+
+    // Seqlock: odd while the snapshot is written.
+    std::atomic<uint32_t> snapshot_seq{0};
+    MeterSnapshot snapshot = {};
+    uint32_t published_seq = 0;
 };
@@ -0,0 +1,358 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "tiered_history.h"
+
+#include <LittleFS.h>
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#include "esp_heap_caps.h"
+#include "event_log.h"
+#include "malloc_tools.h"
+#include "task_scheduler.h"
+#include "tools.h"
+#include "web_server.h"
+
+extern EventLog logger;
+extern TaskScheduler task_scheduler;
+extern WebServer server;
+
+// One finished hour of a segment file.
+struct HistoryRecord {
+    uint64_t quarters[4];
+    uint64_t hour;
+    uint32_t timestamp_minutes; // End of the hour. 0 if the clock was not synced.
+    uint32_t reserved;
+};
+
+static_assert(sizeof(HistoryRecord) == 48, "Unexpected size of HistoryRecord");
+
+#define SEGMENT_MAX_FILE_SIZE (TIERED_HISTORY_SEGMENT_RECORDS * sizeof(HistoryRecord))
+
+static const char *tier_suffixes[TIERED_HISTORY_TIER_COUNT] = {"1m", "15m", "1h"};
+
+// Buckets are stored as one uint64_t: The ring buffers may live in memory
+// that only allows 32 bit accesses (see malloc_32bit_addressed).
+static uint64_t pack_bucket(const HistoryBucket &bucket)
+{
+    return (uint64_t)(uint16_t)bucket.min
+         | (uint64_t)(uint16_t)bucket.max << 16
+         | (uint64_t)(uint16_t)bucket.avg << 32
+         | (uint64_t)bucket.count << 48;
+}
+
+static HistoryBucket unpack_bucket(uint64_t packed)
+{
+    HistoryBucket bucket;
+    bucket.min = (int16_t)(packed & 0xFFFF);
+    bucket.max = (int16_t)((packed >> 16) & 0xFFFF);
+    bucket.avg = (int16_t)((packed >> 32) & 0xFFFF);
+    bucket.count = (uint16_t)(packed >> 48);
+    return bucket;
+}
+
+static int16_t to_int16(float value)
+{
+    if (isnan(value))
+        return 0;
+
+    return (int16_t)lroundf(std::max((float)INT16_MIN, std::min((float)INT16_MAX, value)));
+}
+
+void TieredHistory::accumulate(accumulator_t *acc, int16_t min, int16_t max, float sum, uint32_t count)
+{
+    if (count == 0)
+        return;
+
+    if (acc->count == 0) {
+        acc->min = min;
+        acc->max = max;
+    } else {
+        acc->min = std::min(acc->min, min);
+        acc->max = std::max(acc->max, max);
+    }
+
+    acc->sum += sum;
+    acc->count += count;
+}
+
+HistoryBucket TieredHistory::finish(accumulator_t *acc)
+{
+    HistoryBucket bucket = {0, 0, 0, 0};
+
+    if (acc->count > 0) {
+        bucket.min = acc->min;
+        bucket.max = acc->max;
+        bucket.avg = to_int16(acc->sum / acc->count);
+        bucket.count = (uint16_t)std::min(acc->count, (uint32_t)UINT16_MAX);
+    }
+
+    *acc = {0, 0, 0, 0};
+    return bucket;
+}
+
+void TieredHistory::setup()
+{
+    static const uint16_t tier_layout[TIERED_HISTORY_TIER_COUNT][2] = TIERED_HISTORY_TIERS;
+
+    for (size_t i = 0; i < TIERED_HISTORY_TIER_COUNT; ++i) {
+        tier_t &tier = tiers[i];
+        tier.interval_minutes = tier_layout[i][0];
+        tier.size = tier_layout[i][1];
+        tier.start = 0;
+        tier.used = 0;
+        tier.parts = 0;
+        tier.acc = {0, 0, 0, 0};
+#if defined(BOARD_HAS_PSRAM)
+        tier.buf = (uint64_t *)malloc_psram(tier.size * sizeof(uint64_t));
+#else
+        tier.buf = (uint64_t *)malloc_32bit_addressed(tier.size * sizeof(uint64_t));
+#endif
+        if (tier.buf == nullptr) {
+            logger.printfln("Failed to allocate %s history", name);
+            for (size_t j = 0; j < i; ++j) {
+                heap_caps_free(tiers[j].buf);
+                tiers[j].buf = nullptr;
+            }
+            return;
+        }
+    }
+
+    // mkdir also returns true if the directory already exists and is a directory.
+    persist = LittleFS.mkdir(TIERED_HISTORY_FOLDER);
+    if (persist)
+        restoreSegments();
+    else
+        logger.printfln("Failed to create meter history folder!");
+
+    task_scheduler.scheduleWithFixedDelay([this](){
+        this->tick();
+    }, 60 * 1000, 60 * 1000);
+}
+
+void TieredHistory::add_sample(float sample)
+{
+    if (tiers[0].buf == nullptr || isnan(sample))
+        return;
+
+    float value = std::max((float)INT16_MIN, std::min((float)INT16_MAX, sample * scale));
+    int16_t rounded = to_int16(value);
+    accumulate(&tiers[0].acc, rounded, rounded, value, 1);
+}
+
+void TieredHistory::push(size_t tier_idx, const HistoryBucket &bucket)
+{
+    tier_t &tier = tiers[tier_idx];
+
+    size_t idx = tier.start + tier.used;
+    if (idx >= tier.size)
+        idx -= tier.size;
+
+    tier.buf[idx] = pack_bucket(bucket);
+
+    if (tier.used < tier.size) {
+        ++tier.used;
+    } else if (++tier.start == tier.size) {
+        tier.start = 0;
+    }
+}
+
+bool TieredHistory::get_bucket(size_t tier_idx, size_t offset, HistoryBucket *bucket)
+{
+    if (tier_idx >= TIERED_HISTORY_TIER_COUNT || offset >= tiers[tier_idx].used)
+        return false;
+
+    const tier_t &tier = tiers[tier_idx];
+
+    size_t idx = tier.start + offset;
+    if (idx >= tier.size)
+        idx -= tier.size;
+
+    *bucket = unpack_bucket(tier.buf[idx]);
+    return true;
+}
+
+void TieredHistory::tick()
+{
+    if (tiers[0].buf == nullptr)
+        return;
+
+    HistoryBucket bucket = finish(&tiers[0].acc);
+    push(0, bucket);
+
+    for (size_t i = 1; i < TIERED_HISTORY_TIER_COUNT; ++i) {
+        tier_t &tier = tiers[i];
+
+        accumulate(&tier.acc, bucket.min, bucket.max, (float)bucket.avg * bucket.count, bucket.count);
+        if (i == 2)
+            quarters[tier.parts] = bucket;
+
+        if (++tier.parts < tier.interval_minutes / tiers[i - 1].interval_minutes)
+            return;
+
+        tier.parts = 0;
+        bucket = finish(&tier.acc);
+        push(i, bucket);
+    }
+
+    if (persist)
+        appendRecord(bucket);
+}
+
+String TieredHistory::segmentFilename(uint32_t segment)
+{
+    return String(TIERED_HISTORY_FOLDER) + "/" + name + "-" + segment + ".bin";
+}
+
+void TieredHistory::restoreSegments()
+{
+    String prefix = String(name) + "-";
+    std::vector<uint32_t> segments;
+
+    File folder = LittleFS.open(TIERED_HISTORY_FOLDER);
+    File f;
+    while (f = folder.openNextFile()) {
+        String file_name = String(f.name());
+        if (f.isDirectory() || !file_name.startsWith(prefix) || !file_name.endsWith(".bin"))
+            continue;
+
+        long segment = file_name.substring(prefix.length(), file_name.length() - 4).toInt();
+        if (segment > 0)
+            segments.push_back(segment);
+    }
+    folder.close();
+
+    if (segments.empty())
+        return;
+
+    std::sort(segments.begin(), segments.end());
+
+    // Segments are removed oldest first. Anything left over from an
+    // interrupted removal (or an older layout) is removed here.
+    while (segments.size() > TIERED_HISTORY_SEGMENT_COUNT) {
+        LittleFS.remove(segmentFilename(segments.front()));
+        segments.erase(segments.begin());
+    }
+
+    first_segment = segments.front();
+    last_segment = segments.back();
+
+    for (uint32_t segment : segments) {
+        f = LittleFS.open(segmentFilename(segment));
+        size_t records = f.size() / sizeof(HistoryRecord);
+
+        // LittleFS caches internally, so reading one record at a time is fine.
+        for (size_t i = 0; i < records; ++i) {
+            HistoryRecord record;
+            if (f.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+                break;
+
+            for (size_t q = 0; q < ARRAY_SIZE(record.quarters); ++q)
+                push(1, unpack_bucket(record.quarters[q]));
+            push(2, unpack_bucket(record.hour));
+        }
+    }
+
+    // The time while the ESP was off is unknown. Mark it with one empty interval.
+    if (tiers[1].used > 0) {
+        HistoryBucket empty = {0, 0, 0, 0};
+        push(1, empty);
+        push(2, empty);
+    }
+}
+
+void TieredHistory::appendRecord(const HistoryBucket &hour)
+{
+    HistoryRecord record;
+    for (size_t q = 0; q < ARRAY_SIZE(record.quarters); ++q)
+        record.quarters[q] = pack_bucket(quarters[q]);
+    record.hour = pack_bucket(hour);
+    record.timestamp_minutes = timestamp_minutes();
+    record.reserved = 0;
+
+    File file = LittleFS.open(segmentFilename(last_segment), "a", true);
+
+    // Never rewrite a segment: A full or damaged segment is continued in the next one.
+    if (file.size() >= SEGMENT_MAX_FILE_SIZE || file.size() % sizeof(HistoryRecord) != 0) {
+        file.close();
+
+        ++last_segment;
+        while (last_segment - first_segment + 1 > TIERED_HISTORY_SEGMENT_COUNT) {
+            LittleFS.remove(segmentFilename(first_segment));
+            ++first_segment;
+        }
+
+        file = LittleFS.open(segmentFilename(last_segment), "w", true);
+    }
+
+    if (file.write((const uint8_t *)&record, sizeof(record)) != sizeof(record))
+        logger.printfln("Failed to write %s history", name);
+}
+
+void TieredHistory::register_urls(String base_url)
+{
+    for (size_t tier_idx = 0; tier_idx < TIERED_HISTORY_TIER_COUNT; ++tier_idx) {
+        String url = "/" + base_url + name + "_history_" + tier_suffixes[tier_idx];
+
+        server.on(url.c_str(), HTTP_GET, [this, tier_idx](WebServerRequest request) {
+            if (tiers[tier_idx].buf == nullptr)
+                return request.send(400, "text/html", "not initialized");
+
+            request.beginChunkedResponse(200, "application/json; charset=utf-8");
+            WebServerChunkWriter writer{&request};
+
+            writer.write("{\"interval\":");
+            writer.writeInt(tiers[tier_idx].interval_minutes * 60);
+
+            static const char *keys[3] = {",\"min\":[", ",\"max\":[", ",\"avg\":["};
+            for (size_t k = 0; k < ARRAY_SIZE(keys); ++k) {
+                writer.write(keys[k]);
+
+                HistoryBucket bucket;
+                for (size_t i = 0; get_bucket(tier_idx, i, &bucket); ++i) {
+                    if (i != 0)
+                        writer.write(',');
+
+                    // Intervals without samples (for example while the ESP was off) are null.
+                    if (bucket.count == 0) {
+                        writer.write("null", 4);
+                        continue;
+                    }
+
+                    int16_t val = k == 0 ? bucket.min : (k == 1 ? bucket.max : bucket.avg);
+                    if (scale == 1.0f) {
+                        writer.writeInt(val);
+                    } else {
+                        char num[16];
+                        writer.write(num, snprintf(num, sizeof(num), "%g", val / scale));
+                    }
+                }
+
+                writer.write(']');
+            }
+
+            writer.write('}');
+            writer.flush();
+            return request.endChunkedResponse();
+        });
+    }
+}
@@ -0,0 +1,117 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Aggregate of the samples of one interval. Values are stored
+// as multiples of 1 / scale of the channel, see TieredHistory.
+struct HistoryBucket {
+    int16_t min;
+    int16_t max;
+    int16_t avg;
+    uint16_t count; // 0 if there was no sample in this interval, for example after a reboot.
+};
+
+#define TIERED_HISTORY_TIER_COUNT 3
+
+// Minutes of the intervals of the tiers and how many intervals are kept:
+// 1 minute for 4 hours, 15 minutes for 2 days and 1 hour for 14 days.
+#define TIERED_HISTORY_TIERS {{1, 4 * 60}, {15, 2 * 24 * 4}, {60, 14 * 24}}
+
+// Hourly records per segment file and how many segment files are kept.
+#define TIERED_HISTORY_SEGMENT_RECORDS 24
+#define TIERED_HISTORY_SEGMENT_COUNT 15
+
+#define TIERED_HISTORY_FOLDER "/meter-history"
+
+// Keeps the minimum, maximum and average of a channel (for example the
+// charging power or a phase current) in multiple resolutions. The raw
+// samples are not kept here, see ValueHistory::live for those.
+//
+// The minute tier is aggregated from the samples, every other tier from
+// the finished intervals of the tier below.
+//
+// Every finished hour is appended together with its quarter hours to a
+// segment file. Segments are only ever appended to and deleted as a whole,
+// so an hour costs one small write to the flash. The quarter hour and hour
+// tiers are restored from the segments after a reboot.
+class TieredHistory
+{
+public:
+    // name is used in the URLs and file names.
+    // scale converts a sample into the stored int16 value.
+    TieredHistory(const char *name, float scale) : name(name), scale(scale)
+    {
+    }
+
+    void setup();
+    void register_urls(String base_url);
+    void add_sample(float sample);
+
+    bool get_bucket(size_t tier, size_t offset, HistoryBucket *bucket);
+    size_t used(size_t tier) { return tiers[tier].used; }
+
+private:
+    // Aggregate of an unfinished interval
+    struct accumulator_t {
+        int16_t min;
+        int16_t max;
+        float sum;
+        uint32_t count;
+    };
+
+    struct tier_t {
+        uint16_t interval_minutes;
+        uint16_t size;
+        uint16_t start;
+        uint16_t used;
+        uint64_t *buf;
+
+        accumulator_t acc;
+        // Intervals of the tier below that are part of acc.
+        uint16_t parts;
+    };
+
+    static void accumulate(accumulator_t *acc, int16_t min, int16_t max, float sum, uint32_t count);
+    static HistoryBucket finish(accumulator_t *acc);
+
+    void tick();
+    void push(size_t tier, const HistoryBucket &bucket);
+
+    String segmentFilename(uint32_t segment);
+    void restoreSegments();
+    void appendRecord(const HistoryBucket &hour);
+
+    const char *name;
+    float scale;
+
+    tier_t tiers[TIERED_HISTORY_TIER_COUNT] = {};
+
+    // Quarter hours of the current hour, for the segment record.
+    HistoryBucket quarters[4] = {};
+
+    uint32_t first_segment = 1;
+    uint32_t last_segment = 1;
+    bool persist = false;
+};
@@ -19,6 +19,8 @@
 
 #include "value_history.h"
 
+#include <algorithm>
+
 void ValueHistory::setup()
 {
     history.setup();
@@ -53,6 +55,9 @@ void ValueHistory::setup()
     }, 1000 * 60 * HISTORY_MINUTE_INTERVAL, 1000 * 60 * HISTORY_MINUTE_INTERVAL);
 }
 
+// Samples are copied out of the ring buffers in spans of this size.
+#define RENDER_SPAN_SIZE 64
+
 void ValueHistory::register_urls(String base_url)
 {
     server.on(("/" + base_url + "history").c_str(), HTTP_GET, [this](WebServerRequest request) {
@@ -61,30 +66,36 @@ void ValueHistory::register_urls(String base_url)
             return;
         }*/
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        std::unique_ptr<char[]> buf{new char[buf_size]};
-        size_t buf_written = 0;
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        WebServerChunkWriter writer{&request};
 
-        int16_t val;
-        history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < history.used() && history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, ",%d", (int)val);
-        }
+        int16_t span[RENDER_SPAN_SIZE];
+        size_t offset = 0;
+        size_t count;
 
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, "%c", ']');
+        writer.write('[');
+
+        // Always render at least one value, even if the ring buffer is empty.
+        if (history.used() == 0)
+            writer.write('0');
+
+        while ((count = history.peek_range(span, offset, RENDER_SPAN_SIZE)) > 0) {
+            for (size_t i = 0; i < count; ++i) {
+                if (offset + i != 0)
+                    writer.write(',');
+
+                // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
+                if (span[i] < 0)
+                    writer.write("null", 4);
+                else
+                    writer.writeInt(span[i]);
+            }
+            offset += count;
+        }
 
-        return request.send(200, "application/json; charset=utf-8", buf.get(), buf_written);
+        writer.write(']');
+        writer.flush();
+        return request.endChunkedResponse();
     });
 
     server.on(("/" + base_url + "live").c_str(), HTTP_GET, [this](WebServerRequest request) {
@@ -93,26 +104,43 @@ void ValueHistory::register_urls(String base_url)
             return;
         }*/
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        std::unique_ptr<char[]> buf{new char[buf_size]};
-        size_t buf_written = 0;
-
-        int16_t val;
-        live.peek(&val);
         float samples_per_second = 0;
         if (this->samples_per_interval > 0) {
             samples_per_second = ((float)this->samples_per_interval) / (60 * HISTORY_MINUTE_INTERVAL);
         } else {
             samples_per_second = (float)this->samples_last_interval / millis() * 1000;
         }
-        buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, "{\"samples_per_second\":%f,\"samples\":[%d", samples_per_second, val);
 
-        for (int i = 1; (i < live.used() - 1) && live.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, ",%d", val);
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        WebServerChunkWriter writer{&request};
+
+        char header[64];
+        writer.write(header, snprintf(header, sizeof(header), "{\"samples_per_second\":%f,\"samples\":[", samples_per_second));
+
+        // The newest sample is left out, unless it is the only one.
+        // If there are no samples, a single 0 is rendered.
+        size_t used = live.used();
+        size_t to_render = used > 1 ? used - 1 : used;
+
+        if (used == 0)
+            writer.write('0');
+
+        int16_t span[RENDER_SPAN_SIZE];
+        size_t offset = 0;
+        size_t count;
+
+        while (offset < to_render && (count = live.peek_range(span, offset, std::min(to_render - offset, (size_t)RENDER_SPAN_SIZE))) > 0) {
+            for (size_t i = 0; i < count; ++i) {
+                if (offset + i != 0)
+                    writer.write(',');
+                writer.writeInt(span[i]);
+            }
+            offset += count;
         }
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf.get() + buf_written, buf_size - buf_written, "%s", "]}");
-        return request.send(200, "application/json; charset=utf-8", buf.get(), buf_written);
+
+        writer.write("]}", 2);
+        writer.flush();
+        return request.endChunkedResponse();
     });
 }
 
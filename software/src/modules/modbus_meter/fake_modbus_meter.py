@@ -1,9 +1,16 @@
 #!/usr/bin/env python
 # -*- coding: utf-8 -*-
 
+# Simulates an energy meter with a RS485 bricklet in Modbus slave mode.
+# Every input register answers with a float derived from its address.
+# Reads are recorded per register, the achieved refresh rate of every
+# register that was read is printed every --report seconds.
+
 HOST = "localhost"
 PORT = 4223
 
+import argparse
+import threading
 import time
 import sys
 from struct import pack, unpack
@@ -11,12 +18,75 @@ from struct import pack, unpack
 from tinkerforge.ip_connection import IPConnection
 from tinkerforge.bricklet_rs485 import BrickletRS485
 
+args = None
+stats_lock = threading.Lock()
+# register -> [read count, first read, last read, max gap]
+stats = {}
+requests = [0, 0] # count, registers
+
+def register_value(register):
+    # Registers hold word-swapped floats, each float takes two registers.
+    first = register - (register - 1) % 2
+    value = first + 0.5
+    low, high = unpack('<HH', pack('<f', value))
+    return high if register == first else low
+
+def record_read(starting_address, count):
+    now = time.monotonic()
+
+    with stats_lock:
+        requests[0] += 1
+        requests[1] += count
+
+        for register in range(starting_address, starting_address + count):
+            entry = stats.get(register)
+            if entry is None:
+                stats[register] = [1, now, now, 0]
+                continue
+
+            entry[3] = max(entry[3], now - entry[2])
+            entry[0] += 1
+            entry[2] = now
+
+def print_report():
+    with stats_lock:
+        if len(stats) == 0:
+            print("No reads yet")
+            return
+
+        now = time.monotonic()
+        start = min(entry[1] for entry in stats.values())
+        duration = max(now - start, 1e-3)
+
+        print("{:.1f} s: {} requests, {:.1f} registers per request".format(duration, requests[0], requests[1] / max(requests[0], 1)))
+        print("register   rate [Hz]   max gap [ms]")
+
+        # Only print the first register of each float
+        for register in sorted(stats):
+            if register % 2 == 0:
+                continue
+            count, first, _last, max_gap = stats[register]
+            print("{:8d}   {:9.3f}   {:12.0f}".format(register, count / duration, max_gap * 1000))
+
+        stats.clear()
+        requests[0] = 0
+        requests[1] = 0
+
 # Callback function for Modbus master write single register response callback
 def cb_modbus_slave_read_input_registers_request(rs485, uid, request_id, starting_address, count):
-    regs = [0, 0]
-    regs[1], regs[0] = unpack('<HH', pack('<f', 42.23))
+    record_read(starting_address, count)
+
+    if args.delay > 0:
+        time.sleep(args.delay / 1000)
+
+    regs = [register_value(r) for r in range(starting_address, starting_address + count)]
     rs485.modbus_slave_answer_read_input_registers_request(request_id, regs)
 
+def cb_modbus_slave_read_holding_registers_request(rs485, uid, request_id, starting_address, count):
+    # Meter ID register used for the meter type detection
+    regs = [args.meter_id if starting_address + i == 64515 else 0 for i in range(count)]
+    rs485.modbus_slave_answer_read_holding_registers_request(request_id, regs)
+
 # Print incoming enumeration
 def cb_enumerate(ipcon, uid, connected_uid, position, hardware_version, firmware_version,
                  device_identifier, enumeration_type):
@@ -32,17 +102,28 @@ def cb_enumerate(ipcon, uid, connected_uid, position, hardware_version, firmware
     rs485.set_rs485_configuration(9600, 0, 1, 8, 0)
     rs485.register_callback(rs485.CALLBACK_MODBUS_SLAVE_READ_INPUT_REGISTERS_REQUEST,
                             lambda *args: cb_modbus_slave_read_input_registers_request(rs485, uid, *args))
+    rs485.register_callback(rs485.CALLBACK_MODBUS_SLAVE_READ_HOLDING_REGISTERS_REQUEST,
+                            lambda *args: cb_modbus_slave_read_holding_registers_request(rs485, uid, *args))
 
 if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default=HOST)
+    parser.add_argument('--port', type=int, default=PORT)
+    parser.add_argument('--meter-id', type=lambda x: int(x, 0), default=0x0070, help='value of holding register 64515 (0x0070: SDM630, 0x0089: SDM72DM-V2)')
+    parser.add_argument('--delay', type=float, default=0, help='additional response delay in ms, to check the adaptive pacing')
+    parser.add_argument('--report', type=float, default=60, help='seconds between refresh rate reports')
+    args = parser.parse_args()
+
     ipcon = IPConnection()
-    ipcon.connect(HOST, PORT)
+    ipcon.connect(args.host, args.port)
     # Register Enumerate Callback
-    ipcon.register_callback(IPConnection.CALLBACK_ENUMERATE, lambda *args: cb_enumerate(ipcon, *args))
+    ipcon.register_callback(IPConnection.CALLBACK_ENUMERATE, lambda *cb_args: cb_enumerate(ipcon, *cb_args))
 
     # Trigger Enumerate
     ipcon.enumerate()
     print("!!!Reset both ESP Bricks!!!")
     while True:
-       time.sleep(1)
+        time.sleep(args.report)
+        print_report()
     #input("Press key to exit\n") # Use raw_input() in Python 2
     #ipcon.disconnect()
@@ -1,16 +1,162 @@
 #include "meter_defs.h"
 
-void convert_to_float(const uint16_t *regs, float *target, const uint16_t *indices, size_t count)
+#include <string.h>
+
+#include "event_log.h"
+#include "read_scheduler.h"
+
+extern EventLog logger;
+
+uint8_t meter_value_registers(MeterValueType type)
+{
+    switch (type) {
+        case MeterValueType::UINT16:
+        case MeterValueType::INT16:
+            return 1;
+        case MeterValueType::FLOAT:
+        case MeterValueType::UINT32:
+        case MeterValueType::INT32:
+        case MeterValueType::UINT32_LW:
+        case MeterValueType::INT32_LW:
+            return 2;
+        case MeterValueType::UINT64:
+        case MeterValueType::INT64:
+            return 4;
+    }
+
+    return 0;
+}
+
+void convert_float_runs(const uint16_t *regs, float *target, const FloatRun *runs, size_t run_count)
+{
+    for (size_t r = 0; r < run_count; ++r) {
+        // Copy the run to locals: The stores below may alias anything.
+        const uint16_t *src = regs + runs[r].reg;
+        const uint16_t *end = src + 2 * runs[r].count;
+        float *dst = target + runs[r].target;
+
+        // The high word comes first. Copy the bits instead of going through
+        // a float temporary to keep NaN payloads intact.
+        // Load both registers at once and swap the halves (a rotate).
+        // Like the register buffer itself, this assumes a little endian CPU.
+        for (; src != end; src += 2, ++dst) {
+            uint32_t bits;
+            memcpy(&bits, src, sizeof(bits));
+            bits = (bits << 16) | (bits >> 16);
+            memcpy(dst, &bits, sizeof(bits));
+        }
+    }
+}
+
+static uint32_t high_word_first(const uint16_t *regs)
+{
+    return ((uint32_t)regs[0] << 16) | regs[1];
+}
+
+static float decode_value(const uint16_t *regs, const MeterValueDef *def)
+{
+    float raw = 0;
+
+    switch (def->type) {
+        case MeterValueType::FLOAT: {
+            uint32_t bits = high_word_first(regs);
+            memcpy(&raw, &bits, sizeof(raw));
+            break;
+        }
+        case MeterValueType::UINT16:
+            raw = regs[0];
+            break;
+        case MeterValueType::INT16:
+            raw = (int16_t)regs[0];
+            break;
+        case MeterValueType::UINT32:
+            raw = high_word_first(regs);
+            break;
+        case MeterValueType::INT32:
+            raw = (int32_t)high_word_first(regs);
+            break;
+        case MeterValueType::UINT32_LW:
+            raw = ((uint32_t)regs[1] << 16) | regs[0];
+            break;
+        case MeterValueType::INT32_LW:
+            raw = (int32_t)(((uint32_t)regs[1] << 16) | regs[0]);
+            break;
+        case MeterValueType::UINT64:
+            raw = ((uint64_t)high_word_first(regs) << 32) | high_word_first(regs + 2);
+            break;
+        case MeterValueType::INT64:
+            raw = (int64_t)(((uint64_t)high_word_first(regs) << 32) | high_word_first(regs + 2));
+            break;
+    }
+
+    return raw * def->scale;
+}
+
+void MeterDecoder::setup(const MeterInfo *meter, const ReadScheduler *scheduler)
 {
-    union {
-        float f;
-        uint16_t regs[2];
-    } value;
-
-    for (size_t i = 0; i < count; ++i) {
-        size_t reg = indices[i] - 1; // -1: convert from register to address
-        value.regs[1] = regs[reg + 0];
-        value.regs[0] = regs[reg + 1];
-        target[i] = value.f;
+    for (group_t &group : groups) {
+        group.float_runs.clear();
+        group.values.clear();
     }
+    memset(targets, 0, sizeof(targets));
+
+    uint32_t fast_interval = UINT32_MAX;
+    for (size_t i = 0; i < meter->values_len; ++i)
+        if (meter->values[i].interval_ms < fast_interval)
+            fast_interval = meter->values[i].interval_ms;
+
+    uint8_t fast_targets = 0;
+
+    for (size_t i = 0; i < meter->values_len; ++i) {
+        const MeterValueDef *def = &meter->values[i];
+
+        int offset = scheduler->buffer_offset(def->reg, meter_value_registers(def->type));
+        if (offset < 0 || def->target >= METER_VALUE_COUNT) {
+            logger.printfln("%s: Ignoring value at register %u", meter->meter_name, def->reg);
+            continue;
+        }
+
+        bool fast = def->interval_ms == fast_interval;
+        group_t &group = groups[fast ? 0 : 1];
+
+        targets[def->target / 8] |= 1 << (def->target % 8);
+
+        if (fast && def->target <= METER_ALL_VALUES_CURRENT_L3_A)
+            fast_targets |= 1 << def->target;
+
+        if (def->type != MeterValueType::FLOAT || def->scale != 1.0f) {
+            group.values.push_back({(uint16_t)offset, def});
+            continue;
+        }
+
+        if (!group.float_runs.empty()) {
+            FloatRun &last = group.float_runs.back();
+            if (offset == last.reg + 2 * last.count && def->target == last.target + last.count) {
+                ++last.count;
+                continue;
+            }
+        }
+
+        group.float_runs.push_back({(uint16_t)offset, def->target, 1});
+    }
+
+    // Voltages and currents of L1 to L3
+    phases = fast_targets == 0x3F;
+}
+
+void MeterDecoder::decode(const uint16_t *regs, bool fast_only, float *values) const
+{
+    for (size_t g = 0; g < (fast_only ? 1 : 2); ++g) {
+        const group_t &group = groups[g];
+
+        convert_float_runs(regs, values, group.float_runs.data(), group.float_runs.size());
+
+        for (const value_t &value : group.values)
+            values[value.def->target] = decode_value(regs + value.offset, value.def);
+    }
+}
+
+bool MeterDecoder::has_target(uint8_t target) const
+{
+    return target < METER_VALUE_COUNT && (targets[target / 8] & (1 << (target % 8))) != 0;
 }
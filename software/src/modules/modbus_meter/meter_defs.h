@@ -2,29 +2,120 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <vector>
+
+#include "modules/meter/meter.h"
+
+// Maximum number of registers per read input registers request.
+#define MODBUS_MAX_READ_REGISTERS 125
 
 #define PHASE_ACTIVE_CURRENT_THRES 0.3f // ampere
 #define PHASE_CONNECTED_VOLTAGE_THRES 180.0f // volts
 
-struct RegRead {
-    uint16_t start;
-    uint16_t len;
+// Refresh intervals of meter values
+#define READ_INTERVAL_FAST_MS 500
+#define READ_INTERVAL_SLOW_MS 2000
+#define READ_INTERVAL_RARE_MS 30000
+
+// Targets of meter values that are not part of meter/all_values.
+// Meter values are decoded into a float array indexed by
+// METER_ALL_VALUES_* or these targets.
+#define METER_VALUE_POWER (METER_ALL_VALUES_COUNT + 0)
+#define METER_VALUE_ENERGY_REL (METER_ALL_VALUES_COUNT + 1)
+#define METER_VALUE_ENERGY_ABS (METER_ALL_VALUES_COUNT + 2)
+#define METER_VALUE_COUNT (METER_ALL_VALUES_COUNT + 3)
+
+enum class MeterValueType : uint8_t {
+    FLOAT,     // IEEE 754, high word first
+    UINT16,
+    INT16,
+    UINT32,    // high word first
+    INT32,     // high word first
+    UINT32_LW, // low word first
+    INT32_LW,  // low word first
+    UINT64,    // high word first
+    INT64,     // high word first
+};
+
+// One value of a meter. The raw register value is multiplied with scale.
+//
+// All values read with the shortest interval of a meter form the fast group:
+// Power, energies and the voltages and currents used for the phase detection
+// are updated from it. meter/all_values is updated from all values, after
+// the values with the second shortest interval were read.
+struct MeterValueDef {
+    uint16_t reg; // first input register, as in the manual of the meter (1-based)
+    MeterValueType type;
+    float scale;
+    uint8_t target; // METER_ALL_VALUES_* or METER_VALUE_*
+    uint32_t interval_ms;
 };
 
+#define METER_FLOAT(reg, target, interval_ms) {reg, MeterValueType::FLOAT, 1.0f, target, interval_ms}
+
 struct MeterInfo {
     uint16_t meter_id; // read from holding register 64515
     uint8_t meter_type; // will be written into meter/state["type"] if holding register 64515 contains the meter_id
+    const char *meter_name;
 
-    const RegRead *to_read_slow;
-    size_t to_read_slow_len;
+    const MeterValueDef *values;
+    size_t values_len;
 
-    const RegRead *to_read_fast;
-    size_t to_read_fast_len;
+    // Registers between two values are read too if this saves a request.
+    // Set to 0 for meters that reject reads of undefined registers.
+    uint16_t max_read_gap;
 
-    void (*const slow_read_done_fn)(const uint16_t *registers);
-    void (*const fast_read_done_fn)(const uint16_t *registers);
-    const char *meter_name;
+    float (*const energy_rel_fn)(float energy_abs); // set to nullptr if the meter has a relative energy register (METER_VALUE_ENERGY_REL)
     void (*const custom_reset_fn)(); // set to nullptr if reset via register 61457 is supported
 };
 
-void convert_to_float(const uint16_t *regs, float *target, const uint16_t *indices, size_t count);
+#define METER_VALUES(values) values, sizeof(values) / sizeof(values[0])
+
+uint8_t meter_value_registers(MeterValueType type);
+
+// A run of word swapped floats in consecutive registers
+// that are converted into consecutive target values.
+struct FloatRun {
+    uint16_t reg; // offset of the first register in the register buffer
+    uint16_t target;
+    uint16_t count;
+};
+
+void convert_float_runs(const uint16_t *regs, float *target, const FloatRun *runs, size_t run_count);
+
+class ReadScheduler;
+
+// Decodes the values of a meter from the register buffer of a ReadScheduler.
+// Unscaled floats are combined into runs (see convert_float_runs),
+// all other values are decoded one by one.
+class MeterDecoder
+{
+public:
+    MeterDecoder() {}
+
+    void setup(const MeterInfo *meter, const ReadScheduler *scheduler);
+
+    // Decodes the fast group, or all values if fast_only is false.
+    // values must have space for METER_VALUE_COUNT entries.
+    void decode(const uint16_t *regs, bool fast_only, float *values) const;
+
+    bool has_target(uint8_t target) const;
+
+    // True if the fast group contains the voltages and currents of all phases.
+    bool has_phases() const { return phases; }
+
+private:
+    struct value_t {
+        uint16_t offset;
+        const MeterValueDef *def;
+    };
+
+    struct group_t {
+        std::vector<FloatRun> float_runs;
+        std::vector<value_t> values;
+    };
+
+    group_t groups[2];
+    uint8_t targets[(METER_VALUE_COUNT + 7) / 8] = {0};
+    bool phases = false;
+};
@@ -39,8 +39,10 @@ extern TaskScheduler task_scheduler;
 
 extern API api;
 
-static uint16_t write_buf[100];
-static uint16_t registers[400];
+// The bindings assemble the response in this buffer before calling the response callback.
+static uint16_t write_buf[MODBUS_MAX_READ_REGISTERS];
+static uint16_t registers[READ_SCHEDULER_REGISTER_COUNT];
+static float meter_values[METER_VALUE_COUNT];
 
 static MeterInfo *supported_meters[] = {
     &sdm72dm,
@@ -52,6 +54,8 @@ static MeterInfo *meter_in_use = nullptr;
 
 #define METER_TYPE_AUTO_DETECT 255
 
+#define METER_BAUDRATE 9600
+
 void ModbusMeter::pre_setup()
 {
     error_counters = Config::Object({
@@ -185,7 +189,7 @@ void ModbusMeter::setupRS485()
         return;
     }
 
-    result = tf_rs485_set_rs485_configuration(&device, 9600, TF_RS485_PARITY_NONE, TF_RS485_STOPBITS_1, TF_RS485_WORDLENGTH_8, TF_RS485_DUPLEX_HALF);
+    result = tf_rs485_set_rs485_configuration(&device, METER_BAUDRATE, TF_RS485_PARITY_NONE, TF_RS485_STOPBITS_1, TF_RS485_WORDLENGTH_8, TF_RS485_DUPLEX_HALF);
     if (result != TF_E_OK) {
         if (!is_in_bootloader(result)) {
             logger.printfln("RS485 set config failed (rc %d). Disabling energy meter support.", result);
@@ -271,42 +275,65 @@ void ModbusMeter::register_urls()
     this->DeviceModule::register_urls();
 }
 
-const RegRead *ModbusMeter::getNextRead(bool *trigger_fast_read_done, bool *trigger_slow_read_done)
+void ModbusMeter::fast_read_done()
 {
-    *trigger_fast_read_done = false;
-    *trigger_slow_read_done = false;
-
-    if (modbus_read_state_fast != meter_in_use->to_read_fast_len) {
-        last_read_was_fast = true;
-        const RegRead *result = &meter_in_use->to_read_fast[modbus_read_state_fast];
-        ++modbus_read_state_fast;
-        return result;
-    }
+    decoder.decode(registers, true, meter_values);
 
-    // fast state machine is done. do 1 slow read then run the fast state machine again.
+    float energy_abs = meter_values[METER_VALUE_ENERGY_ABS];
+    float energy_rel = meter_in_use->energy_rel_fn != nullptr ? meter_in_use->energy_rel_fn(energy_abs) : meter_values[METER_VALUE_ENERGY_REL];
 
-    if (last_read_was_fast) {
-        *trigger_fast_read_done = true;
+    // TODO: Handle reset
+    meter.updateMeterValues(meter_values[METER_VALUE_POWER], energy_rel, energy_abs);
 
-        if (modbus_read_state_slow == meter_in_use->to_read_slow_len) {
-            modbus_read_state_slow = 0;
-        }
-        if (meter_in_use->to_read_slow_len != 0) {
-            last_read_was_fast = false;
-            const RegRead *result = &meter_in_use->to_read_slow[modbus_read_state_slow];
-            ++modbus_read_state_slow;
-            return result;
-        }
-    }
-    if (modbus_read_state_slow == meter_in_use->to_read_slow_len) {
-        *trigger_slow_read_done = true;
-    }
+    if (!decoder.has_phases())
+        return;
+
+    bool phases_active[3] = {
+        meter_values[METER_ALL_VALUES_CURRENT_L1_A] > PHASE_ACTIVE_CURRENT_THRES,
+        meter_values[METER_ALL_VALUES_CURRENT_L2_A] > PHASE_ACTIVE_CURRENT_THRES,
+        meter_values[METER_ALL_VALUES_CURRENT_L3_A] > PHASE_ACTIVE_CURRENT_THRES
+    };
+
+    bool phases_connected[3] = {
+        meter_values[METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L1] > PHASE_CONNECTED_VOLTAGE_THRES,
+        meter_values[METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L2] > PHASE_CONNECTED_VOLTAGE_THRES,
+        meter_values[METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L3] > PHASE_CONNECTED_VOLTAGE_THRES
+    };
 
-    modbus_read_state_fast = 0;
-    last_read_was_fast = true;
-    const RegRead *result = &meter_in_use->to_read_fast[modbus_read_state_fast];
-    ++modbus_read_state_fast;
-    return result;
+    meter.updateMeterPhases(phases_connected, phases_active);
+}
+
+void ModbusMeter::slow_read_done()
+{
+    decoder.decode(registers, false, meter_values);
+
+    for (uint8_t i = 0; i < METER_ALL_VALUES_COUNT; ++i)
+        if (decoder.has_target(i))
+            meter.updateMeterAllValues(i, meter_values[i]);
+}
+
+void ModbusMeter::handle_response()
+{
+    request_pending = false;
+
+    if (user_data.done == UserDataDone::DONE) {
+        if (!read_pending)
+            return;
+
+        uint8_t groups_done = scheduler.read_done(millis(), micros() - request_start_us);
+
+        if (groups_done & READ_GROUP_FAST)
+            fast_read_done();
+
+        if (groups_done & READ_GROUP_SLOW)
+            slow_read_done();
+    } else if (user_data.done == UserDataDone::ERROR) {
+        next_read_deadline_ms = millis() + 500;
+        error_counters.get("meter")->updateUint(error_counters.get("meter")->asUint() + 1);
+    } else {
+        next_read_deadline_ms = millis() + 500;
+        error_counters.get("bricklet")->updateUint(error_counters.get("bricklet")->asUint() + 1);
+    }
 }
 
 void ModbusMeter::loop()
@@ -315,15 +342,24 @@ void ModbusMeter::loop()
     if (!initialized || meter_in_use == nullptr)
         return;
 
-    if (user_data.done == UserDataDone::NOT_DONE && !deadline_elapsed(callback_deadline_ms))
-        return;
+    if (scheduler.meter() != meter_in_use) {
+        scheduler.setup(meter_in_use, METER_BAUDRATE, millis());
+        decoder.setup(meter_in_use, &scheduler);
+    }
 
-    if (user_data.done == UserDataDone::NOT_DONE) {
-        logger.printfln("rs485 deadline reached!");
-        this->checkRS485State();
+    if (request_pending) {
+        if (user_data.done == UserDataDone::NOT_DONE) {
+            if (!deadline_elapsed(callback_deadline_ms))
+                return;
+
+            logger.printfln("rs485 deadline reached!");
+            this->checkRS485State();
+        }
+
+        handle_response();
     }
 
-    if (user_data.done != UserDataDone::NOT_DONE && !deadline_elapsed(next_read_deadline_ms))
+    if (!deadline_elapsed(next_read_deadline_ms))
         return;
 
     if (reset_requested) {
@@ -341,48 +377,31 @@ void ModbusMeter::loop()
             if (user_data.expected_request_id == 0) {
                 this->checkRS485State();
             }
+
+            request_pending = true;
+            read_pending = false;
+            callback_deadline_ms = millis() + 3000;
         }
         return;
     }
 
-    bool trigger_fast_read_done;
-    bool trigger_slow_read_done;
-    const RegRead *next_read = getNextRead(&trigger_fast_read_done, &trigger_slow_read_done);
-
-    auto last_user_data_done = user_data.done;
+    uint16_t start;
+    uint16_t len;
+    if (!scheduler.next_read(millis(), &start, &len))
+        return;
 
-    user_data.value_to_write = &registers[next_read->start - 1];
+    user_data.value_to_write = &registers[scheduler.buffer_offset(start, len)];
     user_data.done = UserDataDone::NOT_DONE;
     user_data.expected_request_id = 0;
-    is_in_bootloader(tf_rs485_modbus_master_read_input_registers(&device, 1, next_read->start, next_read->len, &user_data.expected_request_id));
+    request_start_us = micros();
+    is_in_bootloader(tf_rs485_modbus_master_read_input_registers(&device, 1, start, len, &user_data.expected_request_id));
     if (user_data.expected_request_id == 0) {
-        logger.printfln("Failed to read energy meter registers starting at %u: request_id: %u", next_read->start, user_data.expected_request_id);
+        logger.printfln("Failed to read energy meter registers starting at %u: request_id: %u", start, user_data.expected_request_id);
         this->checkRS485State();
     }
 
-    if (trigger_fast_read_done) {
-        meter_in_use->fast_read_done_fn(registers);
-    }
-
-    if (trigger_slow_read_done) {
-        meter_in_use->slow_read_done_fn(registers);
-    }
-
-    if (last_user_data_done == UserDataDone::DONE) {
-        if (trigger_slow_read_done) {
-            // Try to measure each 500 ms, but don't pile up measurements
-            // if we are already a complete slot behind.
-            next_read_deadline_ms = next_read_deadline_ms + 500;
-            if (deadline_elapsed(next_read_deadline_ms))
-                next_read_deadline_ms = millis() + 500;
-        }
-    } else if (last_user_data_done == UserDataDone::ERROR) {
-        next_read_deadline_ms = millis() + 500;
-        error_counters.get("meter")->updateUint(error_counters.get("meter")->asUint() + 1);
-    } else {
-        next_read_deadline_ms = millis() + 500;
-        error_counters.get("bricklet")->updateUint(error_counters.get("bricklet")->asUint() + 1);
-    }
+    request_pending = true;
+    read_pending = true;
 
     // This protects against lost callback responses.
     // If the callback packet is lost,
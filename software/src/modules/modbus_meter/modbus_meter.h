@@ -26,6 +26,7 @@
 #include "rs485_bricklet_firmware_bin.embedded.h"
 
 #include "meter_defs.h"
+#include "read_scheduler.h"
 
 class ModbusMeter : public DeviceModule<TF_RS485,
                                         rs485_bricklet_firmware_bin_data,
@@ -62,16 +63,18 @@ private:
     void modbus_read();
     void setupRS485();
     void checkRS485State();
-    const RegRead *getNextRead(bool *trigger_fast_read_done, bool *trigger_slow_read_done);
+    void handle_response();
+    void fast_read_done();
+    void slow_read_done();
 
     TF_RS485 rs485;
-    size_t modbus_read_state_fast = 0;
-    size_t modbus_read_state_slow = 0;
-    bool last_read_was_fast = false;
+    ReadScheduler scheduler;
+    MeterDecoder decoder;
 
-    uint32_t next_modbus_read_deadline = 0;
-    uint32_t next_power_history_entry = 0;
     UserData user_data;
+    bool request_pending = false;
+    bool read_pending = false;
+    uint32_t request_start_us = 0;
 
     bool reset_requested;
 
@@ -0,0 +1,306 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "read_scheduler.h"
+
+#include <algorithm>
+
+#include "event_log.h"
+#include "tools.h"
+
+extern EventLog logger;
+
+// Request (8 bytes) and response header and CRC (5 bytes)
+#define REQUEST_OVERHEAD_BYTES 13
+// Initial guess of the response delay of the meter and the bricklet communication
+#define INITIAL_TURNAROUND_US 50000
+
+void ReadScheduler::setup(const MeterInfo *meter, uint32_t baudrate, uint32_t now)
+{
+    meter_info = meter;
+    read_count = 0;
+    segment_count = 0;
+    window_start = 0;
+    window_end = 0;
+
+    // 8N1: 10 bits per byte
+    register_time_us = 2 * 10 * 1000000 / baudrate;
+    overhead_us = REQUEST_OVERHEAD_BYTES * 10 * 1000000 / baudrate + INITIAL_TURNAROUND_US;
+
+    // Reading a few unused registers is cheaper than another request.
+    uint32_t max_gap = overhead_us / register_time_us;
+    if (max_gap > meter->max_read_gap)
+        max_gap = meter->max_read_gap;
+
+    // The fast group are the values with the shortest interval,
+    // the done function of the slow group waits for the values with the second shortest.
+    uint32_t min_interval[2] = {UINT32_MAX, UINT32_MAX};
+    for (size_t i = 0; i < meter->values_len; ++i)
+        if (meter->values[i].interval_ms < min_interval[0])
+            min_interval[0] = meter->values[i].interval_ms;
+
+    for (size_t i = 0; i < meter->values_len; ++i)
+        if (meter->values[i].interval_ms > min_interval[0] && meter->values[i].interval_ms < min_interval[1])
+            min_interval[1] = meter->values[i].interval_ms;
+
+    std::vector<planned_read_t> ranges;
+    ranges.reserve(meter->values_len);
+
+    for (size_t i = 0; i < meter->values_len; ++i) {
+        const MeterValueDef &value = meter->values[i];
+
+        if (value.reg == 0 || value.interval_ms == 0) {
+            logger.printfln("%s: Ignoring invalid value definition at register %u", meter->meter_name, value.reg);
+            continue;
+        }
+
+        planned_read_t range;
+        range.start = value.reg;
+        range.len = meter_value_registers(value.type);
+        range.interval_ms = value.interval_ms;
+        range.groups = value.interval_ms == min_interval[0] ? READ_GROUP_FAST : READ_GROUP_SLOW;
+        ranges.push_back(range);
+    }
+
+    merge_ranges(ranges, max_gap);
+
+    for (size_t i = 0; i < read_count; ++i) {
+        planned_read_t &read = reads[i];
+        read.blocks = 0;
+        if (read.groups & READ_GROUP_FAST)
+            read.blocks |= READ_GROUP_FAST;
+        if ((read.groups & READ_GROUP_SLOW) && read.interval_ms == min_interval[1])
+            read.blocks |= READ_GROUP_SLOW;
+        read.pending = read.blocks;
+        read.next_due_ms = now;
+    }
+
+    build_segments();
+    update_scale();
+}
+
+static bool read_before(uint32_t interval_a, uint16_t start_a, uint32_t interval_b, uint16_t start_b)
+{
+    return interval_a < interval_b || (interval_a == interval_b && start_a < start_b);
+}
+
+void ReadScheduler::merge_ranges(std::vector<planned_read_t> &ranges, uint32_t max_gap)
+{
+    // Sort by interval, then by start register.
+    std::sort(ranges.begin(), ranges.end(), [](const planned_read_t &a, const planned_read_t &b) {
+        return read_before(a.interval_ms, a.start, b.interval_ms, b.start);
+    });
+
+    for (const planned_read_t &next : ranges) {
+        if (read_count > 0) {
+            planned_read_t &last = reads[read_count - 1];
+            uint32_t last_end = last.start + last.len;
+            uint32_t next_end = next.start + next.len;
+
+            if (last.interval_ms == next.interval_ms && next.start <= last_end + max_gap) {
+                if (next_end <= last_end) {
+                    last.groups |= next.groups;
+                    continue;
+                }
+
+                if (next_end - last.start <= MODBUS_MAX_READ_REGISTERS) {
+                    last.len = next_end - last.start;
+                    last.groups |= next.groups;
+                    continue;
+                }
+            }
+        }
+
+        if (read_count == READ_SCHEDULER_MAX_READS) {
+            logger.printfln("%s: Too many register ranges. Ignoring register %u and following.", meter_info->meter_name, next.start);
+            break;
+        }
+
+        // A value that overlaps the end of a full read gets a read of its own.
+        reads[read_count++] = next;
+    }
+
+    // Extending a read with its neighbours in next_read needs the reads sorted by start register.
+    std::sort(reads, reads + read_count, [](const planned_read_t &a, const planned_read_t &b) {
+        return a.start < b.start;
+    });
+}
+
+void ReadScheduler::build_segments()
+{
+    // Reads that overlap or touch share one segment of the register buffer,
+    // so every request (see next_read) fits into one segment.
+    size_t used = 0;
+
+    for (size_t i = 0; i < read_count; ++i) {
+        const planned_read_t &read = reads[i];
+
+        if (segment_count > 0) {
+            segment_t &last = segments[segment_count - 1];
+            if (read.start <= last.start + last.len) {
+                uint16_t end = read.start + read.len;
+                if (end > last.start + last.len) {
+                    used += end - (last.start + last.len);
+                    last.len = end - last.start;
+                }
+                continue;
+            }
+        }
+
+        segments[segment_count++] = {read.start, read.len, (uint16_t)used};
+        used += read.len;
+    }
+
+    if (used > READ_SCHEDULER_REGISTER_COUNT) {
+        logger.printfln("%s: Register buffer too small (%u registers needed). Not reading any values.", meter_info->meter_name, used);
+        read_count = 0;
+        segment_count = 0;
+    }
+}
+
+int ReadScheduler::buffer_offset(uint16_t start, uint16_t len) const
+{
+    for (size_t i = 0; i < segment_count; ++i) {
+        const segment_t &segment = segments[i];
+        if (start >= segment.start && start + len <= segment.start + segment.len)
+            return segment.offset + (start - segment.start);
+    }
+
+    return -1;
+}
+
+uint32_t ReadScheduler::expected_rtt_us(uint16_t len) const
+{
+    return overhead_us + len * register_time_us;
+}
+
+void ReadScheduler::update_scale()
+{
+    float load = 0;
+    for (size_t i = 0; i < read_count; ++i)
+        load += (float)expected_rtt_us(reads[i].len) / (reads[i].interval_ms * 1000.0f);
+
+    scale = load > READ_SCHEDULER_MAX_BUS_LOAD ? load / READ_SCHEDULER_MAX_BUS_LOAD : 1.0f;
+}
+
+uint32_t ReadScheduler::scaled_interval(const planned_read_t &read) const
+{
+    return (uint32_t)(read.interval_ms * scale);
+}
+
+bool ReadScheduler::nearly_due(const planned_read_t &read, uint32_t now) const
+{
+    return a_after_b(now, read.next_due_ms - scaled_interval(read) / 8);
+}
+
+bool ReadScheduler::next_read(uint32_t now, uint16_t *start, uint16_t *len)
+{
+    if (read_count == 0)
+        return false;
+
+    size_t first = 0;
+    for (size_t i = 1; i < read_count; ++i)
+        if (a_after_b(reads[first].next_due_ms, reads[i].next_due_ms) && reads[first].next_due_ms != reads[i].next_due_ms)
+            first = i;
+
+    if (!a_after_b(now, reads[first].next_due_ms))
+        return false;
+
+    uint16_t read_start = reads[first].start;
+    uint16_t read_end = reads[first].start + reads[first].len;
+
+    // Take neighbouring reads along if they would be due soon anyway:
+    // One longer request is cheaper than two short ones.
+    for (size_t i = first + 1; i < read_count && reads[i].start <= read_end; ++i) {
+        uint16_t end = reads[i].start + reads[i].len;
+        if (end > read_end && end - read_start <= MODBUS_MAX_READ_REGISTERS && nearly_due(reads[i], now))
+            read_end = end;
+    }
+
+    for (size_t i = first; i-- > 0;) {
+        uint16_t end = reads[i].start + reads[i].len;
+        if (end >= read_start && reads[i].start < read_start && read_end - reads[i].start <= MODBUS_MAX_READ_REGISTERS && nearly_due(reads[i], now))
+            read_start = reads[i].start;
+    }
+
+    window_start = read_start;
+    window_end = read_end;
+
+    *start = read_start;
+    *len = read_end - read_start;
+    return true;
+}
+
+uint8_t ReadScheduler::read_done(uint32_t now, uint32_t rtt_us)
+{
+    if (window_end == window_start)
+        return 0;
+
+    // The transfer time of the registers is known from the baudrate.
+    // Everything else (the response delay of the meter, bricklet communication)
+    // is tracked as a moving average.
+    uint32_t transfer_us = (window_end - window_start) * register_time_us;
+    uint32_t measured_overhead_us = rtt_us > transfer_us ? rtt_us - transfer_us : 0;
+    overhead_us = (overhead_us * 7 + measured_overhead_us) / 8;
+    update_scale();
+
+    for (size_t i = 0; i < read_count; ++i) {
+        planned_read_t &read = reads[i];
+        if (read.start < window_start || read.start + read.len > window_end)
+            continue;
+
+        uint32_t interval = scaled_interval(read);
+
+        // Keep the rhythm of reads that were due, but don't pile up
+        // reads if we are already a complete interval behind.
+        if (a_after_b(now, read.next_due_ms)) {
+            read.next_due_ms += interval;
+            if (a_after_b(now, read.next_due_ms))
+                read.next_due_ms = now + interval;
+        } else {
+            read.next_due_ms = now + interval;
+        }
+
+        read.pending = 0;
+    }
+
+    window_start = 0;
+    window_end = 0;
+
+    uint8_t groups_done = 0;
+    for (uint8_t group = READ_GROUP_FAST; group <= READ_GROUP_SLOW; group <<= 1) {
+        bool has_reads = false;
+        bool pending = false;
+
+        for (size_t i = 0; i < read_count; ++i) {
+            has_reads |= (reads[i].blocks & group) != 0;
+            pending |= (reads[i].pending & group) != 0;
+        }
+
+        if (!has_reads || pending)
+            continue;
+
+        groups_done |= group;
+
+        for (size_t i = 0; i < read_count; ++i)
+            reads[i].pending |= reads[i].blocks & group;
+    }
+
+    return groups_done;
+}
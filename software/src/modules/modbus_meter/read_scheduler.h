@@ -0,0 +1,128 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "meter_defs.h"
+
+#define READ_SCHEDULER_MAX_READS 24
+// Size of the register buffer. Only registers that are read get a place in it.
+#define READ_SCHEDULER_REGISTER_COUNT 400
+
+// Target share of the bus time used for reads. If the measured round trip times
+// don't allow to read all registers with their configured intervals,
+// all intervals are stretched by the same factor.
+#define READ_SCHEDULER_MAX_BUS_LOAD 0.8f
+
+#define READ_GROUP_FAST 1
+#define READ_GROUP_SLOW 2
+
+// Plans the input register reads of a meter.
+//
+// The registers of all values of a meter are merged into as few requests
+// as possible: Values with the same refresh interval are combined up to
+// the 125 register limit of a Modbus request. Small gaps between them are
+// read too, if that is cheaper than another request and the meter allows it.
+// Every planned read is due after its interval; the most overdue read is
+// issued next and extended by following reads that will be due soon.
+// A read that covers another range completely refreshes that range too.
+//
+// The done function of a group runs after all of its ranges with the
+// shortest interval of that group were refreshed. Ranges with longer
+// intervals (for example THD values) don't delay the done function,
+// their last value stays in the register buffer.
+//
+// Registers are stored compactly: Overlapping or touching reads share a
+// segment of the register buffer, see buffer_offset.
+class ReadScheduler
+{
+public:
+    ReadScheduler() {}
+
+    // baudrate is used to estimate the transfer time of a response.
+    // All reads are due at now.
+    void setup(const MeterInfo *meter, uint32_t baudrate, uint32_t now);
+
+    const MeterInfo *meter() const { return meter_info; }
+
+    // Returns false if no read is due at now. Otherwise start and len are set
+    // to the registers that should be requested. Registers are 1-based,
+    // as in MeterValueDef.
+    bool next_read(uint32_t now, uint16_t *start, uint16_t *len);
+
+    // Marks the registers requested by the last next_read call as refreshed.
+    // rtt_us is the time from the request until the response arrived.
+    // Returns the groups (READ_GROUP_*) whose done functions should run.
+    uint8_t read_done(uint32_t now, uint32_t rtt_us);
+
+    // Expected time a read of len registers takes on the bus.
+    uint32_t expected_rtt_us(uint16_t len) const;
+
+    float interval_scale() const { return scale; }
+
+    size_t planned_read_count() const { return read_count; }
+
+    // Index of register start in the register buffer or -1 if
+    // the registers [start, start + len) are not read.
+    int buffer_offset(uint16_t start, uint16_t len) const;
+
+private:
+    struct planned_read_t {
+        uint16_t start;
+        uint16_t len;
+        uint32_t interval_ms;
+        uint32_t next_due_ms;
+        uint8_t groups;
+        // Groups whose done function waits for this read.
+        uint8_t blocks;
+        // Subset of blocks not refreshed since the last done call of the group.
+        uint8_t pending;
+    };
+
+    struct segment_t {
+        uint16_t start;
+        uint16_t len;
+        uint16_t offset;
+    };
+
+    void merge_ranges(std::vector<planned_read_t> &ranges, uint32_t max_gap);
+    void build_segments();
+    void update_scale();
+    uint32_t scaled_interval(const planned_read_t &read) const;
+    bool nearly_due(const planned_read_t &read, uint32_t now) const;
+
+    const MeterInfo *meter_info = nullptr;
+
+    planned_read_t reads[READ_SCHEDULER_MAX_READS];
+    size_t read_count = 0;
+
+    segment_t segments[READ_SCHEDULER_MAX_READS];
+    size_t segment_count = 0;
+
+    uint16_t window_start = 0;
+    uint16_t window_end = 0;
+
+    uint32_t register_time_us = 0;
+    uint32_t overhead_us = 0;
+    float scale = 1.0f;
+};
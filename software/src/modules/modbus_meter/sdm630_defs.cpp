@@ -5,39 +5,99 @@ extern API api;
 
 static ConfigRoot sdm630_reset;
 
-static const RegRead sdm630_slow[] {
-    {1, 88},
-    {101, 8},
-    {201, 70},
-    {335, 48}
+static const MeterValueDef sdm630_values[] = {
+    METER_FLOAT(53, METER_VALUE_POWER, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(343, METER_VALUE_ENERGY_ABS, READ_INTERVAL_FAST_MS),
+
+    METER_FLOAT(1, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L1, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(3, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L2, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(5, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L3, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(7, METER_ALL_VALUES_CURRENT_L1_A, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(9, METER_ALL_VALUES_CURRENT_L2_A, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(11, METER_ALL_VALUES_CURRENT_L3_A, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(13, METER_ALL_VALUES_POWER_L1_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(15, METER_ALL_VALUES_POWER_L2_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(17, METER_ALL_VALUES_POWER_L3_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(19, METER_ALL_VALUES_VOLT_AMPS_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(21, METER_ALL_VALUES_VOLT_AMPS_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(23, METER_ALL_VALUES_VOLT_AMPS_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(25, METER_ALL_VALUES_VOLT_AMPS_REACTIVE_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(27, METER_ALL_VALUES_VOLT_AMPS_REACTIVE_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(29, METER_ALL_VALUES_VOLT_AMPS_REACTIVE_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(31, METER_ALL_VALUES_POWER_FACTOR_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(33, METER_ALL_VALUES_POWER_FACTOR_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(35, METER_ALL_VALUES_POWER_FACTOR_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(37, METER_ALL_VALUES_PHASE_ANGLE_L1_DEGREE, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(39, METER_ALL_VALUES_PHASE_ANGLE_L2_DEGREE, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(41, METER_ALL_VALUES_PHASE_ANGLE_L3_DEGREE, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(43, METER_ALL_VALUES_AVERAGE_LINE_TO_NEUTRAL_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(47, METER_ALL_VALUES_AVERAGE_LINE_CURRENT_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(49, METER_ALL_VALUES_SUM_OF_LINE_CURRENTS_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(53, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(57, METER_ALL_VALUES_TOTAL_SYSTEM_VOLT_AMPS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(61, METER_ALL_VALUES_TOTAL_SYSTEM_VAR, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(63, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_FACTOR, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(67, METER_ALL_VALUES_TOTAL_SYSTEM_PHASE_ANGLE_DEGREE, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(71, METER_ALL_VALUES_FREQUENCY_OF_SUPPLY_VOLTAGES_HERTZ, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(73, METER_ALL_VALUES_TOTAL_IMPORT_KWH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(75, METER_ALL_VALUES_TOTAL_EXPORT_KWH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(77, METER_ALL_VALUES_TOTAL_IMPORT_KVARH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(79, METER_ALL_VALUES_TOTAL_EXPORT_KVARH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(81, METER_ALL_VALUES_TOTAL_VAH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(83, METER_ALL_VALUES_AH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(85, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_DEMAND_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(87, METER_ALL_VALUES_MAXIMUM_TOTAL_SYSTEM_POWER_DEMAND_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(101, METER_ALL_VALUES_TOTAL_SYSTEM_VA_DEMAND, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(103, METER_ALL_VALUES_MAXIMUM_TOTAL_SYSTEM_VA_DEMAND, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(105, METER_ALL_VALUES_NEUTRAL_CURRENT_DEMAND_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(107, METER_ALL_VALUES_MAXIMUM_NEUTRAL_CURRENT_DEMAND_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(201, METER_ALL_VALUES_LINE1_TO_LINE2_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(203, METER_ALL_VALUES_LINE2_TO_LINE3_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(205, METER_ALL_VALUES_LINE3_TO_LINE1_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(207, METER_ALL_VALUES_AVERAGE_LINE_TO_LINE_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(225, METER_ALL_VALUES_NEUTRAL_CURRENT_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(235, METER_ALL_VALUES_LN_VOLTS_THD_L1, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(237, METER_ALL_VALUES_LN_VOLTS_THD_L2, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(239, METER_ALL_VALUES_LN_VOLTS_THD_L3, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(241, METER_ALL_VALUES_CURRENT_THD_L1_A, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(243, METER_ALL_VALUES_CURRENT_THD_L2_A, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(245, METER_ALL_VALUES_CURRENT_THD_L3_A, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(249, METER_ALL_VALUES_AVERAGE_LINE_TO_NEUTRAL_VOLTS_THD, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(251, METER_ALL_VALUES_AVERAGE_LINE_CURRENT_THD_A, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(259, METER_ALL_VALUES_CURRENT_DEMAND_L1_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(261, METER_ALL_VALUES_CURRENT_DEMAND_L2_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(263, METER_ALL_VALUES_CURRENT_DEMAND_L3_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(265, METER_ALL_VALUES_MAXIMUM_CURRENT_DEMAND_L1_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(267, METER_ALL_VALUES_MAXIMUM_CURRENT_DEMAND_L2_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(269, METER_ALL_VALUES_MAXIMUM_CURRENT_DEMAND_L3_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(335, METER_ALL_VALUES_LINE1_TO_LINE2_VOLTS_THD_PERCENT, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(337, METER_ALL_VALUES_LINE2_TO_LINE3_VOLTS_THD_PERCENT, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(339, METER_ALL_VALUES_LINE3_TO_LINE1_VOLTS_THD_PERCENT, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(341, METER_ALL_VALUES_AVERAGE_LINE_TO_LINE_VOLTS_THD_PERCENT, READ_INTERVAL_RARE_MS),
+    METER_FLOAT(343, METER_ALL_VALUES_TOTAL_KWH_SUM, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(345, METER_ALL_VALUES_TOTAL_KVARH_SUM, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(347, METER_ALL_VALUES_IMPORT_KWH_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(349, METER_ALL_VALUES_IMPORT_KWH_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(351, METER_ALL_VALUES_IMPORT_KWH_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(353, METER_ALL_VALUES_EXPORT_KWH_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(355, METER_ALL_VALUES_EXPORT_KWH_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(357, METER_ALL_VALUES_EXPORT_KWH_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(359, METER_ALL_VALUES_TOTAL_KWH_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(361, METER_ALL_VALUES_TOTAL_KWH_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(363, METER_ALL_VALUES_TOTAL_KWH_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(365, METER_ALL_VALUES_IMPORT_KVARH_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(367, METER_ALL_VALUES_IMPORT_KVARH_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(369, METER_ALL_VALUES_IMPORT_KVARH_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(371, METER_ALL_VALUES_EXPORT_KVARH_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(373, METER_ALL_VALUES_EXPORT_KVARH_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(375, METER_ALL_VALUES_EXPORT_KVARH_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(377, METER_ALL_VALUES_TOTAL_KVARH_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(379, METER_ALL_VALUES_TOTAL_KVARH_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(381, METER_ALL_VALUES_TOTAL_KVARH_L3, READ_INTERVAL_SLOW_MS)
 };
 
-static const RegRead sdm630_fast[]{
-    {1, 12}, // current per phase
-    {53, 2}, // power
-    {343, 2} // energy_abs
-};
-
-static const uint16_t sdm630_registers_to_read[] = {
-	1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31,33,35,37,39,41,43,47,49,53,57,61,63,67,71,73,75,77,79,81,83,85,87,101,103,105,107,201,203,205,207,225,235,237,239,241,243,245,249,251,259,261,263,265,267,269,335,337,339,341,343,345,347,349,351,353,355,357,359,361,363,365,367,369,371,373,375,377,379,381
-};
-
-enum FastValues {
-    Power,
-    EnergyAbs,
-    VoltagePhase0,
-    VoltagePhase1,
-    VoltagePhase2,
-    CurrentPhase0,
-    CurrentPhase1,
-    CurrentPhase2,
-};
-
-static const uint16_t sdm630_registers_fast_to_read[] = {
-	53, 343, 1, 3, 5, 7, 9, 11 // power, energy_abs, voltage per phase, current per phase
-};
-
-static void sdm630_fast_read_done(const uint16_t *all_regs)
+// The SDM630 has no resettable energy counter. Track the reset offset instead.
+static float sdm630_energy_rel(float energy_abs)
 {
     static bool first_run = true;
     if (first_run) {
@@ -46,48 +106,20 @@ static void sdm630_fast_read_done(const uint16_t *all_regs)
         api.restorePersistentConfig("meter/sdm630_reset", &sdm630_reset);
     }
 
-    float fast_values[8];
-    convert_to_float(all_regs, fast_values, sdm630_registers_fast_to_read, sizeof(sdm630_registers_fast_to_read) / sizeof(sdm630_registers_fast_to_read[0]));
-
-    // TODO: Handle reset
-    meter.updateMeterValues(fast_values[Power], fast_values[EnergyAbs] - sdm630_reset.asFloat(), fast_values[EnergyAbs]);
-
-    bool phases_active[3] = {
-        fast_values[CurrentPhase0] > PHASE_ACTIVE_CURRENT_THRES,
-        fast_values[CurrentPhase1] > PHASE_ACTIVE_CURRENT_THRES,
-        fast_values[CurrentPhase2] > PHASE_ACTIVE_CURRENT_THRES
-    };
-
-    bool phases_connected[3] = {
-        fast_values[VoltagePhase0] > PHASE_CONNECTED_VOLTAGE_THRES,
-        fast_values[VoltagePhase1] > PHASE_CONNECTED_VOLTAGE_THRES,
-        fast_values[VoltagePhase2] > PHASE_CONNECTED_VOLTAGE_THRES
-    };
-
-    meter.updateMeterPhases(phases_connected, phases_active);
-}
-
-static void sdm630_slow_read_done(const uint16_t *all_regs)
-{
-    float all_values[METER_ALL_VALUES_COUNT];
-    convert_to_float(all_regs, all_values, sdm630_registers_to_read, sizeof(sdm630_registers_to_read) / sizeof(sdm630_registers_to_read[0]));
-
-    meter.updateMeterAllValues(all_values);
+    return energy_abs - sdm630_reset.asFloat();
 }
 
 MeterInfo sdm630 {
     0x0070,
     2,
-    sdm630_slow,
-    sizeof(sdm630_slow) / sizeof(sdm630_slow[0]),
-    sdm630_fast,
-    sizeof(sdm630_fast) / sizeof(sdm630_fast[0]),
-    sdm630_slow_read_done,
-    sdm630_fast_read_done,
     "SDM630",
+    METER_VALUES(sdm630_values),
+    MODBUS_MAX_READ_REGISTERS,
+    sdm630_energy_rel,
     [](){
-        sdm630_reset.updateFloat(meter.values.get("energy_abs")->asFloat());
+        MeterSnapshot snapshot;
+        meter.getSnapshot(&snapshot);
+        sdm630_reset.updateFloat(snapshot.energy_abs);
         api.writeConfig("meter/sdm630_reset", &sdm630_reset);
     }
 };
-
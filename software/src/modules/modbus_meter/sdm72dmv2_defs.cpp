@@ -1,93 +1,55 @@
 #include "sdm72dmv2_defs.h"
 
-static const RegRead sdm72dmv2_slow[] {
-    {1, 76},
-    {201, 46},
-    {343, 4}
+// The other values of meter/all_values are not available in the SDM72DM-V2.
+static const MeterValueDef sdm72dmv2_values[] = {
+    METER_FLOAT(53, METER_VALUE_POWER, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(343, METER_VALUE_ENERGY_ABS, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(385, METER_VALUE_ENERGY_REL, READ_INTERVAL_FAST_MS),
+
+    METER_FLOAT(1, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L1, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(3, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L2, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(5, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L3, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(7, METER_ALL_VALUES_CURRENT_L1_A, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(9, METER_ALL_VALUES_CURRENT_L2_A, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(11, METER_ALL_VALUES_CURRENT_L3_A, READ_INTERVAL_FAST_MS),
+    METER_FLOAT(13, METER_ALL_VALUES_POWER_L1_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(15, METER_ALL_VALUES_POWER_L2_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(17, METER_ALL_VALUES_POWER_L3_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(19, METER_ALL_VALUES_VOLT_AMPS_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(21, METER_ALL_VALUES_VOLT_AMPS_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(23, METER_ALL_VALUES_VOLT_AMPS_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(25, METER_ALL_VALUES_VOLT_AMPS_REACTIVE_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(27, METER_ALL_VALUES_VOLT_AMPS_REACTIVE_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(29, METER_ALL_VALUES_VOLT_AMPS_REACTIVE_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(31, METER_ALL_VALUES_POWER_FACTOR_L1, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(33, METER_ALL_VALUES_POWER_FACTOR_L2, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(35, METER_ALL_VALUES_POWER_FACTOR_L3, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(47, METER_ALL_VALUES_AVERAGE_LINE_CURRENT_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(49, METER_ALL_VALUES_SUM_OF_LINE_CURRENTS_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(53, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_W, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(57, METER_ALL_VALUES_TOTAL_SYSTEM_VOLT_AMPS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(61, METER_ALL_VALUES_TOTAL_SYSTEM_VAR, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(63, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_FACTOR, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(71, METER_ALL_VALUES_FREQUENCY_OF_SUPPLY_VOLTAGES_HERTZ, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(73, METER_ALL_VALUES_TOTAL_IMPORT_KWH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(75, METER_ALL_VALUES_TOTAL_EXPORT_KWH, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(201, METER_ALL_VALUES_LINE1_TO_LINE2_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(203, METER_ALL_VALUES_LINE2_TO_LINE3_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(205, METER_ALL_VALUES_LINE3_TO_LINE1_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(207, METER_ALL_VALUES_AVERAGE_LINE_TO_LINE_VOLTS, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(225, METER_ALL_VALUES_NEUTRAL_CURRENT_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(243, METER_ALL_VALUES_CURRENT_THD_L2_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(245, METER_ALL_VALUES_CURRENT_THD_L3_A, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(343, METER_ALL_VALUES_TOTAL_KWH_SUM, READ_INTERVAL_SLOW_MS),
+    METER_FLOAT(345, METER_ALL_VALUES_TOTAL_KVARH_SUM, READ_INTERVAL_SLOW_MS)
 };
 
-static const RegRead sdm72dmv2_fast[]{
-    {1, 12},  // current per phase
-    {53, 2},  // power
-    {343, 2}, // energy_abs
-    {385, 2}  // energy_rel
-};
-
-static const uint16_t sdm72dmv2_registers_to_read[] = {
-	1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31,33,35,47,49,53,57,61,63,71,73,75,201,203,205,207,225,243,245,343,345
-};
-
-static const bool sdm_registers_available_in_sdm72v2[] = {
-	1,1,1,1,1,1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,  0,  0,  0,  1,  1,  1,  1,  1,  0,  0,  0,  0,  1,  1,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
-};
-
-enum FastValues {
-    Power,
-    EnergyAbs,
-    EnergyRel,
-    VoltagePhase0,
-    VoltagePhase1,
-    VoltagePhase2,
-    CurrentPhase0,
-    CurrentPhase1,
-    CurrentPhase2,
-};
-
-static const uint16_t sdm72dmv2_registers_fast_to_read[] = {
-	53, 343, 385, 1, 3, 5, 7, 9, 11 // power, energy_abs, energy_rel, voltage per phase, current per phase
-};
-
-static void sdm72dmv2_fast_read_done(const uint16_t *all_regs)
-{
-    float fast_values[sizeof(sdm72dmv2_registers_fast_to_read)/sizeof(sdm72dmv2_registers_fast_to_read[0])];
-    convert_to_float(all_regs, fast_values, sdm72dmv2_registers_fast_to_read, sizeof(sdm72dmv2_registers_fast_to_read) / sizeof(sdm72dmv2_registers_fast_to_read[0]));
-
-    // TODO: Handle reset
-    meter.updateMeterValues(fast_values[Power], fast_values[EnergyRel], fast_values[EnergyAbs]);
-
-    bool phases_active[3] = {
-        fast_values[CurrentPhase0] > PHASE_ACTIVE_CURRENT_THRES,
-        fast_values[CurrentPhase1] > PHASE_ACTIVE_CURRENT_THRES,
-        fast_values[CurrentPhase2] > PHASE_ACTIVE_CURRENT_THRES
-    };
-
-    bool phases_connected[3] = {
-        fast_values[VoltagePhase0] > PHASE_CONNECTED_VOLTAGE_THRES,
-        fast_values[VoltagePhase1] > PHASE_CONNECTED_VOLTAGE_THRES,
-        fast_values[VoltagePhase2] > PHASE_CONNECTED_VOLTAGE_THRES
-    };
-
-    meter.updateMeterPhases(phases_connected, phases_active);
-}
-
-static void sdm72dmv2_slow_read_done(const uint16_t *all_regs)
-{
-    //float all_values[METER_ALL_VALUES_COUNT];
-    //convert_to_float(all_regs, all_values, sdm72dmv2_registers_to_read, sizeof(sdm72dmv2_registers_to_read) / sizeof(sdm72dmv2_registers_to_read[0]));
-
-    size_t read = 0;
-    for (size_t i = 0; i < METER_ALL_VALUES_COUNT; ++i) {
-        if (!sdm_registers_available_in_sdm72v2[i])
-            continue;
-
-        float val;
-        convert_to_float(all_regs, &val, &sdm72dmv2_registers_to_read[read], 1),
-        meter.updateMeterAllValues(i, val);
-        ++read;
-    }
-
-    //meter.updateMeterAllValues(all_values);
-}
-
 MeterInfo sdm72dmv2 {
     0x0089,
     3,
-    sdm72dmv2_slow,
-    sizeof(sdm72dmv2_slow) / sizeof(sdm72dmv2_slow[0]),
-    sdm72dmv2_fast,
-    sizeof(sdm72dmv2_fast) / sizeof(sdm72dmv2_fast[0]),
-    sdm72dmv2_slow_read_done,
-    sdm72dmv2_fast_read_done,
     "SDM72DM-V2",
+    METER_VALUES(sdm72dmv2_values),
+    MODBUS_MAX_READ_REGISTERS,
+    nullptr,
     nullptr
 };
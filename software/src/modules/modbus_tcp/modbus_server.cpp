@@ -0,0 +1,358 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Frederic Henrichs <frederic@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "modbus_server.h"
+
+#include <Arduino.h>
+#include <lwip/sockets.h>
+
+#include "event_log.h"
+
+extern EventLog logger;
+
+#define MODBUS_FC_READ_COILS 0x01
+#define MODBUS_FC_READ_DISCRETE_INPUTS 0x02
+#define MODBUS_FC_READ_HOLDING_REGISTERS 0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS 0x04
+#define MODBUS_FC_WRITE_SINGLE_REGISTER 0x06
+#define MODBUS_FC_WRITE_MULTIPLE_REGISTERS 0x10
+
+#define MODBUS_EX_ILLEGAL_FUNCTION 0x01
+#define MODBUS_EX_ILLEGAL_DATA_ADDRESS 0x02
+#define MODBUS_EX_ILLEGAL_DATA_VALUE 0x03
+#define MODBUS_EX_SLAVE_DEVICE_BUSY 0x06
+
+#define MBAP_HEADER_LENGTH 7
+
+static uint16_t be16(const uint8_t *buf)
+{
+    return (buf[0] << 8) | buf[1];
+}
+
+static size_t exception(uint8_t function_code, uint8_t code, uint8_t *response)
+{
+    response[0] = function_code | 0x80;
+    response[1] = code;
+    return 2;
+}
+
+bool ModbusServer::start(uint16_t port, RegisterMap *map_in)
+{
+    map = map_in;
+
+    for (client_t &client : clients)
+        client.fd = -1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_fd < 0) {
+        logger.printfln("Modbus TCP: Failed to open socket: %s", strerror(errno));
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, MODBUS_TCP_MAX_CLIENTS) < 0) {
+        logger.printfln("Modbus TCP: Failed to listen on port %u: %s", port, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    xTaskCreate(server_task,
+        "modbus_tcp",
+        MODBUS_TCP_STACK_SIZE,
+        this,
+        tskIDLE_PRIORITY + 1,
+        nullptr);
+
+    return true;
+}
+
+void ModbusServer::server_task(void *arg)
+{
+    ((ModbusServer *)arg)->run();
+}
+
+void ModbusServer::run()
+{
+    for (;;) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(listen_fd, &read_fds);
+        int max_fd = listen_fd;
+
+        for (const client_t &client : clients) {
+            if (client.fd < 0)
+                continue;
+            FD_SET(client.fd, &read_fds);
+            if (client.fd > max_fd)
+                max_fd = client.fd;
+        }
+
+        struct timeval timeout = {1, 0};
+        int ready = select(max_fd + 1, &read_fds, nullptr, nullptr, &timeout);
+        if (ready <= 0)
+            continue;
+
+        if (FD_ISSET(listen_fd, &read_fds))
+            accept_client();
+
+        for (client_t &client : clients) {
+            if (client.fd < 0 || !FD_ISSET(client.fd, &read_fds))
+                continue;
+
+            if (!serve_client(client))
+                close_client(client);
+        }
+    }
+}
+
+void ModbusServer::accept_client()
+{
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0)
+        return;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct timeval send_timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    // If all slots are taken, drop the client that was idle the longest.
+    client_t *slot = nullptr;
+    for (client_t &client : clients) {
+        if (client.fd < 0) {
+            slot = &client;
+            break;
+        }
+
+        if (slot == nullptr || (uint32_t)(millis() - client.last_activity) > (uint32_t)(millis() - slot->last_activity))
+            slot = &client;
+    }
+
+    if (slot->fd >= 0)
+        close_client(*slot);
+
+    slot->fd = fd;
+    slot->rx_len = 0;
+    slot->last_activity = millis();
+}
+
+void ModbusServer::close_client(client_t &client)
+{
+    close(client.fd);
+    client.fd = -1;
+    client.rx_len = 0;
+}
+
+bool ModbusServer::send_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = send(fd, buf, len, 0);
+        if (written <= 0)
+            return false;
+        buf += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+bool ModbusServer::serve_client(client_t &client)
+{
+    ssize_t received = recv(client.fd, client.rx + client.rx_len, sizeof(client.rx) - client.rx_len, 0);
+    if (received <= 0)
+        return false;
+
+    client.rx_len += received;
+    client.last_activity = millis();
+
+    size_t pos = 0;
+    size_t tx_len = 0;
+
+    // Answer every complete request in the buffer.
+    while (client.rx_len - pos >= MBAP_HEADER_LENGTH) {
+        const uint8_t *adu = client.rx + pos;
+        uint16_t protocol_id = be16(adu + 2);
+        uint16_t length = be16(adu + 4);
+
+        if (protocol_id != 0 || length < 2 || length > MODBUS_TCP_MAX_ADU_LENGTH - 6)
+            return false;
+
+        if (client.rx_len - pos < 6u + length)
+            break;
+
+        if (tx_len + MODBUS_TCP_MAX_ADU_LENGTH > sizeof(tx)) {
+            if (!send_all(client.fd, tx, tx_len))
+                return false;
+            tx_len = 0;
+        }
+
+        uint8_t *response = tx + tx_len;
+
+        // Transaction and protocol identifier and unit identifier are echoed.
+        memcpy(response, adu, MBAP_HEADER_LENGTH);
+        size_t pdu_len = handle_pdu(adu + MBAP_HEADER_LENGTH, length - 1, response + MBAP_HEADER_LENGTH);
+        response[4] = (pdu_len + 1) >> 8;
+        response[5] = (pdu_len + 1) & 0xFF;
+
+        tx_len += MBAP_HEADER_LENGTH + pdu_len;
+        pos += 6 + length;
+    }
+
+    memmove(client.rx, client.rx + pos, client.rx_len - pos);
+    client.rx_len -= pos;
+
+    return tx_len == 0 || send_all(client.fd, tx, tx_len);
+}
+
+size_t ModbusServer::read_bits(uint8_t function_code, mb_param_type_t type, const uint8_t *pdu, size_t length, uint8_t *response)
+{
+    if (length != 5)
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+    uint16_t address = be16(pdu + 1);
+    uint16_t count = be16(pdu + 3);
+
+    if (count < 1 || count > 2000)
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+    uint8_t first_bit;
+    int offset = map->find_range(type, address, count, &first_bit);
+    if (offset < 0)
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_ADDRESS, response);
+
+    uint8_t byte_count = (count + 7) / 8;
+    response[0] = function_code;
+    response[1] = byte_count;
+    memset(response + 2, 0, byte_count);
+
+    const uint8_t *bits = map->acquire_image() + offset;
+    for (uint16_t i = 0; i < count; ++i) {
+        uint16_t bit = first_bit + i;
+        if ((bits[bit / 8] >> (bit % 8)) & 1)
+            response[2 + i / 8] |= 1 << (i % 8);
+    }
+    map->release_image();
+
+    return 2 + byte_count;
+}
+
+size_t ModbusServer::read_registers(uint8_t function_code, mb_param_type_t type, const uint8_t *pdu, size_t length, uint8_t *response)
+{
+    if (length != 5)
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+    uint16_t address = be16(pdu + 1);
+    uint16_t count = be16(pdu + 3);
+
+    if (count < 1 || count > 125)
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+    uint8_t first_bit;
+    int offset = map->find_range(type, address, count, &first_bit);
+    if (offset < 0)
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_ADDRESS, response);
+
+    response[0] = function_code;
+    response[1] = count * 2;
+
+    const uint16_t *words = (const uint16_t *)(map->acquire_image() + offset);
+    for (uint16_t i = 0; i < count; ++i) {
+        response[2 + i * 2] = words[i] >> 8;
+        response[3 + i * 2] = words[i] & 0xFF;
+    }
+    map->release_image();
+
+    return 2 + count * 2;
+}
+
+size_t ModbusServer::write_registers(uint8_t function_code, uint16_t address, uint16_t count, const uint8_t *values, uint8_t *response)
+{
+    // Registers that mirror data are read-only. Without this, a written value
+    // would stay in the image until the mirrored value changes.
+    if (!map->is_writable(address, count))
+        return exception(function_code, MODBUS_EX_ILLEGAL_DATA_ADDRESS, response);
+
+    if (!map->queue_write(address, values, count))
+        return exception(function_code, MODBUS_EX_SLAVE_DEVICE_BUSY, response);
+
+    return 0;
+}
+
+size_t ModbusServer::handle_pdu(const uint8_t *pdu, size_t length, uint8_t *response)
+{
+    uint8_t function_code = pdu[0];
+
+    switch (function_code) {
+        case MODBUS_FC_READ_COILS:
+            return read_bits(function_code, MB_PARAM_COIL, pdu, length, response);
+
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return read_bits(function_code, MB_PARAM_DISCRETE, pdu, length, response);
+
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return read_registers(function_code, MB_PARAM_HOLDING, pdu, length, response);
+
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return read_registers(function_code, MB_PARAM_INPUT, pdu, length, response);
+
+        case MODBUS_FC_WRITE_SINGLE_REGISTER: {
+            if (length != 5)
+                return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+            size_t ex_len = write_registers(function_code, be16(pdu + 1), 1, pdu + 3, response);
+            if (ex_len > 0)
+                return ex_len;
+
+            // The response echoes the request.
+            memcpy(response, pdu, 5);
+            return 5;
+        }
+
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
+            if (length < 6)
+                return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+            uint16_t count = be16(pdu + 3);
+            uint8_t byte_count = pdu[5];
+
+            if (count < 1 || count > 123 || byte_count != count * 2 || length != 6u + byte_count)
+                return exception(function_code, MODBUS_EX_ILLEGAL_DATA_VALUE, response);
+
+            size_t ex_len = write_registers(function_code, be16(pdu + 1), count, pdu + 6, response);
+            if (ex_len > 0)
+                return ex_len;
+
+            memcpy(response, pdu, 5);
+            return 5;
+        }
+
+        default:
+            return exception(function_code, MODBUS_EX_ILLEGAL_FUNCTION, response);
+    }
+}
@@ -0,0 +1,71 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Frederic Henrichs <frederic@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "register_map.h"
+
+#define MODBUS_TCP_MAX_CLIENTS 4
+#define MODBUS_TCP_MAX_ADU_LENGTH 260
+#define MODBUS_TCP_RX_BUFFER_SIZE (2 * MODBUS_TCP_MAX_ADU_LENGTH)
+#define MODBUS_TCP_TX_BUFFER_SIZE 1460
+#define MODBUS_TCP_STACK_SIZE 4096
+
+// Modbus TCP front end for a RegisterMap.
+// One task serves all client connections. Requests that arrive back to back
+// (pipelined transactions) are answered in order with as few sends as possible.
+// Reads are served from the published register image without locking.
+class ModbusServer
+{
+public:
+    ModbusServer() {}
+
+    bool start(uint16_t port, RegisterMap *map);
+
+    // Handles one request PDU (function code and data) and writes the response PDU.
+    // Returns the length of the response.
+    size_t handle_pdu(const uint8_t *pdu, size_t length, uint8_t *response);
+
+private:
+    struct client_t {
+        int fd;
+        uint32_t last_activity;
+        size_t rx_len;
+        uint8_t rx[MODBUS_TCP_RX_BUFFER_SIZE];
+    };
+
+    static void server_task(void *arg);
+    void run();
+    void accept_client();
+    bool serve_client(client_t &client);
+    bool send_all(int fd, const uint8_t *buf, size_t len);
+    void close_client(client_t &client);
+
+    size_t read_bits(uint8_t function_code, mb_param_type_t type, const uint8_t *pdu, size_t length, uint8_t *response);
+    size_t read_registers(uint8_t function_code, mb_param_type_t type, const uint8_t *pdu, size_t length, uint8_t *response);
+    size_t write_registers(uint8_t function_code, uint16_t address, uint16_t count, const uint8_t *values, uint8_t *response);
+
+    RegisterMap *map = nullptr;
+    int listen_fd = -1;
+    client_t clients[MODBUS_TCP_MAX_CLIENTS];
+    uint8_t tx[MODBUS_TCP_TX_BUFFER_SIZE];
+};
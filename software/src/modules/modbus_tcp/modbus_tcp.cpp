@@ -20,16 +20,17 @@
 #include <Arduino.h>
 
 #include "esp_modbus_common.h"
-#include "esp_modbus_slave.h"
-#include "esp_netif.h"
 
 #include "modules.h"
 #include "modbus_tcp.h"
+#include "register_map.h"
+#include "modbus_server.h"
 #include "build.h"
 #include "math.h"
 
 extern TaskScheduler task_scheduler;
 extern API api;
+extern EventLog logger;
 extern uint32_t local_uid_num;
 
 #if MODULE_EVSE_V2_AVAILABLE()
@@ -51,7 +52,6 @@ struct uint32swapped_t {
     static inline uint32_t swapReg(uint32_t x) { return (x << 16) | (x >> 16);}
     uint32_t val;
 };
-static uint32swapped_t fromUint(uint32_t x) {return {uint32swapped_t::swapReg(x)};}
 
 struct floatswapped_t {
     //floatswapped_t(float x): val(swapReg(x)) {}
@@ -65,7 +65,6 @@ struct floatswapped_t {
     }
     float val;
 };
-static floatswapped_t fromFloat(float x) {return {floatswapped_t::swapReg(x)};}
 
 //-------------------
 // Input Registers
@@ -295,478 +294,183 @@ struct meter_discrete_inputs_t {
     bool phase_three_active:1;
 };
 
-static input_regs_t *input_regs, *input_regs_copy;
-static evse_input_regs_t *evse_input_regs, *evse_input_regs_copy;
-static meter_input_regs_t *meter_input_regs, *meter_input_regs_copy;
-static meter_all_values_input_regs_t *meter_all_values_input_regs, *meter_all_values_input_regs_copy;
-
-static holding_regs_t *holding_regs, *holding_regs_copy;
-static evse_holding_regs_t *evse_holding_regs, *evse_holding_regs_copy;
-static meter_holding_regs_t *meter_holding_regs, *meter_holding_regs_copy;
-
-static discrete_inputs_t *discrete_inputs, *discrete_inputs_copy;
-static meter_discrete_inputs_t *meter_discrete_inputs, *meter_discrete_inputs_copy;
-
-
-static bender_general_s *bender_general, *bender_general_cpy;
-static bender_phases_s *bender_phases, *bender_phases_cpy;
-static bender_dlm_s *bender_dlm, *bender_dlm_cpy;
-static bender_charge_s *bender_charge, *bender_charge_cpy;
-static bender_hems_s *bender_hems, *bender_hems_cpy;
-static bender_write_uid_s *bender_write_uid, *bender_write_uid_cpy;
-
-
-static keba_read_general_s *keba_read_general, *keba_read_general_cpy;
-static keba_read_charge_s *keba_read_charge, *keba_read_charge_cpy;
-static keba_read_max_s *keba_read_max, *keba_read_max_cpy;
-static keba_write_s *keba_write, *keba_write_cpy;
-
-
-static portMUX_TYPE mtx;
+//-------------------
+// Converters
+//-------------------
+static uint32_t float_bits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
 
-ModbusTcp::ModbusTcp() {}
+static uint32_t conv_uint(const Config *const *src)
+{
+    return src[0]->asUint();
+}
 
-void ModbusTcp::pre_setup()
+static uint32_t conv_uint_div1000(const Config *const *src)
 {
-    config = Config::Object({
-        {"enable", Config::Bool(false)},
-        {"port", Config::Uint16(502)},
-        {"table", Config::Uint16(0)},
-    });
+    return src[0]->asUint() / 1000;
 }
 
-static void allocate_table()
-{
-    calloc_struct(&input_regs);
-    calloc_struct(&input_regs_copy);
-    calloc_struct(&evse_input_regs);
-    calloc_struct(&evse_input_regs_copy);
-    calloc_struct(&meter_input_regs);
-    calloc_struct(&meter_input_regs_copy);
-    calloc_struct(&meter_all_values_input_regs);
-    calloc_struct(&meter_all_values_input_regs_copy);
-    calloc_struct(&holding_regs);
-    calloc_struct(&holding_regs_copy);
-    calloc_struct(&evse_holding_regs);
-    calloc_struct(&evse_holding_regs_copy);
-    calloc_struct(&meter_holding_regs);
-    calloc_struct(&meter_holding_regs_copy);
-    calloc_struct(&discrete_inputs);
-    calloc_struct(&discrete_inputs_copy);
-    calloc_struct(&meter_discrete_inputs);
-    calloc_struct(&meter_discrete_inputs_copy);
-}
-
-static void allocate_bender_table()
-{
-    calloc_struct(&bender_general);
-    calloc_struct(&bender_general_cpy);
-    calloc_struct(&bender_phases);
-    calloc_struct(&bender_phases_cpy);
-    calloc_struct(&bender_dlm);
-    calloc_struct(&bender_dlm_cpy);
-    calloc_struct(&bender_charge);
-    calloc_struct(&bender_charge_cpy);
-    calloc_struct(&bender_hems);
-    calloc_struct(&bender_hems_cpy);
-    calloc_struct(&bender_write_uid);
-    calloc_struct(&bender_write_uid_cpy);
-}
-
-static void allocate_keba_table()
-{
-    calloc_struct(&keba_read_charge);
-    calloc_struct(&keba_read_charge_cpy);
-    calloc_struct(&keba_read_general);
-    calloc_struct(&keba_read_general_cpy);
-    calloc_struct(&keba_read_max);
-    calloc_struct(&keba_read_max_cpy);
-    calloc_struct(&keba_write);
-    calloc_struct(&keba_write_cpy);
+static uint32_t conv_bool(const Config *const *src)
+{
+    return src[0]->asBool();
 }
 
-void ModbusTcp::setup()
+static uint32_t conv_float(const Config *const *src)
 {
-    api.restorePersistentConfig("modbus_tcp/config", &config);
+    return float_bits(src[0]->asFloat());
+}
 
-    if (config.get("enable")->asBool() == true)
-    {
-        void *modbus_handle = NULL;
-        esp_err_t err = mbc_slave_init_tcp(&modbus_handle);
-        if (err != ESP_OK || modbus_handle == NULL)
-            printf("Modbus init failed with code %i", err);
-
-        mb_communication_info_t comm_info;
-        comm_info.ip_addr = NULL;
-        comm_info.mode = MB_MODE_TCP;
-        comm_info.ip_addr_type = MB_IPV4;
-        comm_info.ip_port = config.get("port")->asUint();
-        // For some reason, mbc_slave_setup asserts that comm_info.ip_netif_ptr is not null,
-        // but the ip_netif_ptr is never used.
-        // Fortunately this means that we can just pass anything to circumvent the assertion
-        // and the modbus_tcp server will listen on any network interface.
-        comm_info.ip_netif_ptr = (void *) 0x12345678;
-        ESP_ERROR_CHECK(mbc_slave_setup((void *)&comm_info));
-
-        mb_register_area_descriptor_t reg_area;
-
-#define REGISTER_DESCRIPTOR(x) do { \
-    reg_area.type = x->TYPE; \
-    reg_area.start_offset = x->OFFSET; \
-    reg_area.address = x; \
-    reg_area.size = sizeof(*x); \
-    ESP_ERROR_CHECK(mbc_slave_set_descriptor(reg_area)); \
-} while (0)
-
-        if (config.get("table")->asUint() == 0)
-        {
-            allocate_table();
-
-            REGISTER_DESCRIPTOR(evse_input_regs);
-            REGISTER_DESCRIPTOR(meter_input_regs);
-            REGISTER_DESCRIPTOR(meter_all_values_input_regs);
-            REGISTER_DESCRIPTOR(input_regs);
-            REGISTER_DESCRIPTOR(holding_regs);
-            REGISTER_DESCRIPTOR(evse_holding_regs);
-            REGISTER_DESCRIPTOR(meter_holding_regs);
-            REGISTER_DESCRIPTOR(discrete_inputs);
-            REGISTER_DESCRIPTOR(meter_discrete_inputs);
-        }
-        else if (config.get("table")->asUint() == 1)
-        {
-            allocate_bender_table();
-
-            REGISTER_DESCRIPTOR(bender_general);
-            REGISTER_DESCRIPTOR(bender_phases);
-            REGISTER_DESCRIPTOR(bender_dlm);
-            REGISTER_DESCRIPTOR(bender_charge);
-            REGISTER_DESCRIPTOR(bender_hems);
-            REGISTER_DESCRIPTOR(bender_write_uid);
-        }
-        else if (config.get("table")->asUint() == 2)
-        {
-            allocate_keba_table();
+static uint32_t conv_float_to_uint(const Config *const *src)
+{
+    return (uint32_t)src[0]->asFloat();
+}
 
-            REGISTER_DESCRIPTOR(keba_read_charge);
-            REGISTER_DESCRIPTOR(keba_read_general);
-            REGISTER_DESCRIPTOR(keba_read_max);
-            REGISTER_DESCRIPTOR(keba_write);
-        }
+static uint32_t conv_float_to_uint_milli(const Config *const *src)
+{
+    return (uint32_t)(src[0]->asFloat() * 1000);
+}
 
-        ESP_ERROR_CHECK(mbc_slave_start());
-    }
+static uint32_t conv_slot_enabled(const Config *const *src)
+{
+    return src[0]->asUint() == 32000 ? 1 : 0;
+}
 
-    initialized = true;
+// max_current, active
+static uint32_t conv_slot(const Config *const *src)
+{
+    return src[1]->asBool() ? src[0]->asUint() : 0xFFFFFFFF;
 }
 
-void ModbusTcp::update_bender_regs()
+static uint32_t conv_uptime_s(const Config *const *)
 {
-    portENTER_CRITICAL(&mtx);
-        *bender_general_cpy = *bender_general;
-        *bender_dlm_cpy = *bender_dlm;
-        *bender_hems_cpy = *bender_hems;
-        *bender_write_uid_cpy = *bender_write_uid;
-    portEXIT_CRITICAL(&mtx);
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
 
-    bool charging = false;
+static uint32_t conv_build_timestamp(const Config *const *)
+{
+    return build_timestamp();
+}
 
-    bender_general_cpy->device_id = 0xEBEE;
+static uint32_t conv_box_id(const Config *const *)
+{
+    return local_uid_num;
+}
 
-#define NOT_SUPPORTED 0
+#if MODULE_CHARGE_TRACKER_AVAILABLE()
+static bool is_charging(const Config *user_id)
+{
+    return user_id->asInt() != -1;
+}
 
-    for (int i = 0; i < 4; i++)
-        bender_general_cpy->errorcodes[i] = fromUint(NOT_SUPPORTED);
-    for (int i = 0; i < 5; i++)
-    {
-        if (bender_write_uid_cpy->user_id[i])
-        {
-            logger.printfln("Writing userid is not supported");
-            bender_write_uid_cpy->user_id[i] = fromUint(NOT_SUPPORTED);
-        }
-    }
+// user_id
+static uint32_t conv_current_user(const Config *const *src)
+{
+    return is_charging(src[0]) ? UINT32_MAX : (uint32_t)src[0]->asInt();
+}
 
-    if (bender_general_cpy->comm_timeout)
-    {
-        logger.printfln("Writing communication timeout is not supported");
-        bender_general_cpy->comm_timeout = fromUint(NOT_SUPPORTED);
-    }
+// timestamp_minutes, user_id
+static uint32_t conv_charge_start_min(const Config *const *src)
+{
+    return is_charging(src[1]) ? src[0]->asUint() : 0;
+}
 
-    if (bender_general_cpy->safe_current)
-    {
-        logger.printfln("Writing safe current is not supported");
-        bender_general_cpy->safe_current = fromUint(NOT_SUPPORTED);
-    }
+// evse uptime, evse_uptime_start, user_id
+static uint32_t conv_charge_duration_s(const Config *const *src)
+{
+    return is_charging(src[2]) ? (src[0]->asUint() - src[1]->asUint()) / 1000 : 0;
+}
 
-    for (int i = 0; i < 3; i++)
-    {
-        if (bender_dlm_cpy->operator_evse_limit[i])
-        {
-            logger.printfln("Writing dlm operator current l%i is not supported", i);
-            bender_dlm_cpy->operator_evse_limit[i] = fromUint(NOT_SUPPORTED);
-        }
-    }
+// energy_abs, meter_start, user_id
+static uint32_t conv_energy_this_charge(const Config *const *src)
+{
+    if (!is_charging(src[2]))
+        return float_bits(0);
+    if (isnan(src[1]->asFloat()))
+        return float_bits(NAN);
+    return float_bits(src[0]->asFloat() - src[1]->asFloat());
+}
 
-    memcpy(bender_general_cpy->firmware_version, ".404", 4);
-    memcpy(bender_general_cpy->protocol_version, "0\0006.", 4);
+// energy_abs, meter_start, user_id
+static uint32_t conv_charged_energy_wh(const Config *const *src)
+{
+    if (!is_charging(src[2]) || isnan(src[1]->asFloat()))
+        return 0;
+    return (uint32_t)((src[0]->asFloat() - src[1]->asFloat()) * 1000);
+}
+#endif
 
-#if MODULE_EVSE_V2_AVAILABLE() || MODULE_EVSE_AVAILABLE()
-    if (api.hasFeature("evse"))
-    {
-        switch (api.getState("evse/state")->get("charger_state")->asUint())
-        {
+static uint32_t conv_bender_cp_state(const Config *const *src)
+{
+    switch (src[0]->asUint()) {
         case 0:
-            bender_general_cpy->ocpp_cp_state = 0;
-            break;
-
+            return 0;
         case 4:
-            bender_general_cpy->ocpp_cp_state = 4;
-            break;
-
+            return 4;
         default:
-            bender_general_cpy->ocpp_cp_state = 1;
-            break;
-        }
-        bender_general_cpy->vehicle_state = api.getState("evse/state")->get("iec61851_state")->asUint() + 1;
-        bender_general_cpy->vehicle_state_hex = api.getState("evse/state")->get("iec61851_state")->asUint() + 10;
-
-        bender_general_cpy->hardware_curr_limit = api.getState("evse/slots")->get(1)->get("max_current")->asUint() / 1000;
-        bender_charge_cpy->current_signaled = api.getState("evse/state")->get("allowed_charging_current")->asUint() / 1000;
-
-#if MODULE_EVSE_V2_AVAILABLE()
-        evse_v2.set_modbus_current(bender_hems_cpy->hems_limit * 1000);
-        evse_v2.set_modbus_enabled(true);
-#elif MODULE_EVSE_AVAILABLE()
-        evse.set_modbus_current(bender_hems_cpy->hems_limit * 1000);
-        evse.set_modbus_enabled(true);
-#endif
-
-#if MODULE_CHARGE_TRACKER_AVAILABLE()
-        int32_t user_id = api.getState("charge_tracker/current_charge")->get("user_id")->asInt();
-        charging = user_id != -1;
-        if (charging) {
-            bender_charge_cpy->charge_duration = fromUint((api.getState("evse/low_level_state")->get("uptime")->asUint() - api.getState("charge_tracker/current_charge")->get("evse_uptime_start")->asUint()) / 1000);
-            bender_charge_cpy->charge_duration_new = fromUint((api.getState("evse/low_level_state")->get("uptime")->asUint() - api.getState("charge_tracker/current_charge")->get("evse_uptime_start")->asUint()) / 1000);
-        } else {
-            bender_charge_cpy->charge_duration = fromUint(0);
-            bender_charge_cpy->charge_duration_new = fromUint(0);
-        }
-#endif
+            return 1;
     }
-#endif
-
-#if MODULE_METER_AVAILABLE()
-    if (api.hasFeature("meter"))
-    {
-        if (api.hasFeature("meter_all_values"))
-        {
-            auto meter_values = api.getState("meter/all_values");
-
-            for (int i = 0; i < 3; i++)
-            {
-                bender_phases_cpy->current[i] = fromUint(meter_values->get(i + METER_ALL_VALUES_CURRENT_L1_A)->asFloat() * 1000);
-                bender_phases_cpy->energy[i] =  fromUint(meter_values->get(i + METER_ALL_VALUES_IMPORT_KWH_L1)->asFloat() * 1000);
-                bender_phases_cpy->power[i] =  fromUint(meter_values->get(i + METER_ALL_VALUES_POWER_L1_W)->asFloat() * 1000);
-                bender_phases_cpy->voltage[i] = fromUint(meter_values->get(i)->asFloat() * 1000);
-            }
-            bender_phases_cpy->total_energy = fromUint(meter_values->get(METER_ALL_VALUES_TOTAL_IMPORT_KWH)->asFloat() * 1000);
-            bender_phases_cpy->total_power = fromUint(meter_values->get(METER_ALL_VALUES_TOTAL_SYSTEM_POWER_W)->asFloat());
-        }
-
-#if MODULE_CHARGE_TRACKER_AVAILABLE()
-        auto meter_start = api.getState("charge_tracker/current_charge")->get("meter_start")->asFloat();
-        auto meter_absolute = api.getState("meter/values")->get("energy_abs")->asFloat();
-        if (!charging)
-        {
-            bender_charge_cpy->wh_charged = fromUint(0);
-            bender_charge_cpy->charged_energy = fromUint(0);
-        }
-        else if (isnan(meter_start))
-        {
-            bender_charge_cpy->wh_charged = 0;
-            bender_charge_cpy->charged_energy = fromUint(0);
-        }
-        else
-        {
-            bender_charge_cpy->wh_charged = uint16_t((meter_absolute - meter_start) * 1000);
-            bender_charge_cpy->charged_energy = fromUint((meter_absolute - meter_start) * 1000);
-        }
-#endif
-
-    }
-#endif
-
-    portENTER_CRITICAL(&mtx);
-        *bender_charge = *bender_charge_cpy;
-        *bender_dlm = *bender_dlm_cpy;
-        *bender_general = *bender_general_cpy;
-        *bender_hems = *bender_hems_cpy;
-        *bender_phases = *bender_phases_cpy;
-        *bender_write_uid = *bender_write_uid_cpy;
-    portEXIT_CRITICAL(&mtx);
 }
 
-void ModbusTcp::update_regs()
+static uint32_t conv_bender_vehicle_state(const Config *const *src)
 {
-    // We want to keep the critical sections as small as possible
-    // -> Do all work in a copy of the registers.
-    portENTER_CRITICAL(&mtx);
-        *holding_regs_copy = *holding_regs;
-        *evse_holding_regs_copy = *evse_holding_regs;
-        *meter_holding_regs_copy = *meter_holding_regs;
-    portEXIT_CRITICAL(&mtx);
-
-    bool write_allowed = false;
-    if (api.hasFeature("evse"))
-        write_allowed = api.getState("evse/slots")->get(CHARGING_SLOT_MODBUS_TCP)->get("active")->asBool();
-    bool charging = false;
-
-    if (holding_regs_copy->reboot == holding_regs_copy->REBOOT_PASSWORD && write_allowed)
-        trigger_reboot("Modbus TCP");
-
-    input_regs_copy->table_version = fromUint(MODBUS_TABLE_VERSION);
-    input_regs_copy->box_id = fromUint(local_uid_num);
-    input_regs_copy->firmware_major = fromUint(BUILD_VERSION_MAJOR);
-    input_regs_copy->firmware_minor = fromUint(BUILD_VERSION_MINOR);
-    input_regs_copy->firmware_patch = fromUint(BUILD_VERSION_PATCH);
-    input_regs_copy->firmware_build_ts = fromUint(build_timestamp());
-    input_regs_copy->uptime = fromUint((uint32_t)(esp_timer_get_time() / 1000000));
-
-#if MODULE_EVSE_V2_AVAILABLE() || MODULE_EVSE_AVAILABLE()
-    if (api.hasFeature("evse"))
-    {
-        discrete_inputs_copy->evse = true;
-        evse_input_regs_copy->iec_state = fromUint(api.getState("evse/state")->get("iec61851_state")->asUint());
-        evse_input_regs_copy->charger_state = fromUint(api.getState("evse/state")->get("charger_state")->asUint());
-
-#if MODULE_EVSE_V2_AVAILABLE()
-        evse_v2.set_modbus_current(evse_holding_regs_copy->allowed_current);
-        evse_v2.set_modbus_enabled(evse_holding_regs_copy->enable_charging);
-#elif MODULE_EVSE_AVAILABLE()
-        evse.set_modbus_current(evse_holding_regs_copy->allowed_current);
-        evse.set_modbus_enabled(evse_holding_regs_copy->enable_charging);
-#endif
-
-        auto slots = api.getState("evse/slots");
-
-        for (int i = 0; i < slots->count(); i++)
-        {
-            uint32_t current = slots->get(i)->get("max_current")->asUint();
-            uint32_t val = 0xFFFFFFFF;
-
-            if (slots->get(i)->get("active")->asBool() == true)
-            {
-                val = current;
-            }
-            evse_input_regs_copy->slots[i] = fromUint(val);
-        }
-
-        evse_input_regs_copy->max_current = fromUint(api.getState("evse/state")->get("allowed_charging_current")->asUint());
-        evse_input_regs_copy->start_time_min = fromUint(0);
-        evse_input_regs_copy->charging_time_sec = fromUint(0);
-
-#if MODULE_CHARGE_TRACKER_AVAILABLE()
-        int32_t user_id = api.getState("charge_tracker/current_charge")->get("user_id")->asInt();
-        charging = user_id != -1;
-        evse_input_regs_copy->current_user = fromUint(charging ? UINT32_MAX : (uint32_t)user_id);
-        if (charging) {
-            evse_input_regs_copy->start_time_min = fromUint(api.getState("charge_tracker/current_charge")->get("timestamp_minutes")->asUint());
-            evse_input_regs_copy->charging_time_sec = fromUint((api.getState("evse/low_level_state")->get("uptime")->asUint() - api.getState("charge_tracker/current_charge")->get("evse_uptime_start")->asUint()) / 1000);
-        } else {
-            evse_input_regs_copy->start_time_min = fromUint(0);
-            evse_input_regs_copy->charging_time_sec = fromUint(0);
-        }
-#endif
-    }
-#endif
-
-#if MODULE_METER_AVAILABLE()
-    if (api.hasFeature("meter"))
-    {
-        discrete_inputs_copy->meter = true;
-
-        meter_input_regs_copy->meter_type = fromUint(api.getState("meter/state")->get("type")->asUint());
-
-        auto meter_values = api.getState("meter/values");
-        meter_input_regs_copy->power = fromFloat(meter_values->get("power")->asFloat());
-        meter_input_regs_copy->energy_relative = fromFloat(meter_values->get("energy_rel")->asFloat());
-        meter_input_regs_copy->energy_absolute = fromFloat(meter_values->get("energy_abs")->asFloat());
-#if MODULE_CHARGE_TRACKER_AVAILABLE()
-        auto meter_start = api.getState("charge_tracker/current_charge")->get("meter_start")->asFloat();
-        if (!charging)
-            meter_input_regs_copy->energy_this_charge = fromFloat(0);
-        else if (isnan(meter_start))
-            meter_input_regs_copy->energy_this_charge = fromFloat(NAN);
-        else
-            meter_input_regs_copy->energy_this_charge = fromFloat(meter_input_regs_copy->energy_absolute - meter_start);
-#endif
-
-        if (meter_holding_regs_copy->trigger_reset == meter_holding_regs_copy->TRIGGER_RESET_PASSWORD && write_allowed)
-            api.callCommand("meter/reset", {});
-    }
-
-    if (api.hasFeature("meter_phases"))
-    {
-        discrete_inputs_copy->meter_phases = true;
-
-        auto meter_phase_values = api.getState("meter/phases");
-        meter_discrete_inputs_copy->phase_one_active = meter_phase_values->get("phases_active")->get(0)->asBool();
-        meter_discrete_inputs_copy->phase_two_active = meter_phase_values->get("phases_active")->get(1)->asBool();
-        meter_discrete_inputs_copy->phase_three_active = meter_phase_values->get("phases_active")->get(2)->asBool();
-        meter_discrete_inputs_copy->phase_one_connected = meter_phase_values->get("phases_connected")->get(0)->asBool();
-        meter_discrete_inputs_copy->phase_two_connected = meter_phase_values->get("phases_connected")->get(1)->asBool();
-        meter_discrete_inputs_copy->phase_three_connected = meter_phase_values->get("phases_connected")->get(2)->asBool();
-    }
+    return src[0]->asUint() + 1;
+}
 
-    if (api.hasFeature("meter_all_values"))
-    {
-        discrete_inputs_copy->meter_all_values = true;
+static uint32_t conv_bender_vehicle_state_hex(const Config *const *src)
+{
+    return src[0]->asUint() + 10;
+}
 
-        auto meter_all_values = api.getState("meter/all_values");
+static uint32_t conv_keba_charging_state(const Config *const *src)
+{
+    uint32_t iec61851_state = src[0]->asUint();
+    return iec61851_state == 4 ? 4 : iec61851_state + 1;
+}
 
-        for (int i = 0; i < 85; i++)
-            meter_all_values_input_regs_copy->meter_values[i] = fromFloat(meter_all_values->get(i)->asFloat());
+static uint32_t conv_keba_cable_state(const Config *const *src)
+{
+    switch (src[0]->asUint()) {
+        case 0:
+            return 0;
+        case 1:
+        case 2:
+            return 3;
+        default:
+            return 7;
     }
-#endif
-
-    portENTER_CRITICAL(&mtx);
-        *input_regs = *input_regs_copy;
-        *evse_input_regs = *evse_input_regs_copy;
-        *meter_input_regs = *meter_input_regs_copy;
-        *meter_all_values_input_regs = *meter_all_values_input_regs_copy;
-        *discrete_inputs = *discrete_inputs_copy;
-        *meter_discrete_inputs = *meter_discrete_inputs_copy;
-    portEXIT_CRITICAL(&mtx);
 }
 
-uint32_t keba_get_features()
+// jumper_configuration
+static uint32_t conv_keba_features(const Config *const *src)
 {
     static bool warned;
     uint32_t features = 31;
     features *= 10;
-    if (api.hasFeature("evse"))
+    switch (src[0]->asUint())
     {
-        switch (api.getState("evse/hardware_configuration")->get("jumper_configuration")->asUint())
-        {
-        case 2:
-            features += 1;
-            break;
+    case 2:
+        features += 1;
+        break;
 
-        case 3:
-            features += 2;
-            break;
+    case 3:
+        features += 2;
+        break;
 
-        case 4:
-            features += 3;
-            break;
+    case 4:
+        features += 3;
+        break;
 
-        case 6:
-            features += 4;
-            break;
+    case 6:
+        features += 4;
+        break;
 
-        default:
-            logger.printfln("No matching keba cable configuration! It will be set to 0!");
-            break;
-        }
+    default:
+        logger.printfln("No matching keba cable configuration! It will be set to 0!");
+        break;
     }
     features *= 10;
     features += 1;
@@ -816,85 +520,291 @@ static uint32_t export_tag_id_as_uint32(const String &str)
     return *ret;
 }
 
-void ModbusTcp::update_keba_regs()
+// authorization_type, authorization_info
+static uint32_t conv_keba_rfid_tag(const Config *const *src)
 {
-    portENTER_CRITICAL(&mtx);
-        *keba_write_cpy = *keba_write;
-    portEXIT_CRITICAL(&mtx);
+    // authorization_info is replaced as a whole when a charge starts,
+    // so its tag_id can't be resolved in advance.
+    if (src[0]->asUint() != 2)
+        return 0;
 
-    keba_read_general_cpy->features = fromUint(keba_get_features());
-    keba_read_general_cpy->firmware_version = fromUint(0x30A1B00);
+    return export_tag_id_as_uint32(src[1]->get("tag_id")->asString());
+}
 
-#if MODULE_EVSE_V2_AVAILABLE() || MODULE_EVSE_AVAILABLE()
-    if (api.hasFeature("evse"))
-    {
+//-------------------
+// Write handlers
+//-------------------
+static void set_modbus_current(uint32_t current)
+{
 #if MODULE_EVSE_V2_AVAILABLE()
-        evse_v2.set_modbus_current(keba_write_cpy->set_charging_current);
-        evse_v2.set_modbus_enabled(keba_write_cpy->enable_station == 1 ? true : false);
+    evse_v2.set_modbus_current(current);
 #elif MODULE_EVSE_AVAILABLE()
-        evse.set_modbus_current(keba_write_cpy->set_charging_current);
-        evse.set_modbus_enabled(keba_write_cpy->enable_station == 1 ? true : false);
+    evse.set_modbus_current(current);
 #endif
-        if (api.getState("evse/state")->get("iec61851_state")->asUint() == 4)
-            keba_read_general_cpy->charging_state = fromUint(4);
-        else
-            keba_read_general_cpy->charging_state = fromUint(api.getState("evse/state")->get("iec61851_state")->asUint() + 1);
-        if (api.getState("evse/state")->get("charger_state")->asUint() == 0)
-            keba_read_general_cpy->cable_state = fromUint(0);
-        else if (api.getState("evse/state")->get("charger_state")->asUint() == 1 || api.getState("evse/state")->get("charger_state")->asUint() == 2)
-            keba_read_general_cpy->cable_state = fromUint(3);
-        else
-            keba_read_general_cpy->cable_state = fromUint(7);
-
-        keba_read_max_cpy->max_current = fromUint(api.getState("evse/state")->get("allowed_charging_current")->asUint());
-
-        keba_read_max_cpy->max_hardware_current = fromUint(api.getState("evse/slots")->get(CHARGING_SLOT_INCOMING_CABLE)->get("max_current")->asUint());
+}
+
+static void set_modbus_enabled(bool enabled)
+{
+#if MODULE_EVSE_V2_AVAILABLE()
+    evse_v2.set_modbus_enabled(enabled);
+#elif MODULE_EVSE_AVAILABLE()
+    evse.set_modbus_enabled(enabled);
+#endif
+}
+
+static bool write_allowed()
+{
+    static const Config *modbus_slot_active = nullptr;
+
+    if (modbus_slot_active == nullptr) {
+        if (!api.hasFeature("evse"))
+            return false;
+        modbus_slot_active = RegisterMap::resolve_source("evse/slots/#/active", CHARGING_SLOT_MODBUS_TCP);
+        if (modbus_slot_active == nullptr)
+            return false;
     }
+
+    return modbus_slot_active->asBool();
+}
+
+static bool handle_reboot(const reg_write_entry_t &, uint32_t value)
+{
+    if (value == holding_regs_t::REBOOT_PASSWORD && write_allowed())
+        trigger_reboot("Modbus TCP");
+    return false;
+}
+
+static bool handle_meter_reset(const reg_write_entry_t &, uint32_t value)
+{
+    if (value == meter_holding_regs_t::TRIGGER_RESET_PASSWORD && write_allowed() && api.hasFeature("meter"))
+        api.callCommand("meter/reset", {});
+    return false;
+}
+
+static bool handle_current(const reg_write_entry_t &, uint32_t value)
+{
+    set_modbus_current(value);
+    return false;
+}
+
+static bool handle_current_ampere(const reg_write_entry_t &, uint32_t value)
+{
+    set_modbus_current(value * 1000);
+    set_modbus_enabled(true);
+    return false;
+}
+
+static bool handle_enable(const reg_write_entry_t &, uint32_t value)
+{
+    set_modbus_enabled(value);
+    return false;
+}
+
+static bool handle_enable_station(const reg_write_entry_t &, uint32_t value)
+{
+    set_modbus_enabled(value == 1);
+    return false;
+}
+
+static bool reject_write(const reg_write_entry_t &entry, uint32_t value)
+{
+    if (value == 0)
+        return false;
+
+    logger.printfln("Writing %s is not supported", entry.name);
+    return true;
+}
+
+//-------------------
+// Register maps
+//-------------------
+static constexpr reg_area_t warp_areas[] = {
+    REG_AREA(evse_input_regs_t),
+    REG_AREA(meter_input_regs_t),
+    REG_AREA(meter_all_values_input_regs_t),
+    REG_AREA(input_regs_t),
+    REG_AREA(holding_regs_t),
+    REG_AREA(evse_holding_regs_t),
+    REG_AREA(meter_holding_regs_t),
+    REG_AREA(discrete_inputs_t),
+    REG_AREA(meter_discrete_inputs_t),
+};
+
+static constexpr reg_map_entry_t warp_reads[] = {
+    REG_CONST(input_regs_t, table_version, RegType::U32, MODBUS_TABLE_VERSION),
+    REG_CONST(input_regs_t, firmware_major, RegType::U32, BUILD_VERSION_MAJOR),
+    REG_CONST(input_regs_t, firmware_minor, RegType::U32, BUILD_VERSION_MINOR),
+    REG_CONST(input_regs_t, firmware_patch, RegType::U32, BUILD_VERSION_PATCH),
+    REG_READ(input_regs_t, firmware_build_ts, RegType::U32, nullptr, conv_build_timestamp),
+    REG_READ(input_regs_t, box_id, RegType::U32, nullptr, conv_box_id),
+    REG_READ(input_regs_t, uptime, RegType::U32, nullptr, conv_uptime_s),
+
+    REG_READ(evse_input_regs_t, iec_state, RegType::U32, "evse", conv_uint, "evse/state/iec61851_state"),
+    REG_READ(evse_input_regs_t, charger_state, RegType::U32, "evse", conv_uint, "evse/state/charger_state"),
+    REG_READ(evse_input_regs_t, max_current, RegType::U32, "evse", conv_uint, "evse/state/allowed_charging_current"),
+    REG_READ_ARRAY(evse_input_regs_t, slots, RegType::U32, CHARGING_SLOT_COUNT, 0, "evse", conv_slot, "evse/slots/#/max_current", "evse/slots/#/active"),
+#if MODULE_CHARGE_TRACKER_AVAILABLE()
+    REG_READ(evse_input_regs_t, current_user, RegType::U32, "evse", conv_current_user, "charge_tracker/current_charge/user_id"),
+    REG_READ(evse_input_regs_t, start_time_min, RegType::U32, "evse", conv_charge_start_min,
+             "charge_tracker/current_charge/timestamp_minutes", "charge_tracker/current_charge/user_id"),
+    REG_READ(evse_input_regs_t, charging_time_sec, RegType::U32, "evse", conv_charge_duration_s,
+             "evse/low_level_state/uptime", "charge_tracker/current_charge/evse_uptime_start", "charge_tracker/current_charge/user_id"),
 #endif
+    REG_BIT_CONST(discrete_inputs_t, 0, "evse", 1),
 
-#if MODULE_METER_AVAILABLE()
-    if (api.hasFeature("meter"))
-    {
-        bool charging = false;
+    REG_READ(meter_input_regs_t, meter_type, RegType::U32, "meter", conv_uint, "meter/state/type"),
+    REG_READ(meter_input_regs_t, power, RegType::F32, "meter", conv_float, "meter/values/power"),
+    REG_READ(meter_input_regs_t, energy_relative, RegType::F32, "meter", conv_float, "meter/values/energy_rel"),
+    REG_READ(meter_input_regs_t, energy_absolute, RegType::F32, "meter", conv_float, "meter/values/energy_abs"),
+#if MODULE_CHARGE_TRACKER_AVAILABLE()
+    REG_READ(meter_input_regs_t, energy_this_charge, RegType::F32, "meter", conv_energy_this_charge,
+             "meter/values/energy_abs", "charge_tracker/current_charge/meter_start", "charge_tracker/current_charge/user_id"),
+#endif
+    REG_BIT_CONST(discrete_inputs_t, 1, "meter", 1),
+
+    REG_BIT(meter_discrete_inputs_t, 0, "meter_phases", conv_bool, "meter/phases/phases_connected/0"),
+    REG_BIT(meter_discrete_inputs_t, 1, "meter_phases", conv_bool, "meter/phases/phases_connected/1"),
+    REG_BIT(meter_discrete_inputs_t, 2, "meter_phases", conv_bool, "meter/phases/phases_connected/2"),
+    REG_BIT(meter_discrete_inputs_t, 3, "meter_phases", conv_bool, "meter/phases/phases_active/0"),
+    REG_BIT(meter_discrete_inputs_t, 4, "meter_phases", conv_bool, "meter/phases/phases_active/1"),
+    REG_BIT(meter_discrete_inputs_t, 5, "meter_phases", conv_bool, "meter/phases/phases_active/2"),
+    REG_BIT_CONST(discrete_inputs_t, 2, "meter_phases", 1),
+
+    REG_READ_ARRAY(meter_all_values_input_regs_t, meter_values, RegType::F32, METER_ALL_VALUES_COUNT, 0, "meter_all_values", conv_float, "meter/all_values/#"),
+    REG_BIT_CONST(discrete_inputs_t, 3, "meter_all_values", 1),
+};
+
+static constexpr reg_write_entry_t warp_writes[] = {
+    REG_WRITE(holding_regs_t, reboot, RegType::U32, 1, "reboot", nullptr, handle_reboot),
+    REG_WRITE_INIT(evse_holding_regs_t, allowed_current, RegType::U32, "allowed current", "evse", handle_current,
+                   conv_uint, "evse/slots/" REG_STR(CHARGING_SLOT_MODBUS_TCP) "/max_current"),
+    REG_WRITE_INIT(evse_holding_regs_t, enable_charging, RegType::U32, "enable charging", "evse", handle_enable,
+                   conv_slot_enabled, "evse/slots/" REG_STR(CHARGING_SLOT_MODBUS_TCP_ENABLE) "/max_current"),
+    REG_WRITE(meter_holding_regs_t, trigger_reset, RegType::U32, 1, "meter reset", nullptr, handle_meter_reset),
+};
+
+static constexpr reg_area_t bender_areas[] = {
+    REG_AREA(bender_general_s),
+    REG_AREA(bender_phases_s),
+    REG_AREA(bender_dlm_s),
+    REG_AREA(bender_charge_s),
+    REG_AREA(bender_hems_s),
+    REG_AREA(bender_write_uid_s),
+};
 
+// The error code registers are not supported and stay 0.
+static constexpr reg_map_entry_t bender_reads[] = {
+    REG_CONST(bender_general_s, device_id, RegType::U16, 0xEBEE),
+    REG_CHARS(bender_general_s, firmware_version, ".404"),
+    REG_CHARS(bender_general_s, protocol_version, "0\0006."),
+
+    REG_READ(bender_general_s, ocpp_cp_state, RegType::U16, "evse", conv_bender_cp_state, "evse/state/charger_state"),
+    REG_READ(bender_general_s, vehicle_state, RegType::U16, "evse", conv_bender_vehicle_state, "evse/state/iec61851_state"),
+    REG_READ(bender_general_s, vehicle_state_hex, RegType::U16, "evse", conv_bender_vehicle_state_hex, "evse/state/iec61851_state"),
+    REG_READ(bender_general_s, hardware_curr_limit, RegType::U16, "evse", conv_uint_div1000, "evse/slots/" REG_STR(CHARGING_SLOT_OUTGOING_CABLE) "/max_current"),
+    REG_READ(bender_charge_s, current_signaled, RegType::U16, "evse", conv_uint_div1000, "evse/state/allowed_charging_current"),
 #if MODULE_CHARGE_TRACKER_AVAILABLE()
-        auto meter_absolute = api.getState("meter/values")->get("energy_abs")->asFloat();
-        auto meter_start = api.getState("charge_tracker/current_charge")->get("meter_start")->asFloat();
+    REG_READ(bender_charge_s, charge_duration, RegType::U16, "evse", conv_charge_duration_s,
+             "evse/low_level_state/uptime", "charge_tracker/current_charge/evse_uptime_start", "charge_tracker/current_charge/user_id"),
+    REG_READ(bender_charge_s, charge_duration_new, RegType::U32, "evse", conv_charge_duration_s,
+             "evse/low_level_state/uptime", "charge_tracker/current_charge/evse_uptime_start", "charge_tracker/current_charge/user_id"),
+    REG_READ(bender_charge_s, wh_charged, RegType::U16, "meter", conv_charged_energy_wh,
+             "meter/values/energy_abs", "charge_tracker/current_charge/meter_start", "charge_tracker/current_charge/user_id"),
+    REG_READ(bender_charge_s, charged_energy, RegType::U32, "meter", conv_charged_energy_wh,
+             "meter/values/energy_abs", "charge_tracker/current_charge/meter_start", "charge_tracker/current_charge/user_id"),
+#endif
 
-        if (!charging)
-            keba_read_charge->charged_energy = fromUint(0);
-        else if (isnan(meter_start))
-            keba_read_charge->charged_energy = fromUint(0);
-        else
-            keba_read_charge->charged_energy = fromUint((uint32_t)((meter_absolute - meter_start) * 1000));
+    REG_READ_ARRAY(bender_phases_s, current, RegType::U32, 3, METER_ALL_VALUES_CURRENT_L1_A, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+    REG_READ_ARRAY(bender_phases_s, energy, RegType::U32, 3, METER_ALL_VALUES_IMPORT_KWH_L1, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+    REG_READ_ARRAY(bender_phases_s, power, RegType::U32, 3, METER_ALL_VALUES_POWER_L1_W, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+    REG_READ_ARRAY(bender_phases_s, voltage, RegType::U32, 3, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L1, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+    REG_READ_ARRAY(bender_phases_s, total_energy, RegType::U32, 1, METER_ALL_VALUES_TOTAL_IMPORT_KWH, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+    REG_READ_ARRAY(bender_phases_s, total_power, RegType::U32, 1, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_W, "meter_all_values", conv_float_to_uint, "meter/all_values/#"),
+};
 
-        if (api.getState("charge_tracker/current_charge")->get("authorization_type")->asUint() == 2)
-        {
-            const auto &tag_id = api.getState("charge_tracker/current_charge")->get("authorization_info")->get("tag_id")->asString();
-            keba_read_charge_cpy->rfid_tag = fromUint(export_tag_id_as_uint32(tag_id));
-        }
+static constexpr reg_write_entry_t bender_writes[] = {
+    REG_WRITE_INIT(bender_hems_s, hems_limit, RegType::U16, "hems limit", "evse", handle_current_ampere,
+                   conv_uint_div1000, "evse/slots/" REG_STR(CHARGING_SLOT_MODBUS_TCP) "/max_current"),
+    REG_WRITE_INIT(bender_general_s, chargepoint_available, RegType::U16, "chargepoint available", "evse", nullptr,
+                   conv_slot_enabled, "evse/slots/" REG_STR(CHARGING_SLOT_MODBUS_TCP_ENABLE) "/max_current"),
+    REG_WRITE(bender_write_uid_s, user_id, RegType::U32, 5, "userid", nullptr, reject_write),
+    REG_WRITE(bender_general_s, comm_timeout, RegType::U16, 1, "communication timeout", nullptr, reject_write),
+    REG_WRITE(bender_general_s, safe_current, RegType::U16, 1, "safe current", nullptr, reject_write),
+    REG_WRITE(bender_dlm_s, operator_evse_limit, RegType::U16, 3, "dlm operator current", nullptr, reject_write),
+};
+
+static constexpr reg_area_t keba_areas[] = {
+    REG_AREA(keba_read_charge_s),
+    REG_AREA(keba_read_general_s),
+    REG_AREA(keba_read_max_s),
+    REG_AREA(keba_write_s),
+};
+
+static constexpr reg_map_entry_t keba_reads[] = {
+    REG_CONST(keba_read_general_s, firmware_version, RegType::U32, 0x30A1B00),
+    REG_READ(keba_read_general_s, features, RegType::U32, "evse", conv_keba_features, "evse/hardware_configuration/jumper_configuration"),
+
+    REG_READ(keba_read_general_s, charging_state, RegType::U32, "evse", conv_keba_charging_state, "evse/state/iec61851_state"),
+    REG_READ(keba_read_general_s, cable_state, RegType::U32, "evse", conv_keba_cable_state, "evse/state/charger_state"),
+    REG_READ(keba_read_max_s, max_current, RegType::U32, "evse", conv_uint, "evse/state/allowed_charging_current"),
+    REG_READ(keba_read_max_s, max_hardware_current, RegType::U32, "evse", conv_uint, "evse/slots/" REG_STR(CHARGING_SLOT_INCOMING_CABLE) "/max_current"),
+
+    REG_READ(keba_read_general_s, power, RegType::U32, "meter", conv_float_to_uint_milli, "meter/values/power"),
+    REG_READ(keba_read_general_s, total_energy, RegType::U32, "meter", conv_float_to_uint_milli, "meter/values/energy_abs"),
+#if MODULE_CHARGE_TRACKER_AVAILABLE()
+    REG_READ(keba_read_charge_s, charged_energy, RegType::U32, "meter", conv_charged_energy_wh,
+             "meter/values/energy_abs", "charge_tracker/current_charge/meter_start", "charge_tracker/current_charge/user_id"),
+    REG_READ(keba_read_charge_s, rfid_tag, RegType::U32, "meter", conv_keba_rfid_tag,
+             "charge_tracker/current_charge/authorization_type", "charge_tracker/current_charge/authorization_info"),
 #endif
 
-        if (api.hasFeature("meter_all_values"))
-        {
-            auto meter_all_values = api.getState("meter/all_values");
-            for (int i = 0; i < 3; i++)
-            {
-                keba_read_general_cpy->currents[i] = fromUint(meter_all_values->get(i + METER_ALL_VALUES_CURRENT_L1_A)->asFloat() * 1000);
-                keba_read_general_cpy->voltages[i] = fromUint(meter_all_values->get(i)->asFloat());
-            }
-            keba_read_general_cpy->power_factor = fromUint(meter_all_values->get(METER_ALL_VALUES_TOTAL_SYSTEM_POWER_FACTOR)->asFloat() * 1000);
+    REG_READ_ARRAY(keba_read_general_s, currents, RegType::U32, 3, METER_ALL_VALUES_CURRENT_L1_A, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+    REG_READ_ARRAY(keba_read_general_s, voltages, RegType::U32, 3, METER_ALL_VALUES_LINE_TO_NEUTRAL_VOLTS_L1, "meter_all_values", conv_float_to_uint, "meter/all_values/#"),
+    REG_READ_ARRAY(keba_read_general_s, power_factor, RegType::U32, 1, METER_ALL_VALUES_TOTAL_SYSTEM_POWER_FACTOR, "meter_all_values", conv_float_to_uint_milli, "meter/all_values/#"),
+};
+
+static constexpr reg_write_entry_t keba_writes[] = {
+    REG_WRITE_INIT(keba_write_s, set_charging_current, RegType::U16, "charging current", "evse", handle_current,
+                   conv_uint_div1000, "evse/slots/" REG_STR(CHARGING_SLOT_MODBUS_TCP) "/max_current"),
+    REG_WRITE_INIT(keba_write_s, enable_station, RegType::U16, "enable station", "evse", handle_enable_station,
+                   conv_slot_enabled, "evse/slots/" REG_STR(CHARGING_SLOT_MODBUS_TCP_ENABLE) "/max_current"),
+};
+
+// Indexed by the "table" config value.
+static constexpr reg_profile_t profiles[] = {
+    REG_PROFILE(warp_areas, warp_reads, warp_writes),
+    REG_PROFILE(bender_areas, bender_reads, bender_writes),
+    REG_PROFILE(keba_areas, keba_reads, keba_writes),
+};
+
+static RegisterMap register_map;
+static ModbusServer server;
+
+ModbusTcp::ModbusTcp() {}
+
+void ModbusTcp::pre_setup()
+{
+    config = Config::Object({
+        {"enable", Config::Bool(false)},
+        {"port", Config::Uint16(502)},
+        {"table", Config::Uint16(0)},
+    });
+}
+
+void ModbusTcp::setup()
+{
+    api.restorePersistentConfig("modbus_tcp/config", &config);
+
+    if (config.get("enable")->asBool() == true)
+    {
+        uint32_t table = config.get("table")->asUint();
+        if (table < ARRAY_SIZE(profiles)) {
+            register_map.setup(&profiles[table]);
+            server.start(config.get("port")->asUint(), &register_map);
         }
-        keba_read_general_cpy->power = fromUint(api.getState("meter/values")->get("power")->asFloat() * 1000);
-        keba_read_general_cpy->total_energy = fromUint(api.getState("meter/values")->get("energy_abs")->asFloat() * 1000);
     }
-#endif
 
-    portENTER_CRITICAL(&mtx);
-        *keba_read_charge = *keba_read_charge_cpy;
-        *keba_read_general = *keba_read_general_cpy;
-        *keba_read_max = *keba_read_max_cpy;
-    portEXIT_CRITICAL(&mtx);
+    initialized = true;
 }
 
 void ModbusTcp::register_urls()
@@ -903,67 +813,9 @@ void ModbusTcp::register_urls()
 
     if (config.get("enable")->asBool() == true)
     {
-        spinlock_initialize(&mtx);
-
-        if (config.get("table")->asUint() == 0)
-        {
-
-            uint16_t allowed_current = 32000;
-            uint8_t enable_charging = 1;
-
-    #if MODULE_EVSE_V2_AVAILABLE() || MODULE_EVSE_AVAILABLE()
-            if (api.hasFeature("evse"))
-            {
-                auto slots = api.getState("evse/slots");
-                allowed_current = slots->get(CHARGING_SLOT_MODBUS_TCP)->get("max_current")->asUint();
-                enable_charging = slots->get(CHARGING_SLOT_MODBUS_TCP_ENABLE)->get("max_current")->asUint() == 32000;
-            }
-    #endif
-
-            portENTER_CRITICAL(&mtx);
-                input_regs->table_version = fromUint(MODBUS_TABLE_VERSION);
-                input_regs->box_id = fromUint(local_uid_num);
-                input_regs->firmware_major = fromUint(BUILD_VERSION_MAJOR);
-                input_regs->firmware_minor = fromUint(BUILD_VERSION_MINOR);
-                input_regs->firmware_patch = fromUint(BUILD_VERSION_PATCH);
-                input_regs->firmware_build_ts = fromUint(build_timestamp());
-
-                evse_holding_regs->allowed_current = fromUint(allowed_current);
-                evse_holding_regs->enable_charging = fromUint(enable_charging);
-            portEXIT_CRITICAL(&mtx);
-
-            task_scheduler.scheduleWithFixedDelay([this]() {
-                this->update_regs();
-            }, 0, 500);
-        }
-        else if (config.get("table")->asUint() == 1)
-        {
-            if (api.hasFeature("evse"))
-            {
-#if MODULE_EVSE_V2_AVAILABLE() || MODULE_EVSE_AVAILABLE()
-                portENTER_CRITICAL(&mtx);
-                    bender_hems->hems_limit = api.getState("evse/slots")->get(CHARGING_SLOT_MODBUS_TCP)->get("max_current")->asUint() / 1000;
-                    bender_general->chargepoint_available = api.getState("evse/slots")->get(CHARGING_SLOT_MODBUS_TCP_ENABLE)->get("max_current")->asUint() == 32000 ? 1 : 0;
-                portEXIT_CRITICAL(&mtx);
-#endif
-            }
-
-            task_scheduler.scheduleWithFixedDelay([this]() {
-                this->update_bender_regs();
-            }, 0, 500);
-        }
-        else if (config.get("table")->asUint() == 2)
-        {
-#if MODULE_EVSE_V2_AVAILABLE() || MODULE_EVSE_AVAILABLE()
-                portENTER_CRITICAL(&mtx);
-                    keba_write->set_charging_current = api.getState("evse/slots")->get(CHARGING_SLOT_MODBUS_TCP)->get("max_current")->asUint() / 1000;
-                    keba_write->enable_station = api.getState("evse/slots")->get(CHARGING_SLOT_MODBUS_TCP_ENABLE)->get("max_current")->asUint() == 32000 ? 1 : 0;
-                portEXIT_CRITICAL(&mtx);
-#endif
-            task_scheduler.scheduleWithFixedDelay([this]() {
-                this->update_keba_regs();
-            }, 0, 500);
-        }
+        task_scheduler.scheduleWithFixedDelay([]() {
+            register_map.update();
+        }, 0, 500);
     }
 }
 
@@ -19,12 +19,6 @@
 
 #pragma once
 
-template<typename T>
-    void calloc_struct(T **out)
-    {
-        *out = (T *)calloc(1, sizeof(T));
-    }
-
 class ModbusTcp
 {
 public:
@@ -33,9 +27,6 @@ public:
     void setup();
     void register_urls();
     void loop();
-    void update_regs();
-    void update_bender_regs();
-    void update_keba_regs();
 
     bool initialized = false;
 
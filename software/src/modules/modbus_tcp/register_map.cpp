@@ -0,0 +1,426 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Frederic Henrichs <frederic@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "register_map.h"
+
+#include <Arduino.h>
+
+#include "api.h"
+#include "event_log.h"
+
+extern API api;
+extern EventLog logger;
+
+static uint8_t reg_width(RegType type)
+{
+    return (type == RegType::U32 || type == RegType::F32) ? 2 : 1;
+}
+
+static bool is_bit_area(mb_param_type_t type)
+{
+    return type == MB_PARAM_DISCRETE || type == MB_PARAM_COIL;
+}
+
+void RegisterMap::setup(const reg_profile_t *profile_in)
+{
+    profile = profile_in;
+    spinlock_initialize(&write_mtx);
+
+    for (size_t i = 0; i < profile->area_count; ++i) {
+        const reg_area_t *area = &profile->areas[i];
+        areas.push_back({area, image_size});
+        // Keep the registers of every area 2 byte aligned.
+        image_size += (area->size + 1) & ~1u;
+    }
+
+    work = (uint8_t *)calloc(1, image_size);
+    images[0] = (uint8_t *)calloc(1, image_size);
+    images[1] = (uint8_t *)calloc(1, image_size);
+    writable = (uint8_t *)calloc(1, image_size / 2);
+
+    pending_writes.reserve(REG_MAP_MAX_PENDING_WRITES);
+
+    read_bound.resize(profile->read_count, false);
+    write_bound.resize(profile->write_count, false);
+    pending = profile->read_count + profile->write_count;
+}
+
+int RegisterMap::find_range(mb_param_type_t type, uint16_t address, uint16_t count, uint8_t *first_bit)
+{
+    for (const area_buf_t &area_buf : areas) {
+        const reg_area_t *area = area_buf.area;
+        if (area->type != type || address < area->offset)
+            continue;
+
+        size_t idx = address - area->offset;
+
+        if (is_bit_area(type)) {
+            if (idx + count > area->size * 8u)
+                continue;
+            *first_bit = idx % 8;
+            return area_buf.image_offset + idx / 8;
+        }
+
+        if ((idx + count) * 2 > area->size)
+            continue;
+        *first_bit = 0;
+        return area_buf.image_offset + idx * 2;
+    }
+
+    return -1;
+}
+
+uint8_t *RegisterMap::locate(mb_param_type_t type, uint16_t address, uint8_t *bit)
+{
+    int offset = find_range(type, address, 1, bit);
+    if (offset < 0)
+        return nullptr;
+    return work + offset;
+}
+
+const uint8_t *RegisterMap::acquire_image()
+{
+    if (images[0] == nullptr)
+        return nullptr;
+
+    // Announce which image is read, then make sure it is still the published one.
+    // Otherwise the update task could already be rewriting it.
+    uint8_t idx;
+    do {
+        idx = front.load();
+        reading.store(idx);
+    } while (front.load() != idx);
+
+    return images[idx];
+}
+
+void RegisterMap::release_image()
+{
+    reading.store(-1);
+}
+
+bool RegisterMap::is_writable(uint16_t address, uint16_t count)
+{
+    uint8_t bit;
+    int offset = find_range(MB_PARAM_HOLDING, address, count, &bit);
+    if (offset < 0)
+        return false;
+
+    for (uint16_t i = 0; i < count; ++i)
+        if (!writable[offset / 2 + i])
+            return false;
+
+    return true;
+}
+
+bool RegisterMap::queue_write(uint16_t address, const uint8_t *values, uint16_t count)
+{
+    if (!is_writable(address, count))
+        return false;
+
+    uint8_t bit;
+    int offset = find_range(MB_PARAM_HOLDING, address, count, &bit);
+
+    bool queued = false;
+
+    // The update task only flips the published image while holding write_mtx
+    // and patches the writes that are still queued into the new image first.
+    // Patching the published image in the same critical section thus makes
+    // the write visible to the next read of the client, whichever image it is.
+    portENTER_CRITICAL(&write_mtx);
+        if (pending_writes.size() + count <= REG_MAP_MAX_PENDING_WRITES) {
+            uint16_t *words = (uint16_t *)(images[front.load()] + offset);
+
+            for (uint16_t i = 0; i < count; ++i) {
+                uint16_t value = (values[i * 2] << 8) | values[i * 2 + 1];
+                pending_writes.push_back({(uint16_t)(offset + i * 2), value});
+                words[i] = value;
+            }
+            queued = true;
+        }
+    portEXIT_CRITICAL(&write_mtx);
+
+    return queued;
+}
+
+void RegisterMap::apply_pending_writes()
+{
+    portENTER_CRITICAL(&write_mtx);
+        for (const pending_write_t &write : pending_writes)
+            *(uint16_t *)(work + write.image_offset) = write.value;
+
+        if (!pending_writes.empty())
+            dirty = true;
+
+        pending_writes.clear();
+    portEXIT_CRITICAL(&write_mtx);
+}
+
+void RegisterMap::publish()
+{
+    uint8_t back = 1 - front.load();
+
+    // The server holds an image only for the duration of one request.
+    while (reading.load() == back)
+        vTaskDelay(1);
+
+    memcpy(images[back], work, image_size);
+
+    // Writes queued since apply_pending_writes are not part of the working copy yet.
+    portENTER_CRITICAL(&write_mtx);
+        for (const pending_write_t &write : pending_writes)
+            *(uint16_t *)(images[back] + write.image_offset) = write.value;
+
+        front.store(back);
+    portEXIT_CRITICAL(&write_mtx);
+
+    dirty = false;
+}
+
+const Config *RegisterMap::resolve_source(const char *src, uint8_t index)
+{
+    String path = src;
+    path.replace("#", String(index));
+
+    // The state path itself contains slashes: Find the longest registered
+    // state that is a prefix of the path, then walk the rest of it.
+    int sep = path.length();
+    Config *conf = nullptr;
+    while (sep > 0) {
+        conf = api.getState(path.substring(0, sep), false);
+        if (conf != nullptr)
+            break;
+        sep = path.lastIndexOf('/', sep - 1);
+    }
+
+    if (conf == nullptr)
+        return nullptr;
+
+    while (sep < (int)path.length()) {
+        int start = sep + 1;
+        sep = path.indexOf('/', start);
+        if (sep < 0)
+            sep = path.length();
+
+        String key = path.substring(start, sep);
+
+        if (conf->is<Config::ConfArray>()) {
+            int i = key.toInt();
+            if (i < 0 || i >= conf->count())
+                return nullptr;
+            conf = (Config *)conf->get(i);
+        } else {
+            conf = (Config *)conf->get(key);
+        }
+
+        if (conf == nullptr)
+            return nullptr;
+    }
+
+    return conf;
+}
+
+bool RegisterMap::feature_available(const char *feature)
+{
+    return feature == nullptr || api.hasFeature(feature);
+}
+
+uint32_t RegisterMap::read_raw(const uint8_t *target, RegType type, WordOrder order, uint8_t bit)
+{
+    // Registers are only 2 byte aligned inside the areas, so 32 bit values are accessed word by word.
+    const uint16_t *words = (const uint16_t *)target;
+
+    switch (type) {
+        case RegType::BIT:
+            return (*target >> bit) & 1;
+        case RegType::U16:
+            return words[0];
+        case RegType::U32:
+        case RegType::F32:
+            if (order == WordOrder::HIGH_WORD_FIRST)
+                return ((uint32_t)words[0] << 16) | words[1];
+            return ((uint32_t)words[1] << 16) | words[0];
+    }
+
+    return 0;
+}
+
+void RegisterMap::write_raw(uint8_t *target, RegType type, WordOrder order, uint8_t bit, uint32_t value)
+{
+    uint16_t *words = (uint16_t *)target;
+
+    switch (type) {
+        case RegType::BIT:
+            if (value)
+                *target |= 1 << bit;
+            else
+                *target &= ~(1 << bit);
+            break;
+        case RegType::U16:
+            words[0] = value;
+            break;
+        case RegType::U32:
+        case RegType::F32:
+            if (order == WordOrder::HIGH_WORD_FIRST) {
+                words[0] = value >> 16;
+                words[1] = value & 0xFFFF;
+            } else {
+                words[0] = value & 0xFFFF;
+                words[1] = value >> 16;
+            }
+            break;
+    }
+}
+
+bool RegisterMap::bind_read(const reg_map_entry_t *entry)
+{
+    size_t first = bindings.size();
+
+    for (uint8_t i = 0; i < entry->count; ++i) {
+        binding_t binding = {};
+        binding.entry = entry;
+        binding.target = locate(entry->area, entry->address + i * reg_width(entry->type), &binding.bit);
+
+        if (binding.target == nullptr) {
+            logger.printfln("Modbus register %u is not part of any register area", entry->address + i * reg_width(entry->type));
+            bindings.resize(first);
+            // Nothing to retry; drop the entry.
+            return true;
+        }
+
+        for (size_t s = 0; s < REG_MAP_MAX_SOURCES && entry->src[s] != nullptr; ++s) {
+            binding.src[s] = resolve_source(entry->src[s], entry->index_base + i);
+
+            // Not there yet, for example the meter values are added after the meter is detected.
+            if (binding.src[s] == nullptr) {
+                bindings.resize(first);
+                return false;
+            }
+        }
+
+        bindings.push_back(binding);
+    }
+
+    for (size_t i = first; i < bindings.size(); ++i) {
+        binding_t &binding = bindings[i];
+        binding.last_value = entry->convert == nullptr ? entry->constant : entry->convert(binding.src);
+
+        write_raw(binding.target, entry->type, entry->order, binding.bit, binding.last_value);
+        dirty = true;
+    }
+
+    // Constants never change, so there is no need to look at them again.
+    if (entry->convert == nullptr)
+        bindings.resize(first);
+
+    return true;
+}
+
+bool RegisterMap::bind_write(const reg_write_entry_t *entry)
+{
+    const Config *src[REG_MAP_MAX_SOURCES] = {};
+
+    for (size_t s = 0; s < REG_MAP_MAX_SOURCES && entry->src[s] != nullptr; ++s) {
+        src[s] = resolve_source(entry->src[s], 0);
+        if (src[s] == nullptr)
+            return false;
+    }
+
+    for (uint8_t i = 0; i < entry->count; ++i) {
+        uint8_t bit;
+        uint8_t *target = locate(entry->area, entry->address + i * reg_width(entry->type), &bit);
+
+        if (target == nullptr) {
+            logger.printfln("Modbus register %u is not part of any register area", entry->address + i * reg_width(entry->type));
+            return true;
+        }
+
+        if (!is_bit_area(entry->area))
+            for (uint8_t w = 0; w < reg_width(entry->type); ++w)
+                writable[(target - work) / 2 + w] = 1;
+
+        if (entry->initial != nullptr) {
+            uint32_t value = entry->initial(src);
+
+            write_raw(target, entry->type, entry->order, 0, value);
+            dirty = true;
+        }
+
+        // Entries without handler only provide the initial value.
+        if (entry->handler != nullptr)
+            write_bindings.push_back({target, entry});
+    }
+
+    return true;
+}
+
+void RegisterMap::update()
+{
+    if (profile == nullptr)
+        return;
+
+    if (pending > 0) {
+        for (size_t i = 0; i < profile->read_count; ++i) {
+            if (read_bound[i] || !feature_available(profile->reads[i].feature))
+                continue;
+
+            if (bind_read(&profile->reads[i])) {
+                read_bound[i] = true;
+                --pending;
+            }
+        }
+
+        for (size_t i = 0; i < profile->write_count; ++i) {
+            if (write_bound[i] || !feature_available(profile->writes[i].feature))
+                continue;
+
+            if (bind_write(&profile->writes[i])) {
+                write_bound[i] = true;
+                --pending;
+            }
+        }
+    }
+
+    apply_pending_writes();
+
+    for (const write_binding_t &binding : write_bindings) {
+        const reg_write_entry_t *entry = binding.entry;
+        uint32_t value = read_raw(binding.target, entry->type, entry->order, 0);
+
+        if (entry->handler(*entry, value)) {
+            write_raw(binding.target, entry->type, entry->order, 0, 0);
+            dirty = true;
+        }
+    }
+
+    for (binding_t &binding : bindings) {
+        const reg_map_entry_t *entry = binding.entry;
+        uint32_t value = entry->convert(binding.src);
+
+        if (value == binding.last_value)
+            continue;
+
+        binding.last_value = value;
+        write_raw(binding.target, entry->type, entry->order, binding.bit, value);
+        dirty = true;
+    }
+
+    if (dirty)
+        publish();
+}
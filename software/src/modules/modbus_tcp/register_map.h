@@ -0,0 +1,240 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Frederic Henrichs <frederic@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "esp_modbus_common.h"
+#include "freertos/FreeRTOS.h"
+
+#include "config.h"
+
+// A register map describes a Modbus register table as data:
+// - areas: the register blocks that are part of the image served to the clients
+// - reads: registers that mirror config leaves (or constants) to the clients
+// - writes: registers the clients write, passed to a handler on every update
+//
+// Sources are state paths with an optional path into the state,
+// for example "evse/slots/#/max_current". For entries with a count > 1,
+// '#' is replaced by index_base + the element index.
+
+#define REG_MAP_MAX_SOURCES 3
+
+enum class RegType : uint8_t {
+    U16,
+    U32,
+    F32,
+    BIT,
+};
+
+enum class WordOrder : uint8_t {
+    HIGH_WORD_FIRST,
+    LOW_WORD_FIRST,
+};
+
+// Converters get the resolved sources of an entry and return the raw register value.
+// F32 registers expect the IEEE 754 bits of the float.
+typedef uint32_t (*reg_converter_t)(const Config *const *src);
+
+struct reg_write_entry_t;
+
+// Returns true if the register should be cleared after the value was handled.
+typedef bool (*reg_write_handler_t)(const reg_write_entry_t &entry, uint32_t value);
+
+struct reg_area_t {
+    mb_param_type_t type;
+    uint16_t offset;
+    uint16_t size;
+};
+
+struct reg_map_entry_t {
+    mb_param_type_t area;
+    uint16_t address;
+    RegType type;
+    WordOrder order;
+    uint8_t count;
+    uint8_t index_base;
+    const char *feature;
+    reg_converter_t convert;
+    uint32_t constant;
+    const char *src[REG_MAP_MAX_SOURCES];
+};
+
+struct reg_write_entry_t {
+    mb_param_type_t area;
+    uint16_t address;
+    RegType type;
+    WordOrder order;
+    uint8_t count;
+    const char *name;
+    const char *feature;
+    reg_write_handler_t handler;
+    reg_converter_t initial;
+    const char *src[REG_MAP_MAX_SOURCES];
+};
+
+struct reg_profile_t {
+    const reg_area_t *areas;
+    size_t area_count;
+    const reg_map_entry_t *reads;
+    size_t read_count;
+    const reg_write_entry_t *writes;
+    size_t write_count;
+};
+
+static constexpr uint32_t reg_chars(const char *s)
+{
+    return (uint32_t)(uint8_t)s[0] | (uint32_t)(uint8_t)s[1] << 8 | (uint32_t)(uint8_t)s[2] << 16 | (uint32_t)(uint8_t)s[3] << 24;
+}
+
+#define REG_STR_(x) #x
+#define REG_STR(x) REG_STR_(x)
+
+#define REG_ADDRESS(area_t, field) ((uint16_t)(area_t::OFFSET + offsetof(area_t, field) / 2))
+
+#define REG_AREA(area_t) {area_t::TYPE, (uint16_t)area_t::OFFSET, (uint16_t)sizeof(area_t)}
+
+#define REG_CONST(area_t, field, type, value) \
+    {area_t::TYPE, REG_ADDRESS(area_t, field), type, WordOrder::HIGH_WORD_FIRST, 1, 0, nullptr, nullptr, value, {}}
+
+// Four characters, stored in memory order.
+#define REG_CHARS(area_t, field, str) \
+    {area_t::TYPE, REG_ADDRESS(area_t, field), RegType::U32, WordOrder::LOW_WORD_FIRST, 1, 0, nullptr, nullptr, reg_chars(str), {}}
+
+#define REG_READ(area_t, field, type, feature, convert, ...) \
+    {area_t::TYPE, REG_ADDRESS(area_t, field), type, WordOrder::HIGH_WORD_FIRST, 1, 0, feature, convert, 0, {__VA_ARGS__}}
+
+#define REG_READ_ARRAY(area_t, field, type, count, index_base, feature, convert, ...) \
+    {area_t::TYPE, REG_ADDRESS(area_t, field), type, WordOrder::HIGH_WORD_FIRST, count, index_base, feature, convert, 0, {__VA_ARGS__}}
+
+#define REG_BIT(area_t, bit, feature, convert, ...) \
+    {area_t::TYPE, (uint16_t)(area_t::OFFSET + bit), RegType::BIT, WordOrder::HIGH_WORD_FIRST, 1, 0, feature, convert, 0, {__VA_ARGS__}}
+
+#define REG_BIT_CONST(area_t, bit, feature, value) \
+    {area_t::TYPE, (uint16_t)(area_t::OFFSET + bit), RegType::BIT, WordOrder::HIGH_WORD_FIRST, 1, 0, feature, nullptr, value, {}}
+
+#define REG_WRITE(area_t, field, type, count, name, feature, handler) \
+    {area_t::TYPE, REG_ADDRESS(area_t, field), type, WordOrder::HIGH_WORD_FIRST, count, name, feature, handler, nullptr, {}}
+
+#define REG_WRITE_INIT(area_t, field, type, name, feature, handler, initial, ...) \
+    {area_t::TYPE, REG_ADDRESS(area_t, field), type, WordOrder::HIGH_WORD_FIRST, 1, name, feature, handler, initial, {__VA_ARGS__}}
+
+#define REG_PROFILE(areas, reads, writes) \
+    {areas, sizeof(areas) / sizeof(areas[0]), reads, sizeof(reads) / sizeof(reads[0]), writes, sizeof(writes) / sizeof(writes[0])}
+
+#define REG_MAP_MAX_PENDING_WRITES 128
+
+// Owns the register image. The update task works on a private copy and
+// publishes it by swapping between two image buffers, so the server task
+// can answer reads without taking a lock. There must be only one reader
+// (the Modbus TCP server task).
+class RegisterMap
+{
+public:
+    RegisterMap() {}
+
+    // Allocates the image for the areas of the profile.
+    void setup(const reg_profile_t *profile);
+
+    // Binds entries whose feature became available, applies client writes,
+    // passes written registers to their handlers, mirrors changed read
+    // registers and publishes a new image if anything changed.
+    void update();
+
+    static const Config *resolve_source(const char *src, uint8_t index);
+
+    // Reader side. The image returned by acquire_image stays valid until release_image.
+    const uint8_t *acquire_image();
+    void release_image();
+
+    // Returns the byte offset of the first register (or of the byte containing the first bit)
+    // of [address, address + count) in the image, or -1 if the range is not inside one area.
+    // For bit areas, *first_bit is set to the position of address in that byte.
+    int find_range(mb_param_type_t type, uint16_t address, uint16_t count, uint8_t *first_bit);
+
+    // True if every register of [address, address + count) belongs to a bound write entry.
+    // All other holding registers mirror data and are read-only for the clients.
+    bool is_writable(uint16_t address, uint16_t count);
+
+    // Queues client writes to holding registers. values are big endian as on the wire.
+    // The written registers are patched into the published image immediately and
+    // applied to the working copy on the next update. A read following the write
+    // returns the written values until the next update changes them.
+    // Returns false if the range is not writable or too many writes are pending.
+    bool queue_write(uint16_t address, const uint8_t *values, uint16_t count);
+
+private:
+    struct area_buf_t {
+        const reg_area_t *area;
+        size_t image_offset;
+    };
+
+    struct binding_t {
+        uint8_t *target;
+        const reg_map_entry_t *entry;
+        uint8_t bit;
+        uint32_t last_value;
+        const Config *src[REG_MAP_MAX_SOURCES];
+    };
+
+    struct write_binding_t {
+        uint8_t *target;
+        const reg_write_entry_t *entry;
+    };
+
+    struct pending_write_t {
+        uint16_t image_offset;
+        uint16_t value;
+    };
+
+    uint8_t *locate(mb_param_type_t type, uint16_t address, uint8_t *bit);
+    bool feature_available(const char *feature);
+    bool bind_read(const reg_map_entry_t *entry);
+    bool bind_write(const reg_write_entry_t *entry);
+    void apply_pending_writes();
+    void publish();
+
+    uint32_t read_raw(const uint8_t *target, RegType type, WordOrder order, uint8_t bit);
+    void write_raw(uint8_t *target, RegType type, WordOrder order, uint8_t bit, uint32_t value);
+
+    const reg_profile_t *profile = nullptr;
+    std::vector<area_buf_t> areas;
+    std::vector<binding_t> bindings;
+    std::vector<write_binding_t> write_bindings;
+    std::vector<bool> read_bound;
+    std::vector<bool> write_bound;
+    // One flag per register of the image, set for registers of bound write entries.
+    // Set by the update task and read by the server task: plain bytes, no vector<bool>.
+    uint8_t *writable = nullptr;
+    size_t pending = 0;
+
+    size_t image_size = 0;
+    uint8_t *work = nullptr;
+    uint8_t *images[2] = {nullptr, nullptr};
+    std::atomic<uint8_t> front{0};
+    std::atomic<int8_t> reading{-1};
+    bool dirty = false;
+
+    std::vector<pending_write_t> pending_writes;
+    portMUX_TYPE write_mtx;
+};
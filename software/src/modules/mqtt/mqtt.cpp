@@ -21,6 +21,8 @@
 
 #include <Arduino.h>
 
+#include <algorithm>
+
 #include "task_scheduler.h"
 #include "tools.h"
 #include "api.h"
@@ -34,7 +36,10 @@ extern TaskScheduler task_scheduler;
 extern char local_uid_str[32];
 extern API api;
 
-#if MODULE_ESP32_ETHERNET_BRICK_AVAILABLE()
+#if MODULE_ESP32_ETHERNET_BRICK_AVAILABLE() && MODULE_CHARGE_MANAGER_AVAILABLE()
+// Fits a charge_manager/config with 64 chargers (about 7.5 KB) within the headroom, see MAX_CLIENTS.
+#define MQTT_RECV_BUFFER_SIZE 10240
+#elif MODULE_ESP32_ETHERNET_BRICK_AVAILABLE()
 #define MQTT_RECV_BUFFER_SIZE 4096
 #else
 #define MQTT_RECV_BUFFER_SIZE 2048
@@ -42,6 +47,12 @@ extern API api;
 
 #define MQTT_RECV_BUFFER_HEADROOM (MQTT_RECV_BUFFER_SIZE / 4)
 
+// Changes of these states are published before all others.
+static const char *const high_priority_states[] = {
+    "evse/state",
+    "charge_tracker/current_charge",
+};
+
 void Mqtt::pre_setup()
 {
     // The real UID will be patched in later
@@ -53,7 +64,8 @@ void Mqtt::pre_setup()
         {"broker_password", Config::Str("", 0, 64)},
         {"global_topic_prefix", Config::Str(String(BUILD_HOST_PREFIX) + String("/") + String("ABC"), 0, 64)},
         {"client_name", Config::Str(String(BUILD_HOST_PREFIX) + String("-") + String("ABC"), 1, 64)},
-        {"interval", Config::Uint32(1)}
+        {"interval", Config::Uint32(1)},
+        {"wildcard_subscription", Config::Bool(false)}
     }), [](Config &cfg) -> String {
 #if MODULE_MQTT_AUTO_DISCOVERY_AVAILABLE()
         const String &global_topic_prefix = cfg.get("global_topic_prefix")->asString();
@@ -65,12 +77,101 @@ void Mqtt::pre_setup()
         return "";
     });
 
+    mqtt_publish_policies = ConfigRoot(Config::Object({
+        {"policies", Config::Array(
+            {},
+            new Config{Config::Object({
+                {"path", Config::Str("", 0, 64)},
+                {"min_interval", Config::Uint32(0)},
+                {"max_interval", Config::Uint32(0)},
+                {"deadband", Config::Float(0, 0, std::numeric_limits<float>::max())}
+            })},
+            0, MQTT_MAX_PUBLISH_POLICIES,
+            Config::type_id<Config::ConfObject>())
+        }
+    }), [](Config &cfg) -> String {
+        Config *policies = (Config *)cfg.get("policies");
+        for (int i = 0; i < policies->count(); ++i) {
+            auto policy = policies->get(i);
+            uint32_t max_interval = policy->get("max_interval")->asUint();
+            if (max_interval != 0 && max_interval < policy->get("min_interval")->asUint())
+                return String("Maximum interval of ") + policy->get("path")->asString() + " is less than its minimum interval.";
+
+            for (int j = 0; j < i; ++j) {
+                if (policies->get(j)->get("path")->asString() == policy->get("path")->asString())
+                    return String("Duplicate publish policy for ") + policy->get("path")->asString() + ".";
+            }
+        }
+        return "";
+    });
+
     mqtt_state = Config::Object({
         {"connection_state", Config::Int(0)},
-        {"last_error", Config::Int(0)}
+        {"last_error", Config::Int(0)},
+        {"pending_publishes", Config::Uint32(0)},
+        {"outbox_size", Config::Uint32(0)}
     });
 }
 
+// FNV-1a
+static uint32_t topic_hash(const char *topic, size_t topic_len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < topic_len; ++i) {
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool topic_has_wildcard(const String &topic)
+{
+    return topic.indexOf('+') >= 0 || topic.indexOf('#') >= 0;
+}
+
+// Topic filter matching as specified in section 4.7 of the MQTT 3.1.1 specification.
+static bool topic_matches_filter(const char *filter, size_t filter_len, const char *topic, size_t topic_len)
+{
+    // Wildcards at the first level don't match topics starting with $.
+    if (topic_len > 0 && topic[0] == '$' && filter_len > 0 && (filter[0] == '+' || filter[0] == '#'))
+        return false;
+
+    size_t f = 0;
+    size_t t = 0;
+    while (f < filter_len) {
+        if (filter[f] == '#')
+            return true;
+
+        if (filter[f] == '+') {
+            while (t < topic_len && topic[t] != '/')
+                ++t;
+            ++f;
+        } else {
+            while (f < filter_len && filter[f] != '/') {
+                if (t >= topic_len || topic[t] != filter[f])
+                    return false;
+                ++f;
+                ++t;
+            }
+        }
+
+        // Both at the end of the current level.
+        if (f == filter_len)
+            return t == topic_len;
+
+        // filter[f] is a '/'. "a/#" also matches "a".
+        if (t == topic_len)
+            return f + 2 == filter_len && filter[f + 1] == '#';
+
+        if (topic[t] != '/')
+            return false;
+        ++f;
+        ++t;
+    }
+
+    return t == topic_len;
+}
+
 void Mqtt::subscribe_with_prefix(const String &path, std::function<void(char *, size_t)> callback, bool forbid_retained)
 {
     const String &prefix = mqtt_config_in_use.get("global_topic_prefix")->asString();
@@ -78,9 +179,35 @@ void Mqtt::subscribe_with_prefix(const String &path, std::function<void(char *,
     subscribe(topic, callback, forbid_retained);
 }
 
+bool Mqtt::covered_by_wildcard_subscription(const char *topic, size_t topic_len)
+{
+    if (!mqtt_config_in_use.get("wildcard_subscription")->asBool())
+        return false;
+
+    const String &prefix = mqtt_config_in_use.get("global_topic_prefix")->asString();
+    return topic_len > prefix.length()
+        && memcmp(topic, prefix.c_str(), prefix.length()) == 0
+        && topic[prefix.length()] == '/';
+}
+
 void Mqtt::subscribe(const String &topic, std::function<void(char *, size_t)> callback, bool forbid_retained)
 {
     this->commands.push_back({topic, callback, forbid_retained});
+    size_t command_idx = this->commands.size() - 1;
+
+    if (topic_has_wildcard(topic)) {
+        this->wildcard_commands.push_back(command_idx);
+    } else {
+        MqttCommandLookup lookup{topic_hash(topic.c_str(), topic.length()), command_idx};
+        auto it = std::upper_bound(this->command_lookup.begin(), this->command_lookup.end(), lookup, [](const MqttCommandLookup &a, const MqttCommandLookup &b) {
+            return a.topic_hash < b.topic_hash;
+        });
+        this->command_lookup.insert(it, lookup);
+    }
+
+    // Dispatched locally after being received via the <prefix>/# subscription.
+    if (covered_by_wildcard_subscription(topic.c_str(), topic.length()))
+        return;
 
     esp_mqtt_client_unsubscribe(client, topic.c_str());
     esp_mqtt_client_subscribe(client, topic.c_str(), 0);
@@ -118,7 +245,115 @@ void Mqtt::addCommand(size_t commandIdx, const CommandRegistration &reg)
 
 void Mqtt::addState(size_t stateIdx, const StateRegistration &reg)
 {
-    this->states.push_back({reg.path, 0});
+    MqttPublishPriority priority = MqttPublishPriority::NORMAL;
+    for (const char *path : high_priority_states) {
+        if (reg.path == path) {
+            priority = MqttPublishPriority::HIGH;
+            break;
+        }
+    }
+
+    uint32_t min_interval_ms = mqtt_config_in_use.get("interval")->asUint() * 1000;
+    uint32_t max_interval_ms = 0;
+    float deadband = 0;
+
+    Config *policies = (Config *)mqtt_publish_policies.get("policies");
+    for (int i = 0; i < policies->count(); ++i) {
+        auto policy = policies->get(i);
+        if (policy->get("path")->asString() != reg.path)
+            continue;
+
+        min_interval_ms = policy->get("min_interval")->asUint();
+        max_interval_ms = policy->get("max_interval")->asUint();
+        deadband = policy->get("deadband")->asFloat();
+        break;
+    }
+
+    this->states.push_back({reg.path, 0, false, priority, priority, min_interval_ms, max_interval_ms, deadband, 0, {}});
+}
+
+// Collects all numbers of a config. Everything else is hashed.
+struct collect_numbers {
+    void operator()(const Config::ConfVariant::Empty &)
+    {
+        hash_byte(0);
+    }
+    void operator()(const Config::ConfString &x)
+    {
+        const String *val = x.getVal();
+        for (size_t i = 0; i < val->length(); ++i)
+            hash_byte((uint8_t)(*val)[i]);
+        hash_byte(0);
+    }
+    void operator()(const Config::ConfFloat &x)
+    {
+        numbers->push_back(*x.getVal());
+    }
+    void operator()(const Config::ConfInt &x)
+    {
+        numbers->push_back((float)*x.getVal());
+    }
+    void operator()(const Config::ConfUint &x)
+    {
+        numbers->push_back((float)*x.getVal());
+    }
+    void operator()(const Config::ConfBool &x)
+    {
+        hash_byte(*x.getVal() ? 1 : 2);
+    }
+    void operator()(const Config::ConfArray &x)
+    {
+        // Arrays of different lengths must not compare equal.
+        hash_byte(0xFF);
+        for (const Config &child : *x.getVal())
+            Config::apply_visitor(*this, child.value);
+        hash_byte(0xFE);
+    }
+    void operator()(const Config::ConfObject &x)
+    {
+        for (const auto &child : *x.getVal())
+            Config::apply_visitor(*this, child.second.value);
+    }
+
+    void hash_byte(uint8_t b)
+    {
+        *hash = (*hash ^ b) * 16777619u;
+    }
+
+    std::vector<float> *numbers;
+    uint32_t *hash;
+};
+
+void Mqtt::state_published(size_t stateIdx)
+{
+    auto &state = this->states[stateIdx];
+    state.last_send_ms = millis();
+
+    if (state.deadband == 0)
+        return;
+
+    state.published_numbers.clear();
+    state.published_hash = 2166136261u;
+    Config::apply_visitor(collect_numbers{&state.published_numbers, &state.published_hash}, api.states[stateIdx].config->value);
+}
+
+bool Mqtt::exceeds_deadband(size_t stateIdx)
+{
+    auto &state = this->states[stateIdx];
+
+    deadband_scratch.clear();
+    uint32_t hash = 2166136261u;
+    Config::apply_visitor(collect_numbers{&deadband_scratch, &hash}, api.states[stateIdx].config->value);
+
+    if (hash != state.published_hash || deadband_scratch.size() != state.published_numbers.size())
+        return true;
+
+    for (size_t i = 0; i < deadband_scratch.size(); ++i) {
+        if (fabsf(deadband_scratch[i] - state.published_numbers[i]) >= state.deadband)
+            return true;
+    }
+
+    return false;
 }
 
 void Mqtt::addRawCommand(size_t rawCommandIdx, const RawCommandRegistration &reg)
@@ -148,15 +383,96 @@ void Mqtt::publish(const String &topic, const String &payload, bool retain)
     esp_mqtt_client_publish(this->client, topic.c_str(), payload.c_str(), payload.length(), 0, retain);
 }
 
+bool Mqtt::take_publish_token()
+{
+    uint32_t now = millis();
+    uint32_t new_tokens = (now - last_token_refill_ms) / MQTT_PUBLISH_TOKEN_INTERVAL_MS;
+    if (new_tokens > 0) {
+        publish_tokens = std::min(publish_tokens + new_tokens, (uint32_t)MQTT_PUBLISH_BURST);
+        last_token_refill_ms += new_tokens * MQTT_PUBLISH_TOKEN_INTERVAL_MS;
+    }
+    if (publish_tokens == MQTT_PUBLISH_BURST)
+        last_token_refill_ms = now;
+
+    if (publish_tokens == 0)
+        return false;
+
+    --publish_tokens;
+    return true;
+}
+
+bool Mqtt::outbox_full()
+{
+    return esp_mqtt_client_get_outbox_size(client) > MQTT_OUTBOX_LIMIT;
+}
+
+void Mqtt::mark_state_pending(size_t stateIdx, MqttPublishPriority priority)
+{
+    auto &state = this->states[stateIdx];
+
+    if (!state.pending) {
+        state.pending = true;
+        state.pending_priority = priority;
+        ++pending_states;
+    } else if (priority < state.pending_priority) {
+        state.pending_priority = priority;
+    }
+}
+
+void Mqtt::publish_pending_states()
+{
+    if (pending_states == 0)
+        return;
+
+    if (mqtt_state.get("connection_state")->asInt() != (int)MqttConnectionState::CONNECTED)
+        return;
+
+    const String &prefix = mqtt_config_in_use.get("global_topic_prefix")->asString();
+
+    for (int prio = 0; prio < MQTT_PUBLISH_PRIORITY_COUNT; ++prio) {
+        for (size_t i = 0; i < states.size(); ++i) {
+            auto &state = states[i];
+            if (!state.pending || (int)state.pending_priority != prio)
+                continue;
+
+            if (outbox_full() || !take_publish_token())
+                return;
+
+            // Latest value wins: Serialize the current state instead of storing the payload of each update.
+            auto &reg = api.states[i];
+            String topic = prefix + "/" + state.topic;
+            String payload = reg.config->to_string_except(reg.keys_to_censor);
+            if (esp_mqtt_client_publish(this->client, topic.c_str(), payload.c_str(), payload.length(), 0, true) < 0)
+                return;
+
+            state.pending = false;
+            --pending_states;
+            state_published(i);
+        }
+    }
+}
+
 bool Mqtt::pushStateUpdate(size_t stateIdx, const String &payload, const String &path)
 {
     auto &state = this->states[stateIdx];
 
-    if (!deadline_elapsed(state.last_send_ms + mqtt_config_in_use.get("interval")->asUint() * 1000))
+    if (!deadline_elapsed(state.last_send_ms + state.min_interval_ms))
         return false;
 
-    this->publish_with_prefix(path, payload);
-    state.last_send_ms = millis();
+    // Small changes are dropped. The state is still republished after max_interval_ms.
+    if (state.deadband != 0 && !state.pending && !exceeds_deadband(stateIdx))
+        return true;
+
+    // Publish directly if nothing else is waiting. Otherwise the state is queued behind the other pending states.
+    if (pending_states == 0 && !outbox_full() && take_publish_token()) {
+        String topic = mqtt_config_in_use.get("global_topic_prefix")->asString() + "/" + path;
+        if (esp_mqtt_client_publish(this->client, topic.c_str(), payload.c_str(), payload.length(), 0, true) >= 0) {
+            state_published(stateIdx);
+            return true;
+        }
+    }
+
+    mark_state_pending(stateIdx, state.priority);
     return true;
 }
 
@@ -179,6 +495,17 @@ void Mqtt::onMqttConnect()
     this->mqtt_state.get("connection_state")->updateInt((int)MqttConnectionState::CONNECTED);
 
     this->commands.clear();
+    this->command_lookup.clear();
+    this->wildcard_commands.clear();
+
+    if (mqtt_config_in_use.get("wildcard_subscription")->asBool()) {
+        // One SUBSCRIBE for all commands instead of an UNSUBSCRIBE and SUBSCRIBE per command.
+        // The broker then also sends our own retained states back. Those are dropped in onMqttMessage.
+        const String &prefix = mqtt_config_in_use.get("global_topic_prefix")->asString();
+        String topic = prefix + "/#";
+        esp_mqtt_client_subscribe(client, topic.c_str(), 0);
+    }
+
     for (size_t i = 0; i < api.commands.size(); ++i) {
         auto &reg = api.commands[i];
         this->addCommand(i, reg);
@@ -187,9 +514,11 @@ void Mqtt::onMqttConnect()
         auto &reg = api.raw_commands[i];
         this->addRawCommand(i, reg);
     }
-    for (auto &reg : api.states) {
-        publish_with_prefix(reg.path, reg.config->to_string_except(reg.keys_to_censor));
+    // Don't send all states at once: This would overflow the outbox.
+    for (size_t i = 0; i < states.size(); ++i) {
+        mark_state_pending(i, MqttPublishPriority::BULK);
     }
+    publish_pending_states();
 
 #if MODULE_MQTT_AUTO_DISCOVERY_AVAILABLE()
     mqtt_auto_discovery.onMqttConnect();
@@ -209,24 +538,47 @@ void Mqtt::onMqttMessage(char *topic, size_t topic_len, char *data, size_t data_
         return;
 #endif
 
-    for (auto &c : commands) {
+    uint32_t hash = topic_hash(topic, topic_len);
+    auto it = std::lower_bound(command_lookup.begin(), command_lookup.end(), hash, [](const MqttCommandLookup &lookup, uint32_t h) {
+        return lookup.topic_hash < h;
+    });
+    for (; it != command_lookup.end() && it->topic_hash == hash; ++it) {
+        auto &c = commands[it->command_idx];
         if (c.topic.length() != topic_len)
             continue;
         if (memcmp(c.topic.c_str(), topic, topic_len) != 0)
             continue;
 
-        if (retain && c.forbid_retained) {
-            logger.printfln("MQTT: Topic %s is an action. Ignoring retained message.", c.topic.c_str());
-            return;
-        }
+        dispatch_command(c, data, data_len, retain);
+        return;
+    }
 
-        c.callback(data, data_len);
+    for (size_t idx : wildcard_commands) {
+        auto &c = commands[idx];
+        if (!topic_matches_filter(c.topic.c_str(), c.topic.length(), topic, topic_len))
+            continue;
+
+        dispatch_command(c, data, data_len, retain);
         return;
     }
 
+    // Most likely one of our own states.
+    if (covered_by_wildcard_subscription(topic, topic_len))
+        return;
+
     logger.printfln("MQTT: Received message on unknown topic '%.*s'. data_len=%i", topic_len, topic, data_len);
 }
 
+void Mqtt::dispatch_command(MqttCommand &command, char *data, size_t data_len, bool retain)
+{
+    if (retain && command.forbid_retained) {
+        logger.printfln("MQTT: Topic %s is an action. Ignoring retained message.", command.topic.c_str());
+        return;
+    }
+
+    command.callback(data, data_len);
+}
+
 static char err_buf[64] = {0};
 
 static const char *get_mqtt_error(esp_mqtt_connect_return_code_t rc)
@@ -313,6 +665,8 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
 void Mqtt::setup()
 {
+    api.restorePersistentConfig("mqtt/publish_policies", &mqtt_publish_policies);
+
     if (!api.restorePersistentConfig("mqtt/config", &mqtt_config)) {
         mqtt_config.get("global_topic_prefix")->updateString(String(BUILD_HOST_PREFIX) + String("/") + String(local_uid_str));
         mqtt_config.get("client_name")->updateString(String(BUILD_HOST_PREFIX) + String("-") + String(local_uid_str));
@@ -369,9 +723,29 @@ void Mqtt::setup()
 void Mqtt::register_urls()
 {
     api.addPersistentConfig("mqtt/config", &mqtt_config, {"broker_password"}, 1000);
+    api.addPersistentConfig("mqtt/publish_policies", &mqtt_publish_policies, {}, 1000);
     api.addState("mqtt/state", &mqtt_state, {}, 1000);
+
+    if (!mqtt_config.get("enable_mqtt")->asBool())
+        return;
+
+    task_scheduler.scheduleWithFixedDelay([this](){
+        mqtt_state.get("pending_publishes")->updateUint(pending_states);
+        mqtt_state.get("outbox_size")->updateUint(esp_mqtt_client_get_outbox_size(client));
+
+        // Heartbeat: Republish states that were not sent for max_interval_ms.
+        for (size_t i = 0; i < states.size(); ++i) {
+            auto &state = states[i];
+            if (state.max_interval_ms != 0 && !state.pending && deadline_elapsed(state.last_send_ms + state.max_interval_ms))
+                mark_state_pending(i, MqttPublishPriority::NORMAL);
+        }
+    }, 1000, 1000);
 }
 
 void Mqtt::loop()
 {
+    if (!initialized || pending_states == 0)
+        return;
+
+    publish_pending_states();
 }
@@ -26,6 +26,14 @@
 
 #define MAX_CONNECT_ATTEMPT_INTERVAL_MS (5 * 60 * 1000)
 
+// Token bucket for state publishes: One token every MQTT_PUBLISH_TOKEN_INTERVAL_MS, at most MQTT_PUBLISH_BURST tokens.
+#define MQTT_PUBLISH_TOKEN_INTERVAL_MS 20
+#define MQTT_PUBLISH_BURST 32
+// Don't publish states while more than this many bytes are waiting in the esp-mqtt outbox.
+#define MQTT_OUTBOX_LIMIT 8192
+
+#define MQTT_MAX_PUBLISH_POLICIES 32
+
 enum class MqttConnectionState {
     NOT_CONFIGURED,
     NOT_CONNECTED,
@@ -39,9 +47,41 @@ struct MqttCommand {
     bool forbid_retained;
 };
 
+// Maps the hash of a subscribed topic to the command's index in Mqtt::commands.
+struct MqttCommandLookup {
+    uint32_t topic_hash;
+    size_t command_idx;
+};
+
+// Lower values are published first.
+enum class MqttPublishPriority : uint8_t {
+    HIGH,
+    NORMAL,
+    BULK
+};
+
+#define MQTT_PUBLISH_PRIORITY_COUNT 3
+
 struct MqttState {
     String topic;
     uint32_t last_send_ms;
+    // Set if the state has to be published but could not be sent yet.
+    // The payload is serialized when sending, so later updates are coalesced.
+    bool pending;
+    MqttPublishPriority priority;
+    MqttPublishPriority pending_priority;
+
+    // Publish policy: Updates are sent at most every min_interval_ms. If max_interval_ms is not 0,
+    // the state is republished after max_interval_ms even without changes.
+    // If deadband is not 0, an update is only sent if a number in the state changed by at least deadband
+    // compared to the last published value or anything else in the state changed.
+    uint32_t min_interval_ms;
+    uint32_t max_interval_ms;
+    float deadband;
+
+    // Only used if deadband is not 0
+    uint32_t published_hash;
+    std::vector<float> published_numbers;
 };
 
 class Mqtt : public IAPIBackend
@@ -72,13 +112,33 @@ public:
     void onMqttConnect();
     void onMqttMessage(char *topic, size_t topic_len, char *data, size_t data_len, bool retain);
     void onMqttDisconnect();
+    bool covered_by_wildcard_subscription(const char *topic, size_t topic_len);
+    void dispatch_command(MqttCommand &command, char *data, size_t data_len, bool retain);
+
+    bool take_publish_token();
+    bool outbox_full();
+    void mark_state_pending(size_t stateIdx, MqttPublishPriority priority);
+    void publish_pending_states();
+
+    void state_published(size_t stateIdx);
+    bool exceeds_deadband(size_t stateIdx);
 
     ConfigRoot mqtt_config;
     ConfigRoot mqtt_state;
 
     ConfigRoot mqtt_config_in_use;
 
+    ConfigRoot mqtt_publish_policies;
+
     std::vector<MqttCommand> commands;
+    // Sorted by topic_hash. Only contains topics without wildcards.
+    std::vector<MqttCommandLookup> command_lookup;
+    // Indices of commands subscribed with + or # wildcards. Only checked if no exact match was found.
+    std::vector<size_t> wildcard_commands;
     std::vector<MqttState> states;
+    size_t pending_states = 0;
+    uint32_t publish_tokens = MQTT_PUBLISH_BURST;
+    uint32_t last_token_refill_ms = 0;
+    std::vector<float> deadband_scratch;
     esp_mqtt_client_handle_t client;
 };
@@ -19,12 +19,15 @@
 
 #include "nfc.h"
 
+#include <algorithm>
+
 #include "bindings/errors.h"
 
 #include "api.h"
 #include "event_log.h"
 #include "tools.h"
 #include "task_scheduler.h"
+#include "web_server.h"
 #include "modules.h"
 
 #if MODULE_EVSE_AVAILABLE()
@@ -44,6 +47,9 @@
 #define IND_NACK 1002
 #define IND_NAG 1003
 
+// Tags per request of /nfc/tag_table_page
+#define TAG_TABLE_PAGE_MAX_TAGS 64
+
 #define TOKEN_LIFETIME_MS 30000
 #define DETECTION_THRESHOLD_MS 1000
 
@@ -53,6 +59,8 @@ extern TaskScheduler task_scheduler;
 
 extern API api;
 
+extern WebServer server;
+
 void NFC::pre_setup()
 {
     seen_tags = Config::Array(
@@ -114,8 +122,104 @@ void NFC::pre_setup()
             return "Tag ID contains unexpected character. Expected format is hex bytes separated by colons. For example \"01:23:ab:3d\".";
         }
 
+        if (id_copy.length() != 0 && id_copy.length() % 3 != 2)
+            return "Tag ID is incomplete. Expected format is hex bytes separated by colons. For example \"01:23:ab:3d\".";
+
         return "";
     });
+
+    // The validators only queue the change: They run in the task of the web server
+    // or the MQTT client, the tag table is written by the main loop.
+    add_tag = ConfigRoot(Config::Object({
+        {"tag_type", Config::Uint(0, 0, 4)},
+        {"tag_id", Config::Str("", 0, NFC_TAG_ID_STRING_LENGTH)},
+        {"user_id", Config::Uint8(0)}
+    }), [this](Config &cfg) -> String {
+        NFCTagTableEntry entry = {};
+        String error = tag_table_entry_from_config(cfg, &entry);
+        if (error != "")
+            return error;
+
+        entry.user_id = cfg.get("user_id")->asUint();
+        if (!users.is_user_configured(entry.user_id))
+            return "User with this ID not found.";
+
+        return queue_tag_table_change(entry);
+    });
+
+    remove_tag = ConfigRoot(Config::Object({
+        {"tag_type", Config::Uint(0, 0, 4)},
+        {"tag_id", Config::Str("", 0, NFC_TAG_ID_STRING_LENGTH)}
+    }), [this](Config &cfg) -> String {
+        NFCTagTableEntry entry = {};
+        String error = tag_table_entry_from_config(cfg, &entry);
+        if (error != "")
+            return error;
+
+        entry.flags = NFC_TAG_TABLE_FLAG_REMOVED;
+        return queue_tag_table_change(entry);
+    });
+
+    tag_table_state = Config::Object({
+        {"tags", Config::Uint16(0)},
+        {"max_tags", Config::Uint16(NFC_TAG_TABLE_MAX_TAGS)}
+    });
+}
+
+String NFC::tag_table_entry_from_config(Config &cfg, NFCTagTableEntry *entry)
+{
+    String id_copy = cfg.get("tag_id")->asString();
+    id_copy.toUpperCase();
+
+    if (id_copy.length() == 0 || !tag_id_string_to_bytes(id_copy.c_str(), entry->tag_id, &entry->tag_id_len))
+        return "Tag ID is invalid. Expected format is hex bytes separated by colons. For example \"01:23:ab:3d\".";
+
+    cfg.get("tag_id")->updateString(id_copy);
+    entry->tag_type = cfg.get("tag_type")->asUint();
+    return "";
+}
+
+String NFC::queue_tag_table_change(const NFCTagTableEntry &entry)
+{
+    std::lock_guard<std::mutex> lock{pending_tag_changes_mutex};
+    if (pending_tag_changes.size() >= NFC_TAG_TABLE_PENDING_CHANGES)
+        return "Too many pending NFC tag changes. Please retry.";
+
+    pending_tag_changes.push_back(entry);
+    return "";
+}
+
+void NFC::apply_tag_table_changes()
+{
+    for (;;) {
+        NFCTagTableEntry entry;
+        {
+            std::lock_guard<std::mutex> lock{pending_tag_changes_mutex};
+            if (pending_tag_changes.empty())
+                break;
+
+            entry = pending_tag_changes.front();
+            pending_tag_changes.pop_front();
+        }
+
+        String error;
+        if (entry.flags & NFC_TAG_TABLE_FLAG_REMOVED) {
+            error = tag_table.remove(entry);
+        } else if (!users.is_user_configured(entry.user_id)) {
+            // The user was removed after the change was queued.
+            error = "User with this ID not found.";
+        } else {
+            error = tag_table.add(entry);
+        }
+
+        if (error != "") {
+            char tag_id[NFC_TAG_ID_STRING_LENGTH + 1];
+            tag_id_bytes_to_string(entry.tag_id, entry.tag_id_len, tag_id);
+            logger.printfln("Failed to %s NFC tag %s: %s", (entry.flags & NFC_TAG_TABLE_FLAG_REMOVED) ? "remove" : "add", tag_id, error.c_str());
+        }
+    }
+
+    tag_table_state.get("tags")->updateUint(tag_table.count());
 }
 
 void NFC::setup_nfc()
@@ -161,22 +265,124 @@ void NFC::check_nfc_state()
     }
 }
 
-uint8_t NFC::get_user_id(tag_info_t *tag, uint8_t *tag_idx)
+static uint8_t hex_digit(char c)
 {
-    if (tag->last_seen >= TOKEN_LIFETIME_MS)
+    return c <= '9' ? c - '0' : c - 'A' + 10;
+}
+
+// Returns false if tag_id_string is not the complete hex string of up to NFC_TAG_ID_LENGTH bytes.
+bool tag_id_string_to_bytes(const char *tag_id_string, uint8_t tag_id[NFC_TAG_ID_LENGTH], uint8_t *tag_id_len)
+{
+    size_t len = strlen(tag_id_string);
+
+    memset(tag_id, 0, NFC_TAG_ID_LENGTH);
+    *tag_id_len = 0;
+
+    if (len == 0)
+        return true;
+
+    if (len % 3 != 2 || len > NFC_TAG_ID_STRING_LENGTH)
         return false;
 
-    Config *auth_tags = (Config *)config_in_use.get("authorized_tags");
+    for (size_t i = 0; i < len; i += 3) {
+        char hi = tag_id_string[i];
+        char lo = tag_id_string[i + 1];
+        if (!isxdigit(hi) || !isxdigit(lo) || (i + 2 < len && tag_id_string[i + 2] != ':'))
+            return false;
+
+        tag_id[i / 3] = hex_digit(toupper(hi)) << 4 | hex_digit(toupper(lo));
+    }
 
-    for (uint8_t auth_tag_idx = 0; auth_tag_idx < auth_tags->count(); ++auth_tag_idx) {
-        Config *auth_tag = (Config *)auth_tags->get(auth_tag_idx);
+    *tag_id_len = (len + 1) / 3;
+    return true;
+}
 
-        if (auth_tag->get("tag_type")->asUint() == tag->tag_type && auth_tag->get("tag_id")->asString() == tag->tag_id) {
-            *tag_idx = auth_tag_idx;
-            return auth_tag->get("user_id")->asUint();
-        }
+static uint32_t hash_tag(uint8_t tag_type, const uint8_t *tag_id, uint8_t tag_id_len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ tag_type) * 16777619u;
+    hash = (hash ^ tag_id_len) * 16777619u;
+    for (size_t i = 0; i < tag_id_len; ++i)
+        hash = (hash ^ tag_id[i]) * 16777619u;
+    return hash;
+}
+
+void NFC::build_auth_tag_index()
+{
+    Config *tags = (Config *)config_in_use.get("authorized_tags");
+
+    auth_tags.clear();
+    auth_tags.reserve(tags->count());
+
+    // At most half of the slots are used.
+    size_t slot_count = 4;
+    while (slot_count < 2 * (size_t)tags->count())
+        slot_count *= 2;
+
+    auth_tag_slots.assign(slot_count, 0);
+
+    for (int i = 0; i < tags->count(); ++i) {
+        auth_tag_t tag;
+        tag.tag_type = tags->get(i)->get("tag_type")->asUint();
+        tag.user_id = tags->get(i)->get("user_id")->asUint();
+        tag.index = i;
+
+        // A tag ID that is not a complete hex string never matches a seen tag.
+        if (!tag_id_string_to_bytes(tags->get(i)->get("tag_id")->asEphemeralCStr(), tag.tag_id, &tag.tag_id_len))
+            continue;
+
+        // If a tag is configured more than once, the first entry is used.
+        if (find_auth_tag(tag.tag_type, tag.tag_id, tag.tag_id_len) != nullptr)
+            continue;
+
+        size_t slot = hash_tag(tag.tag_type, tag.tag_id, tag.tag_id_len) & (slot_count - 1);
+        while (auth_tag_slots[slot] != 0)
+            slot = (slot + 1) & (slot_count - 1);
+
+        auth_tags.push_back(tag);
+        auth_tag_slots[slot] = auth_tags.size();
+    }
+}
+
+const NFC::auth_tag_t *NFC::find_auth_tag(uint8_t tag_type, const uint8_t *tag_id, uint8_t tag_id_len)
+{
+    if (auth_tag_slots.empty())
+        return nullptr;
+
+    size_t mask = auth_tag_slots.size() - 1;
+
+    for (size_t slot = hash_tag(tag_type, tag_id, tag_id_len) & mask; auth_tag_slots[slot] != 0; slot = (slot + 1) & mask) {
+        const auth_tag_t &tag = auth_tags[auth_tag_slots[slot] - 1];
+        if (tag.tag_type == tag_type && tag.tag_id_len == tag_id_len && memcmp(tag.tag_id, tag_id, tag_id_len) == 0)
+            return &tag;
+    }
+
+    return nullptr;
+}
+
+uint8_t NFC::get_user_id(tag_info_t *tag, uint16_t *tag_idx)
+{
+    if (tag->last_seen >= TOKEN_LIFETIME_MS)
+        return false;
+
+    const auth_tag_t *auth_tag = find_auth_tag(tag->tag_type, tag->tag_id_bytes, tag->tag_id_len);
+    if (auth_tag != nullptr) {
+        *tag_idx = auth_tag->index;
+        return auth_tag->user_id;
     }
-    return 0;
+
+    NFCTagTableEntry entry = {};
+    entry.tag_type = tag->tag_type;
+    entry.tag_id_len = tag->tag_id_len;
+    memcpy(entry.tag_id, tag->tag_id_bytes, sizeof(entry.tag_id));
+
+    if (!tag_table.find(entry, &entry))
+        return 0;
+
+    // All tags of the table share the index after the authorized_tags of config_in_use.
+    *tag_idx = AUTHORIZED_TAG_LIST_LENGTH;
+    return entry.user_id;
 }
 
 void set_led(int16_t mode)
@@ -218,7 +424,7 @@ void set_led(int16_t mode)
 
 void NFC::handle_event(tag_info_t *tag, bool found, bool injected)
 {
-    uint8_t idx = 0;
+    uint16_t idx = 0;
     uint8_t user_id = get_user_id(tag, &idx);
 
     if (user_id != 0) {
@@ -286,6 +492,56 @@ void tag_id_bytes_to_string(const uint8_t *tag_id, uint8_t tag_id_len, char buf[
         buf[3 * tag_id_len - 1] = '\0';
 }
 
+static int compare_tag_ids(const NFC::tag_info_t &a, const NFC::tag_info_t &b)
+{
+    if (a.tag_id_len != b.tag_id_len)
+        return a.tag_id_len < b.tag_id_len ? -1 : 1;
+
+    return memcmp(a.tag_id_bytes, b.tag_id_bytes, a.tag_id_len);
+}
+
+// Sets old_match[i] to the index of the tag in old_tags that has the same ID as new_tags[i], or to -1.
+// Tags with last_seen == 0 are not part of the lists.
+static void match_tag_lists(const NFC::tag_info_t *old_tags, const NFC::tag_info_t *new_tags, int old_match[TAG_LIST_LENGTH])
+{
+    uint8_t old_order[TAG_LIST_LENGTH];
+    uint8_t new_order[TAG_LIST_LENGTH];
+    size_t old_count = 0;
+    size_t new_count = 0;
+
+    for (uint8_t i = 0; i < TAG_LIST_LENGTH; ++i) {
+        old_match[i] = -1;
+
+        if (old_tags[i].last_seen != 0)
+            old_order[old_count++] = i;
+        if (new_tags[i].last_seen != 0)
+            new_order[new_count++] = i;
+    }
+
+    // Stable sort keeps duplicate IDs in list order.
+    std::stable_sort(old_order, old_order + old_count, [old_tags](uint8_t a, uint8_t b) {
+        return compare_tag_ids(old_tags[a], old_tags[b]) < 0;
+    });
+    std::stable_sort(new_order, new_order + new_count, [new_tags](uint8_t a, uint8_t b) {
+        return compare_tag_ids(new_tags[a], new_tags[b]) < 0;
+    });
+
+    size_t o = 0;
+    size_t n = 0;
+    while (o < old_count && n < new_count) {
+        int cmp = compare_tag_ids(old_tags[old_order[o]], new_tags[new_order[n]]);
+        if (cmp < 0) {
+            ++o;
+        } else if (cmp > 0) {
+            ++n;
+        } else {
+            old_match[new_order[n]] = old_order[o];
+            ++o;
+            ++n;
+        }
+    }
+}
+
 void NFC::update_seen_tags()
 {
     for (int i = 0; i < TAG_LIST_LENGTH - 1; ++i) {
@@ -299,6 +555,9 @@ void NFC::update_seen_tags()
             continue;
         }
 
+        tag_id_len = std::min(tag_id_len, (uint8_t)NFC_TAG_ID_LENGTH);
+        memcpy(new_tags[i].tag_id_bytes, buf, sizeof(buf));
+        new_tags[i].tag_id_len = tag_id_len;
         tag_id_bytes_to_string(buf, tag_id_len, new_tags[i].tag_id);
 
         seen_tags.get(i)->get("tag_type")->updateUint(new_tags[i].tag_type);
@@ -310,10 +569,13 @@ void NFC::update_seen_tags()
         last_tag_injection = 0;
         new_tags[TAG_LIST_LENGTH - 1].tag_type = 0;
         new_tags[TAG_LIST_LENGTH - 1].tag_id[0] = '\0';
+        tag_id_string_to_bytes("", new_tags[TAG_LIST_LENGTH - 1].tag_id_bytes, &new_tags[TAG_LIST_LENGTH - 1].tag_id_len);
         new_tags[TAG_LIST_LENGTH - 1].last_seen = 0;
     } else {
         new_tags[TAG_LIST_LENGTH - 1].tag_type = inject_tag.get("tag_type")->asUint();
         strncpy(new_tags[TAG_LIST_LENGTH - 1].tag_id, inject_tag.get("tag_id")->asEphemeralCStr(), sizeof(new_tags[TAG_LIST_LENGTH - 1].tag_id));
+        // The validator of nfc/inject_tag only accepts complete tag IDs.
+        tag_id_string_to_bytes(new_tags[TAG_LIST_LENGTH - 1].tag_id, new_tags[TAG_LIST_LENGTH - 1].tag_id_bytes, &new_tags[TAG_LIST_LENGTH - 1].tag_id_len);
         new_tags[TAG_LIST_LENGTH - 1].last_seen = millis() - last_tag_injection;
     }
 
@@ -321,6 +583,11 @@ void NFC::update_seen_tags()
     seen_tags.get(TAG_LIST_LENGTH - 1)->get("tag_type")->updateUint(new_tags[TAG_LIST_LENGTH - 1].tag_type);
     seen_tags.get(TAG_LIST_LENGTH - 1)->get("tag_id")->updateString(new_tags[TAG_LIST_LENGTH - 1].tag_id);
 
+    // Match the new list with the old one: Both lists are sorted by tag ID and merged.
+    // A tag that is in a list more than once is matched in list order.
+    int old_match[TAG_LIST_LENGTH];
+    match_tag_lists(old_tags, new_tags, old_match);
+
     // compare new list with old
     // tags that are not seen anymore are lost
     // tags that are seen again or are not in the old list are found
@@ -328,26 +595,14 @@ void NFC::update_seen_tags()
         if (new_tags[new_idx].last_seen == 0)
             continue;
 
-        bool found = false;
-        int old_idx;
-        for (old_idx = 0; old_idx < TAG_LIST_LENGTH; ++old_idx) {
-            if (old_tags[old_idx].last_seen == 0)
-                continue;
-
-            if(strncmp(old_tags[old_idx].tag_id,
-                       new_tags[new_idx].tag_id,
-                       NFC_TAG_ID_STRING_LENGTH) != 0)
-                continue;
-
-            found = true;
-            break;
-        }
-
+        int old_idx = old_match[new_idx];
         bool new_seen = new_tags[new_idx].last_seen < DETECTION_THRESHOLD_MS;
 
-        if (!found && new_seen) {
-            // found new tag
-            handle_event(&new_tags[new_idx], true, new_idx == TAG_LIST_LENGTH - 1);
+        if (old_idx < 0) {
+            if (new_seen) {
+                // found new tag
+                handle_event(&new_tags[new_idx], true, new_idx == TAG_LIST_LENGTH - 1);
+            }
             continue;
         }
 
@@ -388,6 +643,10 @@ void NFC::setup()
 
     api.restorePersistentConfig("nfc/config", &config);
     config_in_use = config;
+    build_auth_tag_index();
+
+    tag_table.setup();
+    tag_table_state.get("tags")->updateUint(tag_table.count());
 
     for (int i = 0; i < TAG_LIST_LENGTH; ++i) {
         seen_tags.add();
@@ -407,6 +666,23 @@ void NFC::setup()
     }, 10, 10);
 }
 
+static bool parse_query_uint(WebServerRequest &request, const char *key, uint32_t max, uint32_t *value, bool *valid)
+{
+    char buf[16];
+    if (!request.queryValue(key, buf, sizeof(buf)))
+        return false;
+
+    char *end;
+    unsigned long parsed = strtoul(buf, &end, 10);
+    if (end == buf || *end != '\0' || parsed > max) {
+        *valid = false;
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
 void NFC::register_urls()
 {
     if (!device_found)
@@ -441,6 +717,58 @@ void NFC::register_urls()
             last_tag_injection -= 1;
     }, true);
 
+    api.addState("nfc/tag_table", &tag_table_state, {}, 1000);
+    api.addCommand("nfc/add_tag", &add_tag, {}, [this](){
+        apply_tag_table_changes();
+    }, true);
+    api.addCommand("nfc/remove_tag", &remove_tag, {}, [this](){
+        apply_tag_table_changes();
+    }, true);
+
+    server.on("/nfc/tag_table_page", HTTP_GET, [this](WebServerRequest request) {
+        uint32_t offset = 0;
+        uint32_t count = TAG_TABLE_PAGE_MAX_TAGS;
+        bool valid = true;
+
+        parse_query_uint(request, "offset", NFC_TAG_TABLE_MAX_TAGS, &offset, &valid);
+        parse_query_uint(request, "count", TAG_TABLE_PAGE_MAX_TAGS, &count, &valid);
+
+        if (!valid)
+            return request.send(400, "text/plain", "Invalid query");
+
+        std::vector<NFCTagTableEntry> page;
+        page.reserve(count);
+        tag_table.read_page(offset, count, &page);
+
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        WebServerChunkWriter writer{&request};
+
+        writer.write("{\"tags\":");
+        writer.writeInt(tag_table.count());
+        writer.write(",\"offset\":");
+        writer.writeInt(offset);
+        writer.write(",\"authorized_tags\":[");
+
+        for (size_t i = 0; i < page.size(); ++i) {
+            char tag_id[NFC_TAG_ID_STRING_LENGTH + 1];
+            tag_id_bytes_to_string(page[i].tag_id, page[i].tag_id_len, tag_id);
+
+            if (i != 0)
+                writer.write(',');
+            writer.write("{\"user_id\":");
+            writer.writeInt(page[i].user_id);
+            writer.write(",\"tag_type\":");
+            writer.writeInt(page[i].tag_type);
+            writer.write(",\"tag_id\":\"");
+            writer.write(tag_id);
+            writer.write("\"}");
+        }
+
+        writer.write("]}");
+        writer.flush();
+        return request.endChunkedResponse();
+    });
+
     this->DeviceModule::register_urls();
 }
 
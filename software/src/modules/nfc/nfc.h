@@ -19,11 +19,16 @@
 
 #pragma once
 
+#include <deque>
+#include <mutex>
+#include <vector>
+
 #include "bindings/bricklet_nfc.h"
 
 #include "config.h"
 #include "device_module.h"
 #include "nfc_bricklet_firmware_bin.embedded.h"
+#include "tag_table.h"
 
 // in bytes
 #define NFC_TAG_ID_LENGTH 10
@@ -32,6 +37,14 @@
 
 #define TAG_LIST_LENGTH 9
 
+// Changes of the tag table that can wait for the main loop
+#define NFC_TAG_TABLE_PENDING_CHANGES 16
+
+static_assert(NFC_TAG_ID_LENGTH == NFC_TAG_TABLE_ID_LENGTH, "Tag table and tag lists use different tag ID lengths");
+
+bool tag_id_string_to_bytes(const char *tag_id_string, uint8_t tag_id[NFC_TAG_ID_LENGTH], uint8_t *tag_id_len);
+void tag_id_bytes_to_string(const uint8_t *tag_id, uint8_t tag_id_len, char buf[NFC_TAG_ID_STRING_LENGTH + 1]);
+
 class NFC : public DeviceModule<TF_NFC,
                                 nfc_bricklet_firmware_bin_data,
                                 nfc_bricklet_firmware_bin_length,
@@ -50,21 +63,39 @@ public:
     struct tag_info_t {
         uint32_t last_seen;
         uint8_t tag_type;
+        uint8_t tag_id_len;
+        uint8_t tag_id_bytes[NFC_TAG_ID_LENGTH]; // zero padded
         char tag_id[NFC_TAG_ID_STRING_LENGTH + 1]; // allow null terminator here
     };
 
+    struct auth_tag_t {
+        uint8_t tag_type;
+        uint8_t tag_id_len;
+        uint8_t tag_id[NFC_TAG_ID_LENGTH]; // zero padded
+        uint8_t user_id;
+        uint16_t index; // in authorized_tags of config_in_use
+    };
+
     void update_seen_tags();
     void handle_event(tag_info_t *tag, bool lost_or_found, bool injected);
     void handle_evse();
     void setup_nfc();
     void check_nfc_state();
-    uint8_t get_user_id(tag_info_t *tag, uint8_t *tag_idx);
+    void build_auth_tag_index();
+    const auth_tag_t *find_auth_tag(uint8_t tag_type, const uint8_t *tag_id, uint8_t tag_id_len);
+    uint8_t get_user_id(tag_info_t *tag, uint16_t *tag_idx);
+    String tag_table_entry_from_config(Config &cfg, NFCTagTableEntry *entry);
+    String queue_tag_table_change(const NFCTagTableEntry &entry);
+    void apply_tag_table_changes();
 
     ConfigRoot config;
     ConfigRoot config_in_use;
     ConfigRoot seen_tags;
     ConfigRoot state;
     ConfigRoot inject_tag;
+    ConfigRoot add_tag;
+    ConfigRoot remove_tag;
+    ConfigRoot tag_table_state;
     uint32_t last_tag_injection = 0;
     int tag_injection_action = 0;
 
@@ -77,6 +108,20 @@ public:
     tag_info_t *old_tags = old_tag_buffer;
     tag_info_t *new_tags = new_tag_buffer;
 
+    // Authorized tags of config_in_use. auth_tag_slots is an open addressing
+    // hash table (linear probing) of indices into auth_tags plus one, 0 marks a free slot.
+    std::vector<auth_tag_t> auth_tags;
+    std::vector<uint16_t> auth_tag_slots;
+
+    // Authorized tags in addition to the ones of config_in_use.
+    NFCTagTable tag_table;
+
+    // Changes requested via nfc/add_tag and nfc/remove_tag. Queued by the validators,
+    // applied in order by apply_tag_table_changes in the main loop.
+    // NFC_TAG_TABLE_FLAG_REMOVED marks a removal.
+    std::deque<NFCTagTableEntry> pending_tag_changes;
+    std::mutex pending_tag_changes_mutex;
+
     int auth_token = -1;
     uint32_t auth_token_seen = 0;
     int16_t blink_state = -1;
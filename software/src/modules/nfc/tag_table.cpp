@@ -0,0 +1,409 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "tag_table.h"
+
+#include <LittleFS.h>
+
+#include <algorithm>
+
+#include "event_log.h"
+
+extern EventLog logger;
+
+#define TABLE_FILE NFC_TAG_TABLE_FOLDER "/tags.bin"
+#define TABLE_TMP_FILE NFC_TAG_TABLE_FOLDER "/tags.tmp"
+#define LOG_FILE NFC_TAG_TABLE_FOLDER "/tags-log.bin"
+
+// Entries read or written at once
+#define BLOCK_ENTRIES 32
+
+static int compare_keys(const NFCTagTableEntry &a, const NFCTagTableEntry &b)
+{
+    return memcmp(&a, &b, NFC_TAG_TABLE_KEY_LENGTH);
+}
+
+static bool read_header(File &f, NFCTagTableHeader *header)
+{
+    return f.read((uint8_t *)header, sizeof(*header)) == sizeof(*header) && header->magic == NFC_TAG_TABLE_MAGIC;
+}
+
+static bool write_header(File &f, uint32_t generation)
+{
+    NFCTagTableHeader header = {};
+    header.magic = NFC_TAG_TABLE_MAGIC;
+    header.generation = generation;
+    return f.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+}
+
+void NFCTagTable::setup()
+{
+    // mkdir also returns true if the directory already exists and is a directory.
+    if (!LittleFS.mkdir(NFC_TAG_TABLE_FOLDER)) {
+        logger.printfln("Failed to create NFC tag table folder!");
+        return;
+    }
+
+    // The table is replaced by removing it and renaming the new one. The log
+    // is only removed after that, so nothing is lost if this was interrupted.
+    if (!LittleFS.exists(TABLE_FILE) && LittleFS.exists(TABLE_TMP_FILE))
+        LittleFS.rename(TABLE_TMP_FILE, TABLE_FILE);
+
+    generation = 0;
+    table_count = 0;
+    if (LittleFS.exists(TABLE_FILE)) {
+        File f = LittleFS.open(TABLE_FILE);
+        NFCTagTableHeader header;
+        if (!read_header(f, &header)) {
+            logger.printfln("NFC tag table is corrupted");
+            return;
+        }
+
+        generation = header.generation;
+        table_count = (f.size() - sizeof(header)) / sizeof(NFCTagTableEntry);
+    }
+
+    log.clear();
+    if (LittleFS.exists(LOG_FILE)) {
+        File f = LittleFS.open(LOG_FILE);
+        NFCTagTableHeader header;
+        if (!read_header(f, &header) || header.generation != generation) {
+            // Left over if the table was rewritten but the log was not removed,
+            // its changes are already in the table. Applying them again would undo remove_user.
+            f.close();
+            LittleFS.remove(LOG_FILE);
+        } else {
+            log.resize((f.size() - sizeof(header)) / sizeof(NFCTagTableEntry));
+            size_t len = log.size() * sizeof(NFCTagTableEntry);
+            if (f.read((uint8_t *)log.data(), len) != len) {
+                logger.printfln("Failed to read NFC tag table log");
+                log.clear();
+            }
+        }
+    }
+
+    tag_count = 0;
+    merge([this](const NFCTagTableEntry &) {
+        ++tag_count;
+        return true;
+    });
+
+    ready = true;
+
+    if (log.size() >= NFC_TAG_TABLE_LOG_SIZE)
+        compact(-1);
+}
+
+bool NFCTagTable::find_in_table(const NFCTagTableEntry &key, NFCTagTableEntry *entry)
+{
+    if (table_count == 0)
+        return false;
+
+    File f = LittleFS.open(TABLE_FILE);
+
+    size_t lo = 0;
+    size_t hi = table_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        f.seek(sizeof(NFCTagTableHeader) + mid * sizeof(NFCTagTableEntry), SeekMode::SeekSet);
+        if (f.read((uint8_t *)entry, sizeof(NFCTagTableEntry)) != sizeof(NFCTagTableEntry))
+            return false;
+
+        int cmp = compare_keys(*entry, key);
+        if (cmp == 0)
+            return true;
+
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return false;
+}
+
+bool NFCTagTable::lookup(const NFCTagTableEntry &key, NFCTagTableEntry *entry)
+{
+    // The last change of a tag wins.
+    for (size_t i = log.size(); i-- > 0;) {
+        if (compare_keys(log[i], key) != 0)
+            continue;
+
+        if (log[i].flags & NFC_TAG_TABLE_FLAG_REMOVED)
+            return false;
+
+        *entry = log[i];
+        return true;
+    }
+
+    return find_in_table(key, entry);
+}
+
+bool NFCTagTable::find(const NFCTagTableEntry &key, NFCTagTableEntry *entry)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (!ready)
+        return false;
+
+    return lookup(key, entry);
+}
+
+bool NFCTagTable::append_to_log(const NFCTagTableEntry &entry)
+{
+    File f = LittleFS.open(LOG_FILE, "a");
+    if (f.size() == 0 && !write_header(f, generation))
+        return false;
+
+    if (f.write((const uint8_t *)&entry, sizeof(entry)) != sizeof(entry))
+        return false;
+    f.close();
+
+    log.push_back(entry);
+    return true;
+}
+
+String NFCTagTable::add(const NFCTagTableEntry &entry)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (!ready)
+        return "NFC tag table is not available.";
+
+    NFCTagTableEntry change = entry;
+    change.flags = 0;
+    memset(change.reserved, 0, sizeof(change.reserved));
+
+    NFCTagTableEntry existing;
+    bool exists = lookup(change, &existing);
+
+    if (exists && existing.user_id == change.user_id)
+        return "";
+
+    if (!exists && tag_count >= NFC_TAG_TABLE_MAX_TAGS)
+        return "NFC tag table is full.";
+
+    if (!append_to_log(change))
+        return "Failed to write NFC tag table.";
+
+    if (!exists)
+        ++tag_count;
+
+    if (log.size() >= NFC_TAG_TABLE_LOG_SIZE)
+        compact(-1);
+
+    return "";
+}
+
+String NFCTagTable::remove(const NFCTagTableEntry &key)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (!ready)
+        return "NFC tag table is not available.";
+
+    NFCTagTableEntry existing;
+    if (!lookup(key, &existing))
+        return "Tag not found in NFC tag table.";
+
+    NFCTagTableEntry change = existing;
+    change.user_id = 0;
+    change.flags = NFC_TAG_TABLE_FLAG_REMOVED;
+
+    if (!append_to_log(change))
+        return "Failed to write NFC tag table.";
+
+    --tag_count;
+
+    if (log.size() >= NFC_TAG_TABLE_LOG_SIZE)
+        compact(-1);
+
+    return "";
+}
+
+void NFCTagTable::remove_user(uint8_t user_id)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (!ready)
+        return;
+
+    bool found = false;
+    merge([user_id, &found](const NFCTagTableEntry &entry) {
+        found = entry.user_id == user_id;
+        return !found;
+    });
+
+    if (found)
+        compact(user_id);
+}
+
+void NFCTagTable::read_page(size_t offset, size_t count, std::vector<NFCTagTableEntry> *page)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (!ready || count == 0)
+        return;
+
+    size_t position = 0;
+    merge([offset, count, page, &position](const NFCTagTableEntry &entry) {
+        if (position++ < offset)
+            return true;
+
+        page->push_back(entry);
+        return page->size() < count;
+    });
+}
+
+void NFCTagTable::merge(std::function<bool(const NFCTagTableEntry &)> fn)
+{
+    // Only the last change of every tag counts.
+    std::vector<NFCTagTableEntry> changes;
+    changes.reserve(log.size());
+
+    for (const NFCTagTableEntry &change : log) {
+        auto it = std::find_if(changes.begin(), changes.end(), [&change](const NFCTagTableEntry &e) {
+            return compare_keys(e, change) == 0;
+        });
+
+        if (it != changes.end())
+            *it = change;
+        else
+            changes.push_back(change);
+    }
+
+    std::sort(changes.begin(), changes.end(), [](const NFCTagTableEntry &a, const NFCTagTableEntry &b) {
+        return compare_keys(a, b) < 0;
+    });
+
+    File f;
+    if (table_count > 0) {
+        f = LittleFS.open(TABLE_FILE);
+        f.seek(sizeof(NFCTagTableHeader), SeekMode::SeekSet);
+    }
+
+    NFCTagTableEntry block[BLOCK_ENTRIES];
+    size_t block_len = 0;
+    size_t block_pos = 0;
+    size_t table_read = 0;
+
+    auto next_table_entry = [&]() -> const NFCTagTableEntry * {
+        if (block_pos == block_len) {
+            size_t n = std::min((size_t)BLOCK_ENTRIES, table_count - table_read);
+            if (n == 0 || f.read((uint8_t *)block, n * sizeof(NFCTagTableEntry)) != n * sizeof(NFCTagTableEntry))
+                return nullptr;
+
+            table_read += n;
+            block_len = n;
+            block_pos = 0;
+        }
+
+        return &block[block_pos++];
+    };
+
+    const NFCTagTableEntry *table_entry = next_table_entry();
+    size_t c = 0;
+
+    while (table_entry != nullptr || c < changes.size()) {
+        int cmp;
+        if (table_entry == nullptr)
+            cmp = 1;
+        else if (c == changes.size())
+            cmp = -1;
+        else
+            cmp = compare_keys(*table_entry, changes[c]);
+
+        if (cmp < 0) {
+            if (!fn(*table_entry))
+                return;
+
+            table_entry = next_table_entry();
+            continue;
+        }
+
+        if ((changes[c].flags & NFC_TAG_TABLE_FLAG_REMOVED) == 0 && !fn(changes[c]))
+            return;
+
+        // The change replaces the entry of the table.
+        if (cmp == 0)
+            table_entry = next_table_entry();
+
+        ++c;
+    }
+}
+
+bool NFCTagTable::compact(int remove_user_id)
+{
+    if (LittleFS.exists(TABLE_TMP_FILE))
+        LittleFS.remove(TABLE_TMP_FILE);
+
+    File out = LittleFS.open(TABLE_TMP_FILE, "w");
+
+    NFCTagTableEntry block[BLOCK_ENTRIES];
+    size_t block_len = 0;
+    size_t written = 0;
+    bool ok = write_header(out, generation + 1);
+
+    auto flush = [&]() {
+        size_t len = block_len * sizeof(NFCTagTableEntry);
+        ok = out.write((const uint8_t *)block, len) == len;
+        written += block_len;
+        block_len = 0;
+    };
+
+    merge([&](const NFCTagTableEntry &entry) {
+        if (!ok)
+            return false;
+
+        NFCTagTableEntry &copy = block[block_len++];
+        copy = entry;
+        copy.flags = 0;
+        if (remove_user_id >= 0 && copy.user_id == remove_user_id)
+            copy.user_id = 0;
+
+        if (block_len == BLOCK_ENTRIES)
+            flush();
+
+        return ok;
+    });
+
+    if (ok && block_len > 0)
+        flush();
+
+    out.close();
+
+    if (!ok) {
+        logger.printfln("Failed to write NFC tag table");
+        LittleFS.remove(TABLE_TMP_FILE);
+        return false;
+    }
+
+    if (LittleFS.exists(TABLE_FILE))
+        LittleFS.remove(TABLE_FILE);
+    LittleFS.rename(TABLE_TMP_FILE, TABLE_FILE);
+    // If this is interrupted, setup ignores the log because its generation is older than the table's.
+    LittleFS.remove(LOG_FILE);
+
+    ++generation;
+    log.clear();
+    table_count = written;
+    tag_count = written;
+    return true;
+}
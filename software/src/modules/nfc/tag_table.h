@@ -0,0 +1,115 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NFC_TAG_TABLE_ID_LENGTH 10
+
+#define NFC_TAG_TABLE_MAX_TAGS 8192
+// Changes kept in the change log before they are merged into the table.
+#define NFC_TAG_TABLE_LOG_SIZE 64
+
+#define NFC_TAG_TABLE_FOLDER "/nfc"
+
+#define NFC_TAG_TABLE_FLAG_REMOVED 0x01
+
+struct NFCTagTableEntry {
+    // The first NFC_TAG_TABLE_KEY_LENGTH bytes are the key the table is sorted by.
+    uint8_t tag_type;
+    uint8_t tag_id_len;
+    uint8_t tag_id[NFC_TAG_TABLE_ID_LENGTH]; // zero padded
+    uint8_t user_id;
+    uint8_t flags; // NFC_TAG_TABLE_FLAG_*, only used in the change log
+    uint8_t reserved[2];
+} __attribute__((packed));
+
+#define NFC_TAG_TABLE_KEY_LENGTH (2 + NFC_TAG_TABLE_ID_LENGTH)
+
+static_assert(sizeof(NFCTagTableEntry) == 16, "Unexpected size of NFCTagTableEntry");
+
+#define NFC_TAG_TABLE_MAGIC 0x4C42544E // "NTBL"
+
+// Starts the table file and the change log file. The log is written for the
+// generation of the table. Every rewrite of the table increments the
+// generation, so a log of an older generation is already part of the table.
+struct NFCTagTableHeader {
+    uint32_t magic;
+    uint32_t generation;
+    uint8_t reserved[8];
+} __attribute__((packed));
+
+static_assert(sizeof(NFCTagTableHeader) == sizeof(NFCTagTableEntry), "Header and entries of the NFC tag table have different sizes");
+
+// Authorized tags that are stored in the flash instead of the NFC config.
+//
+// The tags are kept in a file of entries sorted by key, so a lookup is a
+// binary search over the file. Adding or removing a tag appends one entry
+// to a change log that is also kept in RAM. When the log is full it is
+// merged into the table, which rewrites the table once per
+// NFC_TAG_TABLE_LOG_SIZE changes. Only the change log uses RAM.
+class NFCTagTable
+{
+public:
+    NFCTagTable() {}
+
+    void setup();
+
+    // key only needs the key fields. Returns false if the tag is not in the table.
+    bool find(const NFCTagTableEntry &key, NFCTagTableEntry *entry);
+
+    // Adds the tag or changes the user of a tag that is already in the table.
+    String add(const NFCTagTableEntry &entry);
+    String remove(const NFCTagTableEntry &key);
+
+    // Assigns all tags of this user to user 0.
+    void remove_user(uint8_t user_id);
+
+    // Appends up to count tags in key order to page, starting with the tag at position offset.
+    void read_page(size_t offset, size_t count, std::vector<NFCTagTableEntry> *page);
+
+    size_t count() { return tag_count; }
+
+private:
+    bool lookup(const NFCTagTableEntry &key, NFCTagTableEntry *entry);
+    bool find_in_table(const NFCTagTableEntry &key, NFCTagTableEntry *entry);
+    bool append_to_log(const NFCTagTableEntry &entry);
+
+    // Calls fn for every tag of the table with the changes of the log applied, in key order.
+    // Stops if fn returns false.
+    void merge(std::function<bool(const NFCTagTableEntry &)> fn);
+    // Rewrites the table with the changes of the log applied. Tags of remove_user_id (if not -1) are assigned to user 0.
+    bool compact(int remove_user_id);
+
+    std::mutex mutex;
+
+    std::vector<NFCTagTableEntry> log;
+    uint32_t generation = 0;
+    size_t table_count = 0;
+    size_t tag_count = 0;
+    bool ready = false;
+};
@@ -192,11 +192,13 @@ EVSEState platform_get_evse_state(int32_t connectorId) {
 
 // This is the Energy.Active.Import.Register measurand in Wh
 int32_t platform_get_energy(int32_t connectorId) {
-    Config *meter_values = api.getState("meter/values", false);
-    if (meter_values == nullptr)
-        return 0;
-
-    return (int32_t)(meter_values->get("energy_abs")->asFloat() * 1000);
+#if MODULE_METER_AVAILABLE()
+    MeterSnapshot snapshot;
+    meter.getSnapshot(&snapshot);
+    return (int32_t)(snapshot.energy_abs * 1000);
+#else
+    return 0;
+#endif
 }
 
 bool platform_get_signed_meter_value(int32_t connectorId, SampledValueMeasurand measurand, SampledValuePhase phase, SampledValueLocation location, char buf[OCPP_PLATFORM_MEASURAND_MAX_DATA_LEN]){
@@ -319,47 +321,57 @@ const SupportedMeasurand *platform_get_supported_measurands(int32_t connector_id
     return supported_measurands + supported_measurand_offsets[(size_t)measurand];
 }
 
+#if MODULE_METER_AVAILABLE()
+static float all_value(const MeterSnapshot &snapshot, size_t idx)
+{
+    return idx < METER_ALL_VALUES_COUNT ? snapshot.all_values[idx] : 0.0f;
+}
+#endif
+
 float platform_get_raw_meter_value(int32_t connectorId, SampledValueMeasurand measurand, SampledValuePhase phase, SampledValueLocation location) {
     if (connectorId != 1)
         return 0.0f;
 
-    Config *meter_all_values = api.getState("meter/all_values");
-    if (meter_all_values == nullptr)
-        return 0.0f;
+#if !MODULE_METER_AVAILABLE()
+    return 0.0f;
+#else
+    // One consistent copy of all values, read without going through the config tree.
+    MeterSnapshot snapshot;
+    meter.getSnapshot(&snapshot);
 
     switch(measurand) {
         case SampledValueMeasurand::ENERGY_ACTIVE_EXPORT_REGISTER:
-            return meter_all_values->get(70 + (size_t) phase)->asFloat();
+            return all_value(snapshot, 70 + (size_t) phase);
         case SampledValueMeasurand::ENERGY_ACTIVE_IMPORT_REGISTER:
-            return meter_all_values->get(67 + (size_t) phase)->asFloat();
+            return all_value(snapshot, 67 + (size_t) phase);
         case SampledValueMeasurand::ENERGY_REACTIVE_EXPORT_REGISTER:
-            return meter_all_values->get(79 + (size_t) phase)->asFloat();
+            return all_value(snapshot, 79 + (size_t) phase);
         case SampledValueMeasurand::ENERGY_REACTIVE_IMPORT_REGISTER:
-            return meter_all_values->get(76 + (size_t) phase)->asFloat();
+            return all_value(snapshot, 76 + (size_t) phase);
 
         case SampledValueMeasurand::POWER_ACTIVE_EXPORT:
             // The power factor's sign indicates the direction of the current flow.
-            return meter_all_values->get(15 + (size_t) phase)->asFloat() < 0 ?
-                   meter_all_values->get(6 + (size_t) phase)->asFloat() :
+            return all_value(snapshot, 15 + (size_t) phase) < 0 ?
+                   all_value(snapshot, 6 + (size_t) phase) :
                    0.0f;
         case SampledValueMeasurand::POWER_ACTIVE_IMPORT:
-            return meter_all_values->get(15 + (size_t) phase)->asFloat() >= 0 ?
-                   meter_all_values->get(6 + (size_t) phase)->asFloat() :
+            return all_value(snapshot, 15 + (size_t) phase) >= 0 ?
+                   all_value(snapshot, 6 + (size_t) phase) :
                    0.0f;
         case SampledValueMeasurand::POWER_REACTIVE_EXPORT:
-            return meter_all_values->get(15 + (size_t) phase)->asFloat() >= 0 ?
-                   meter_all_values->get(12 + (size_t) phase)->asFloat() :
+            return all_value(snapshot, 15 + (size_t) phase) >= 0 ?
+                   all_value(snapshot, 12 + (size_t) phase) :
                    0.0f;
         case SampledValueMeasurand::POWER_REACTIVE_IMPORT:
-            return meter_all_values->get(15 + (size_t) phase)->asFloat() >= 0 ?
-                   meter_all_values->get(12 + (size_t) phase)->asFloat() :
+            return all_value(snapshot, 15 + (size_t) phase) >= 0 ?
+                   all_value(snapshot, 12 + (size_t) phase) :
                    0.0f;
 
         case SampledValueMeasurand::POWER_FACTOR:
-            return fabs(meter_all_values->get(15 + (size_t) phase)->asFloat());
+            return fabs(all_value(snapshot, 15 + (size_t) phase));
 
         case SampledValueMeasurand::CURRENT_OFFERED:
-            return api.getState("meter/phases")->get("phases_connected")->get((size_t) phase)->asBool() ?
+            return (size_t) phase < 3 && snapshot.phases_connected[(size_t) phase] ?
                    ((float)api.getState("evse/state")->get("allowed_charging_current")->asUint()) / 1000.0f :
                    0.0f;
         case SampledValueMeasurand::VOLTAGE:
@@ -367,12 +379,12 @@ float platform_get_raw_meter_value(int32_t connectorId, SampledValueMeasurand me
                 case SampledValuePhase::L1_N:
                 case SampledValuePhase::L2_N:
                 case SampledValuePhase::L3_N:
-                    return meter_all_values->get(0 + (size_t) phase)->asFloat();
+                    return all_value(snapshot, 0 + (size_t) phase);
 
                 case SampledValuePhase::L1_L2:
                 case SampledValuePhase::L2_L3:
                 case SampledValuePhase::L3_L1:
-                    return meter_all_values->get(42 + (size_t) phase)->asFloat();
+                    return all_value(snapshot, 42 + (size_t) phase);
 
                 case SampledValuePhase::L1:
                 case SampledValuePhase::L2:
@@ -382,7 +394,7 @@ float platform_get_raw_meter_value(int32_t connectorId, SampledValueMeasurand me
                     return 0.0f;
             }
         case SampledValueMeasurand::FREQUENCY:
-            return meter_all_values->get(29 + (size_t) phase)->asFloat();
+            return all_value(snapshot, 29 + (size_t) phase);
 
         case SampledValueMeasurand::ENERGY_ACTIVE_EXPORT_INTERVAL:
         case SampledValueMeasurand::ENERGY_ACTIVE_IMPORT_INTERVAL:
@@ -398,6 +410,7 @@ float platform_get_raw_meter_value(int32_t connectorId, SampledValueMeasurand me
             return 0.0f;
     }
     return 0.0f;
+#endif
 }
 
 void platform_lock_cable(int32_t connectorId)
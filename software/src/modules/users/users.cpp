@@ -33,7 +33,6 @@
 #define USERNAME_LENGTH 32
 #define DISPLAY_NAME_LENGTH 32
 #define USERNAME_ENTRY_LENGTH (USERNAME_LENGTH + DISPLAY_NAME_LENGTH)
-#define MAX_PASSIVE_USERS 256
 #define USERNAME_FILE "/users/all_usernames"
 
 #if MODULE_ESP32_ETHERNET_BRICK_AVAILABLE()
@@ -122,9 +121,10 @@ void set_user_current(uint16_t current)
 
 float get_energy()
 {
-    bool meter_avail = meter.state.get("state")->asUint() == 2;
+    MeterSnapshot snapshot;
+    meter.getSnapshot(&snapshot);
     // If for some reason we decide to use energy_rel here, also update the energy_this_charge calculation in modbus_tcp.cpp
-    return !meter_avail ? NAN : meter.values.get("energy_abs")->asFloat();
+    return !snapshot.available ? NAN : snapshot.energy_abs;
 }
 
 #define USER_SLOT_INFO_VERSION 1
@@ -191,8 +191,6 @@ bool read_user_slot_info(UserSlotInfo *result)
     return result->version == USER_SLOT_INFO_VERSION;
 }
 
-volatile bool user_api_blocked = false;
-
 void Users::pre_setup()
 {
     user_config = Config::Object({
@@ -229,70 +227,46 @@ void Users::pre_setup()
         {"display_name", Config::Str("", 0, USERNAME_LENGTH)},
         {"username", Config::Str("", 0, USERNAME_LENGTH)},
         {"digest_hash", Config::Str("", 0, 32)},
+        {"token", Config::Uint32(0)},
     }), [this](Config &add) -> String {
-        if (user_api_blocked) {
-            for(int i = 0; i < 50; ++i) {
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-                if (!user_api_blocked)
-                    break;
-            }
-            if (user_api_blocked)
-                return "Still applying the last operation. Please retry.";
-        }
-
-        if (user_config.get("next_user_id")->asUint() == 0)
-            return "Can't add user. All user IDs in use.";
-
-        if (add.get("id")->asUint() != user_config.get("next_user_id")->asUint())
-            return "Can't add user. Wrong next user ID";
-
-        if (user_config.get("users")->count() == MAX_ACTIVE_USERS)
-            return "Can't add user. Already have the maximum number of active users.";
-
-        for(int i = 0; i < user_config.get("users")->count(); ++i)
-            if (user_config.get("users")->get(i)->get("username")->asString() == add.get("username")->asString())
-                return "Can't add user. A user with this username already exists.";
-
-        {
-            char username[33] = {0};
-            File f = LittleFS.open(USERNAME_FILE, "r");
-            for(size_t i = 0; i < f.size(); i += USERNAME_ENTRY_LENGTH) {
-                f.seek(i);
-                f.read((uint8_t *) username, USERNAME_LENGTH);
-                if (add.get("username")->asString() == username)
-                    return "Can't add user. A user with this username already has tracked charges.";
-            }
-        }
-
-        user_api_blocked = true;
-        return "";
+        UserOperation op;
+        op.type = USER_OPERATION_ADD;
+        op.token = add.get("token")->asUint();
+        op.user_id = add.get("id")->asUint();
+        op.fields = USER_FIELD_ROLES | USER_FIELD_CURRENT | USER_FIELD_DISPLAY_NAME | USER_FIELD_USERNAME | USER_FIELD_DIGEST_HASH;
+        op.roles = add.get("roles")->asUint();
+        op.current = add.get("current")->asUint();
+        op.display_name = add.get("display_name")->asString();
+        op.username = add.get("username")->asString();
+        op.digest_hash = add.get("digest_hash")->asString();
+
+        return queue_operation(op);
     });
     add.permit_null_updates = false;
 
     remove = ConfigRoot(Config::Object({
-        {"id", Config::Uint8(0)}
+        {"id", Config::Uint8(0)},
+        {"token", Config::Uint32(0)}
     }), [this](Config &remove) -> String {
-        if (user_api_blocked) {
-            for (int i = 0; i < 50; ++i) {
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-                if (!user_api_blocked)
-                    break;
-            }
-            if (user_api_blocked)
-                return "Still applying the last operation. Please retry.";
-        }
+        UserOperation op;
+        op.type = USER_OPERATION_REMOVE;
+        op.token = remove.get("token")->asUint();
+        op.user_id = remove.get("id")->asUint();
+        op.fields = 0;
 
-        if (remove.get("id")->asUint() == 0)
-            return "The anonymous user can't be removed.";
-
-        for (int i = 0; i < user_config.get("users")->count(); ++i) {
-            if (user_config.get("users")->get(i)->get("id")->asUint() == remove.get("id")->asUint()) {
-                user_api_blocked = true;
-                return "";
-            }
-        }
+        return queue_operation(op);
+    });
 
-        return "Can't remove user. User with this ID not found.";
+    operations = Config::Object({
+        {"pending", Config::Uint8(0)},
+        {"results", Config::Array({},
+            new Config{Config::Object({
+                {"id", Config::Uint32(0)},
+                {"token", Config::Uint32(0)},
+                {"type", Config::Uint8(0)},
+                {"user_id", Config::Uint8(0)},
+                {"error", Config::Str("", 0, 96)}
+            })}, 0, USER_OPERATION_RESULTS, Config::type_id<Config::ConfObject>())}
     });
 
     http_auth_update = ConfigRoot(Config::Object({
@@ -324,8 +298,11 @@ void Users::setup()
 {
     api.restorePersistentConfig("users/config", &user_config);
 
-    if (!LittleFS.exists(USERNAME_FILE)) {
+    if (LittleFS.exists(USERNAME_FILE)) {
+        build_username_index();
+    } else {
         logger.printfln("Username list does not exist! Recreating now.");
+        clear_username_index();
         create_username_file();
         for (int i = 0; i < user_config.get("users")->count(); ++i) {
             Config *user = (Config *)user_config.get("users")->get(i);
@@ -419,12 +396,14 @@ void Users::setup()
                 return false;
             }
 
-            auth = auth.substring(7);
-            AuthFields fields = parseDigestAuth(auth.c_str());
+            // Parsed in place after the "Digest " prefix.
+            AuthFields fields = parseDigestAuth(auth.begin() + 7);
+            if (!fields.success)
+                return false;
 
             for (int i = 0; i < user_config.get("users")->count(); ++i) {
                 if (user_config.get("users")->get(i)->get("username")->asString().equals(fields.username))
-                    return checkDigestAuthentication(fields, req.methodString(), fields.username.c_str(), user_config.get("users")->get(i)->get("digest_hash")->asEphemeralCStr(), nullptr, true, nullptr, nullptr, nullptr); // use of emphemeral C string ok
+                    return checkDigestAuthentication(fields, req.methodString(), fields.username, user_config.get("users")->get(i)->get("digest_hash")->asEphemeralCStr(), nullptr, true, nullptr, nullptr, nullptr); // use of emphemeral C string ok
             }
 
             return false;
@@ -439,14 +418,11 @@ void Users::search_next_free_user() {
     uint8_t start_uid = user_id;
     user_id++;
     {
-        File f = LittleFS.open(USERNAME_FILE, "r+");
+        std::lock_guard<std::mutex> lock{username_index_mutex};
         while(start_uid != user_id) {
             if (user_id == 0)
                 user_id++;
-            f.seek(user_id * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
-            char user_name_byte = 0;
-            f.readBytes(&user_name_byte, 1);
-            if (user_name_byte == '\0')
+            if ((used_user_ids[user_id / 32] & (1u << (user_id % 32))) == 0)
                 break;
             user_id++;
         };
@@ -468,18 +444,7 @@ void Users::register_urls()
     }
 
     api.addRawCommand("users/modify", [this](char *c, size_t s) -> String {
-        if (user_api_blocked) {
-            for(int i = 0; i < 50; ++i) {
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-                if (!user_api_blocked)
-                    break;
-            }
-            if (user_api_blocked)
-                return "Still applying the last operation. Please retry.";
-        }
-        user_api_blocked = true;
-
-        StaticJsonDocument<96> doc;
+        StaticJsonDocument<112> doc;
 
         DeserializationError error = deserializeJson(doc, c, s);
 
@@ -502,154 +467,317 @@ void Users::register_urls()
                 return String("Digest_hash needs to be empty.");
         }
 
-        Config *user = nullptr;
-        for(int i = 0; i < user_config.get("users")->count(); ++i) {
-            if (user_config.get("users")->get(i)->get("id")->asUint() == id) {
-                user = (Config *)user_config.get("users")->get(i);
-                break;
-            }
-        }
+        UserOperation op;
+        op.type = USER_OPERATION_MODIFY;
+        op.user_id = id;
+        op.token = doc["token"].as<uint32_t>();
+        op.fields = 0;
 
-        if (user == nullptr) {
-            return "Can't modify user. User with this ID not found.";
+        if (doc["roles"] != nullptr) {
+            op.fields |= USER_FIELD_ROLES;
+            op.roles = doc["roles"].as<uint32_t>();
+        }
+        if (doc["current"] != nullptr) {
+            op.fields |= USER_FIELD_CURRENT;
+            op.current = doc["current"].as<uint16_t>();
+        }
+        if (doc["display_name"] != nullptr) {
+            op.fields |= USER_FIELD_DISPLAY_NAME;
+            op.display_name = doc["display_name"].as<String>();
+        }
+        if (doc["username"] != nullptr) {
+            op.fields |= USER_FIELD_USERNAME;
+            op.username = doc["username"].as<String>();
         }
+        if (doc["digest_hash"] != nullptr) {
+            op.fields |= USER_FIELD_DIGEST_HASH;
+            op.digest_hash = doc["digest_hash"].as<String>();
+        }
+
+        String err = queue_operation(op);
+        if (err != "")
+            return err;
 
-        for(int i = 0; i < user_config.get("users")->count(); ++i) {
-            if (user_config.get("users")->get(i)->get("id")->asUint() == id)
-                continue;
+        task_scheduler.scheduleOnce([this](){
+            this->process_operations();
+        }, 0);
 
-            if (user_config.get("users")->get(i)->get("username")->asString() == doc["username"]) {
-                return "Can't modify user. Another user with the same username already exists.";
-            }
+        return "";
+    }, true);
+
+    api.addState("users/config", &user_config, {"digest_hash"}, 1000);
+    api.addState("users/operations", &operations, {}, 1000);
+
+    // The operations are queued by the validators.
+    api.addCommand("users/add", &add, {"digest_hash"}, [this](){
+        this->process_operations();
+    }, true);
+
+    api.addCommand("users/remove", &remove, {}, [this](){
+        this->process_operations();
+    }, true);
+
+
+    api.addCommand("users/http_auth_update", &http_auth_update, {}, [this](){
+        bool enable = http_auth_update.get("enabled")->asBool();
+        if (!enable)
+            server.setAuthentication([](WebServerRequest req){return true;});
+
+        user_config.get("http_auth_enabled")->updateBool(enable);
+        API::writeConfig("users/config", &user_config);
+    }, false);
+
+    server.on("/users/all_usernames", HTTP_GET, [this](WebServerRequest request) {
+        //std::lock_guard<std::mutex> lock{records_mutex};
+        size_t len = MAX_PASSIVE_USERS * USERNAME_ENTRY_LENGTH;
+        auto buf = std::unique_ptr<char[]>(new char[len]);
+        if (buf == nullptr) {
+            return request.send(507);
         }
 
-        char username[33] = {0};
         File f = LittleFS.open(USERNAME_FILE, "r");
-        for(size_t i = 0; i < f.size(); i += USERNAME_ENTRY_LENGTH) {
-            if ((i / USERNAME_ENTRY_LENGTH) == id)
-                continue;
 
-            f.seek(i);
-            f.read((uint8_t *) username, USERNAME_LENGTH);
-            if (doc["username"].as<String>() == username)
-                return "Can't modify user. A user with this username already has tracked charges.";
+        size_t read = f.read((uint8_t *)buf.get(), len);
+        return request.send(200, "application/octet-stream", buf.get(), read);
+    });
+}
+
+String Users::check_operation(const UserOperation &op)
+{
+    Config *users = (Config *)user_config.get("users");
+
+    Config *user = nullptr;
+    for (int i = 0; i < users->count(); ++i) {
+        if (users->get(i)->get("id")->asUint() == op.user_id) {
+            user = (Config *)users->get(i);
+            break;
         }
+    }
 
-        if (doc["roles"] != nullptr)
-            user->get("roles")->updateUint((uint32_t) doc["roles"]);
+    switch (op.type) {
+        case USER_OPERATION_ADD:
+            if (user_config.get("next_user_id")->asUint() == 0)
+                return "Can't add user. All user IDs in use.";
 
-        bool display_name_changed = false;
-        if (doc["display_name"] != nullptr)
-            display_name_changed = user->get("display_name")->updateString(doc["display_name"]);
+            if (op.user_id != user_config.get("next_user_id")->asUint())
+                return "Can't add user. Wrong next user ID";
 
-        bool username_changed = false;
-        if (doc["username"] != nullptr)
-            username_changed = user->get("username")->updateString(doc["username"]);
+            if (users->count() == MAX_ACTIVE_USERS)
+                return "Can't add user. Already have the maximum number of active users.";
 
-        if (doc["current"] != nullptr)
-            user->get("current")->updateUint((uint32_t) doc["current"]);
+            for (int i = 0; i < users->count(); ++i)
+                if (users->get(i)->get("username")->asString() == op.username)
+                    return "Can't add user. A user with this username already exists.";
 
-        if (doc["digest_hash"] != nullptr)
-            user->get("digest_hash")->updateString(doc["digest_hash"]);
+            if (find_username(op.username) >= 0)
+                return "Can't add user. A user with this username already has tracked charges.";
+            break;
 
-        String err = this->user_config.validate();
-        if (err != "")
-            return err;
+        case USER_OPERATION_REMOVE:
+            if (op.user_id == 0)
+                return "The anonymous user can't be removed.";
 
-        task_scheduler.scheduleOnce([this, display_name_changed, username_changed, user](){
-            API::writeConfig("users/config", &user_config);
+            if (user == nullptr)
+                return "Can't remove user. User with this ID not found.";
+            break;
 
-            if (display_name_changed || username_changed)
-                this->rename_user(user->get("id")->asUint(), user->get("username")->asString(), user->get("display_name")->asString());
+        case USER_OPERATION_MODIFY:
+            if (user == nullptr)
+                return "Can't modify user. User with this ID not found.";
 
-            user_api_blocked = false;
-        }, 0);
+            if ((op.fields & USER_FIELD_USERNAME) == 0)
+                break;
 
-        return "";
-    }, true);
+            for (int i = 0; i < users->count(); ++i) {
+                if (users->get(i) == user)
+                    continue;
 
-    api.addState("users/config", &user_config, {"digest_hash"}, 1000);
-    api.addCommand("users/add", &add, {"digest_hash"}, [this](){
-        user_config.get("users")->add();
-        Config *user = (Config *)user_config.get("users")->get(user_config.get("users")->count() - 1);
+                if (users->get(i)->get("username")->asString() == op.username)
+                    return "Can't modify user. Another user with the same username already exists.";
+            }
 
-        user->get("id")->updateUint(add.get("id")->asUint());
-        user->get("roles")->updateUint(add.get("roles")->asUint());
-        user->get("current")->updateUint(add.get("current")->asUint());
-        user->get("display_name")->updateString(add.get("display_name")->asString());
-        user->get("username")->updateString(add.get("username")->asString());
-        user->get("digest_hash")->updateString(add.get("digest_hash")->asString());
+            if (find_username(op.username, op.user_id) >= 0)
+                return "Can't modify user. A user with this username already has tracked charges.";
+            break;
 
-        search_next_free_user();
+        default:
+            return "Unknown user operation.";
+    }
 
-        API::writeConfig("users/config", &user_config);
-        this->rename_user(user->get("id")->asUint(), user->get("username")->asString(), user->get("display_name")->asString());
-        user_api_blocked = false;
-    }, true);
+    return "";
+}
 
-    api.addCommand("users/remove", &remove, {}, [this](){
-        int idx = -1;
-        for(int i = 0; i < user_config.get("users")->count(); ++i) {
-            if (user_config.get("users")->get(i)->get("id")->asUint() == remove.get("id")->asUint()) {
-                idx = i;
+String Users::queue_operation(UserOperation &op)
+{
+    // Checks against the users are done by apply_operation only: Operations still
+    // in the queue can change the users until this operation is applied.
+    // The result of those checks is published in users/operations.
+    if (op.type == USER_OPERATION_REMOVE && op.user_id == 0)
+        return "The anonymous user can't be removed.";
+
+    {
+        std::lock_guard<std::mutex> lock{operations_mutex};
+        if (pending_operations.size() >= USER_OPERATION_QUEUE_SIZE)
+            return "Too many pending user operations. Please retry.";
+
+        op.id = next_operation_id++;
+        pending_operations.push_back(op);
+    }
+
+    task_scheduler.scheduleOnce([this](){
+        this->publish_operations();
+    }, 0);
+
+    return "";
+}
+
+void Users::publish_operations()
+{
+    uint8_t pending;
+    {
+        std::lock_guard<std::mutex> lock{operations_mutex};
+        pending = pending_operations.size();
+    }
+
+    operations.get("pending")->updateUint(pending);
+}
+
+void Users::process_operations()
+{
+    for (;;) {
+        UserOperation op;
+        {
+            std::lock_guard<std::mutex> lock{operations_mutex};
+            if (pending_operations.empty())
                 break;
-            }
+
+            op = pending_operations.front();
+            pending_operations.pop_front();
         }
 
-        if (idx < 0) {
-            logger.printfln("Can't remove user. User with this ID not found.");
-            return;
+        publish_operations();
+
+        String error = apply_operation(op);
+        if (error != "")
+            logger.printfln("User operation %u failed: %s", op.id, error.c_str());
+
+        Config *results = (Config *)operations.get("results");
+        if (results->count() == USER_OPERATION_RESULTS)
+            results->remove(0);
+
+        results->add();
+        Config *result = (Config *)results->get(results->count() - 1);
+        result->get("id")->updateUint(op.id);
+        result->get("token")->updateUint(op.token);
+        result->get("type")->updateUint(op.type);
+        result->get("user_id")->updateUint(op.user_id);
+        result->get("error")->updateString(error);
+    }
+}
+
+String Users::apply_operation(const UserOperation &op)
+{
+    String err = check_operation(op);
+    if (err != "")
+        return err;
+
+    Config *users = (Config *)user_config.get("users");
+
+    if (op.type == USER_OPERATION_ADD) {
+        Config *user;
+        {
+            std::lock_guard<std::mutex> lock{user_config_mutex};
+            users->add();
+            user = (Config *)users->get(users->count() - 1);
+
+            user->get("id")->updateUint(op.user_id);
+            user->get("roles")->updateUint(op.roles);
+            user->get("current")->updateUint(op.current);
+            user->get("display_name")->updateString(op.display_name);
+            user->get("username")->updateString(op.username);
+            user->get("digest_hash")->updateString(op.digest_hash);
+
+            search_next_free_user();
+        }
+
+        API::writeConfig("users/config", &user_config);
+        this->rename_user(user->get("id")->asUint(), user->get("username")->asString(), user->get("display_name")->asString());
+        return "";
+    }
+
+    int idx = -1;
+    for (int i = 0; i < users->count(); ++i) {
+        if (users->get(i)->get("id")->asUint() == op.user_id) {
+            idx = i;
+            break;
         }
+    }
+    Config *user = (Config *)users->get(idx);
 
-        user_config.get("users")->remove(idx);
+    if (op.type == USER_OPERATION_REMOVE) {
+        {
+            std::lock_guard<std::mutex> lock{user_config_mutex};
+            users->remove(idx);
+        }
         API::writeConfig("users/config", &user_config);
 
         Config *tags = (Config *)nfc.config.get("authorized_tags");
 
         for(int i = 0; i < tags->count(); ++i) {
-            if(tags->get(i)->get("user_id")->asUint() == remove.get("id")->asUint())
+            if(tags->get(i)->get("user_id")->asUint() == op.user_id)
                 tags->get(i)->get("user_id")->updateUint(0);
         }
         API::writeConfig("nfc/config", &nfc.config);
+        nfc.tag_table.remove_user(op.user_id);
 
-        if (!charge_tracker.is_user_tracked(remove.get("id")->asUint()))
+        if (!charge_tracker.is_user_tracked(op.user_id))
         {
-            this->rename_user(remove.get("id")->asUint(), "", "");
+            this->rename_user(op.user_id, "", "");
             // If this user still has tracked charges, we can't recycle their ID, so it is correct
             // to check this here (and not one level up).
             if (user_config.get("next_user_id")->asUint() == 0)
             {
-                user_config.get("next_user_id")->updateUint(remove.get("id")->asUint());
+                user_config.get("next_user_id")->updateUint(op.user_id);
                 API::writeConfig("users/config", &user_config);
             }
         }
+        return "";
+    }
 
-        user_api_blocked = false;
-    }, true);
+    bool display_name_changed = false;
+    bool username_changed = false;
+    {
+        std::lock_guard<std::mutex> lock{user_config_mutex};
+        Config old_user = *user;
 
+        if (op.fields & USER_FIELD_ROLES)
+            user->get("roles")->updateUint(op.roles);
 
-    api.addCommand("users/http_auth_update", &http_auth_update, {}, [this](){
-        bool enable = http_auth_update.get("enabled")->asBool();
-        if (!enable)
-            server.setAuthentication([](WebServerRequest req){return true;});
+        if (op.fields & USER_FIELD_DISPLAY_NAME)
+            display_name_changed = user->get("display_name")->updateString(op.display_name);
 
-        user_config.get("http_auth_enabled")->updateBool(enable);
-        API::writeConfig("users/config", &user_config);
-    }, false);
+        if (op.fields & USER_FIELD_USERNAME)
+            username_changed = user->get("username")->updateString(op.username);
 
-    server.on("/users/all_usernames", HTTP_GET, [this](WebServerRequest request) {
-        //std::lock_guard<std::mutex> lock{records_mutex};
-        size_t len = MAX_PASSIVE_USERS * USERNAME_ENTRY_LENGTH;
-        auto buf = std::unique_ptr<char[]>(new char[len]);
-        if (buf == nullptr) {
-            return request.send(507);
+        if (op.fields & USER_FIELD_CURRENT)
+            user->get("current")->updateUint(op.current);
+
+        if (op.fields & USER_FIELD_DIGEST_HASH)
+            user->get("digest_hash")->updateString(op.digest_hash);
+
+        err = this->user_config.validate();
+        if (err != "") {
+            user->value = old_user.value;
+            return err;
         }
+    }
 
-        File f = LittleFS.open(USERNAME_FILE, "r");
+    API::writeConfig("users/config", &user_config);
 
-        size_t read = f.read((uint8_t *)buf.get(), len);
-        return request.send(200, "application/octet-stream", buf.get(), read);
-    });
+    if (display_name_changed || username_changed)
+        this->rename_user(user->get("id")->asUint(), user->get("username")->asString(), user->get("display_name")->asString());
+
+    return "";
 }
 
 void Users::loop()
@@ -661,6 +789,18 @@ uint8_t Users::next_user_id()
     return this->user_config.get("next_user_id")->asUint();
 }
 
+bool Users::is_user_configured(uint8_t user_id)
+{
+    std::lock_guard<std::mutex> lock{user_config_mutex};
+    Config *users = (Config *)user_config.get("users");
+
+    for (int i = 0; i < users->count(); ++i)
+        if (users->get(i)->get("id")->asUint() == user_id)
+            return true;
+
+    return false;
+}
+
 void Users::rename_user(uint8_t user_id, const String &username, const String &display_name)
 {
     char buf[USERNAME_ENTRY_LENGTH] = {0};
@@ -670,6 +810,109 @@ void Users::rename_user(uint8_t user_id, const String &username, const String &d
     File f = LittleFS.open(USERNAME_FILE, "r+");
     f.seek(user_id * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
     f.write((const uint8_t *)buf, USERNAME_ENTRY_LENGTH);
+
+    // Index what was written: Usernames are cut to USERNAME_LENGTH - 1 characters.
+    index_username(user_id, buf);
+}
+
+static uint32_t hash_username(const char *username)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = username; *c != '\0'; ++c) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void Users::clear_username_index()
+{
+    std::lock_guard<std::mutex> lock{username_index_mutex};
+
+    for (size_t i = 0; i < USERNAME_INDEX_BUCKETS; ++i)
+        username_buckets[i] = MAX_PASSIVE_USERS;
+
+    for (size_t i = 0; i < MAX_PASSIVE_USERS; ++i) {
+        username_hashes[i] = 0;
+        username_next[i] = MAX_PASSIVE_USERS;
+    }
+
+    memset(used_user_ids, 0, sizeof(used_user_ids));
+}
+
+void Users::build_username_index()
+{
+    clear_username_index();
+
+    size_t len = MAX_PASSIVE_USERS * USERNAME_ENTRY_LENGTH;
+    auto buf = std::unique_ptr<char[]>(new char[len]);
+
+    File f = LittleFS.open(USERNAME_FILE, "r");
+    size_t read = f.read((uint8_t *)buf.get(), len);
+
+    for (size_t user_id = 0; user_id < read / USERNAME_ENTRY_LENGTH; ++user_id) {
+        char *username = buf.get() + user_id * USERNAME_ENTRY_LENGTH;
+        username[USERNAME_LENGTH - 1] = '\0';
+        index_username(user_id, username);
+    }
+}
+
+void Users::index_username(uint8_t user_id, const char *username)
+{
+    std::lock_guard<std::mutex> lock{username_index_mutex};
+
+    if ((used_user_ids[user_id / 32] & (1u << (user_id % 32))) != 0) {
+        uint16_t *link = &username_buckets[username_hashes[user_id] % USERNAME_INDEX_BUCKETS];
+        while (*link != user_id)
+            link = &username_next[*link];
+        *link = username_next[user_id];
+
+        username_next[user_id] = MAX_PASSIVE_USERS;
+        username_hashes[user_id] = 0;
+        used_user_ids[user_id / 32] &= ~(1u << (user_id % 32));
+    }
+
+    if (username[0] == '\0')
+        return;
+
+    uint32_t hash = hash_username(username);
+    uint16_t *bucket = &username_buckets[hash % USERNAME_INDEX_BUCKETS];
+
+    username_hashes[user_id] = hash;
+    username_next[user_id] = *bucket;
+    *bucket = user_id;
+    used_user_ids[user_id / 32] |= (1u << (user_id % 32));
+}
+
+int Users::find_username(const String &username, int ignore_id)
+{
+    std::lock_guard<std::mutex> lock{username_index_mutex};
+
+    // Every free entry of the username file has an empty username.
+    if (username.length() == 0) {
+        for (int user_id = 0; user_id < MAX_PASSIVE_USERS; ++user_id)
+            if (user_id != ignore_id && (used_user_ids[user_id / 32] & (1u << (user_id % 32))) == 0)
+                return user_id;
+        return -1;
+    }
+
+    uint32_t hash = hash_username(username.c_str());
+
+    for (uint16_t user_id = username_buckets[hash % USERNAME_INDEX_BUCKETS]; user_id != MAX_PASSIVE_USERS; user_id = username_next[user_id]) {
+        if (user_id == ignore_id || username_hashes[user_id] != hash)
+            continue;
+
+        // Only read the entry back to rule out a hash collision.
+        char entry[USERNAME_LENGTH] = {0};
+        File f = LittleFS.open(USERNAME_FILE, "r");
+        f.seek(user_id * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
+        f.read((uint8_t *)entry, USERNAME_LENGTH - 1);
+        if (username == entry)
+            return user_id;
+    }
+
+    return -1;
 }
 
 void Users::remove_from_username_file(uint8_t user_id)
@@ -740,6 +983,8 @@ void Users::remove_username_file()
 {
     if (LittleFS.exists(USERNAME_FILE))
         LittleFS.remove(USERNAME_FILE);
+
+    clear_username_index();
 }
 
 bool Users::start_charging(uint8_t user_id, uint16_t current_limit, uint8_t auth_type, Config::ConfVariant auth_info)
@@ -21,6 +21,40 @@
 
 #include "config.h"
 
+#include <deque>
+#include <mutex>
+
+#define MAX_PASSIVE_USERS 256
+#define USERNAME_INDEX_BUCKETS 64
+
+#define USER_OPERATION_ADD 0
+#define USER_OPERATION_REMOVE 1
+#define USER_OPERATION_MODIFY 2
+
+#define USER_FIELD_ROLES (1 << 0)
+#define USER_FIELD_CURRENT (1 << 1)
+#define USER_FIELD_DISPLAY_NAME (1 << 2)
+#define USER_FIELD_USERNAME (1 << 3)
+#define USER_FIELD_DIGEST_HASH (1 << 4)
+
+#define USER_OPERATION_QUEUE_SIZE 8
+// Results of finished operations kept in users/operations
+#define USER_OPERATION_RESULTS 8
+
+// A change of the users requested via users/add, users/remove or users/modify.
+struct UserOperation {
+    uint32_t id;
+    uint32_t token; // Chosen by the requester, to find the result in users/operations. 0 if none.
+    uint8_t type; // USER_OPERATION_*
+    uint8_t user_id;
+    uint8_t fields; // USER_FIELD_* that are part of this operation
+    uint32_t roles;
+    uint16_t current;
+    String display_name;
+    String username;
+    String digest_hash;
+};
+
 class Users
 {
 public:
@@ -31,10 +65,16 @@ public:
     void loop();
 
     uint8_t next_user_id();
+    // Safe to call from any task.
+    bool is_user_configured(uint8_t user_id);
     void rename_user(uint8_t user_id, const String &username, const String &display_name);
     void remove_from_username_file(uint8_t user_id);
     void search_next_free_user();
 
+    // Returns the ID whose entry in the username file has this username or -1.
+    // The entry of ignore_id is skipped.
+    int find_username(const String &username, int ignore_id = -1);
+
     #define TRIGGER_CHARGE_ANY 0
     #define TRIGGER_CHARGE_START 1
     #define TRIGGER_CHARGE_STOP 2
@@ -49,7 +89,38 @@ public:
     ConfigRoot remove;
     ConfigRoot http_auth;
     ConfigRoot http_auth_update;
+    ConfigRoot operations;
 
     bool start_charging(uint8_t user_id, uint16_t current_limit, uint8_t auth_type, Config::ConfVariant auth_info);
     bool stop_charging(uint8_t user_id, bool force);
+
+    // Checks an operation against the current users. Called by apply_operation in the main loop,
+    // after all operations queued before this one were applied.
+    String check_operation(const UserOperation &op);
+    // Called by the validators. The operations are applied in order by process_operations in the main loop.
+    String queue_operation(UserOperation &op);
+    void process_operations();
+    // Publishes the number of pending operations. Runs in the main loop.
+    void publish_operations();
+    String apply_operation(const UserOperation &op);
+
+    std::deque<UserOperation> pending_operations;
+    std::mutex operations_mutex;
+    uint32_t next_operation_id = 1;
+
+    // Held while the list of users is changed in the main loop and
+    // while other tasks read it, see is_user_configured.
+    std::mutex user_config_mutex;
+
+    void clear_username_index();
+    void build_username_index();
+    void index_username(uint8_t user_id, const char *username);
+
+    // Index of the username file: The hash of the username of every used ID.
+    // Used IDs are chained per hash bucket, MAX_PASSIVE_USERS ends a chain.
+    uint32_t username_hashes[MAX_PASSIVE_USERS];
+    uint16_t username_buckets[USERNAME_INDEX_BUCKETS];
+    uint16_t username_next[MAX_PASSIVE_USERS];
+    uint32_t used_user_ids[MAX_PASSIVE_USERS / 32]; // one bit per ID with a non-empty username
+    std::mutex username_index_mutex;
 };
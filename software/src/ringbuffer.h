@@ -165,6 +165,68 @@ public:
         return true;
     }
 
+    // Copies up to count elements, starting with the element at offset, to out.
+    // Returns the number of copied elements. The buffer is walked in its
+    // contiguous parts, instead of locating every element on its own.
+    size_t peek_range(T *out, size_t offset, size_t count)
+    {
+        size_t available = used();
+        if (offset >= available) {
+            return 0;
+        }
+
+        if (count > available - offset) {
+            count = available - offset;
+        }
+
+        size_t idx = start + offset >= SIZE ? start + offset - SIZE : start + offset;
+        size_t copied = 0;
+
+        while (copied < count) {
+            size_t span = count - copied;
+            if (span > SIZE - idx) {
+                span = SIZE - idx;
+            }
+
+            read_span(out + copied, idx, span);
+            copied += span;
+            idx = 0;
+        }
+
+        return count;
+    }
+
+    void read_span(T *out, size_t idx, size_t count)
+    {
+        if (sizeof(T) == sizeof(AlignedT)) {
+            for (size_t i = 0; i < count; ++i) {
+                out[i] = buffer[idx + i];
+            }
+            return;
+        }
+
+        size_t items_per_slot = sizeof(AlignedT) / sizeof(T);
+        size_t buffer_idx = idx / items_per_slot;
+        size_t buffer_offset = idx % items_per_slot;
+
+        size_t item_bits = sizeof(T) * 8;
+        AlignedT bits = (AlignedT(1) << item_bits) - 1;
+        AlignedT slot = buffer[buffer_idx] >> (buffer_offset * item_bits);
+
+        for (size_t i = 0; i < count; ++i) {
+            if (buffer_offset == items_per_slot) {
+                // Only read the next slot if there are items left in it:
+                // The last slot is the end of the allocation.
+                slot = buffer[++buffer_idx];
+                buffer_offset = 0;
+            }
+
+            out[i] = slot & bits;
+            slot >>= item_bits;
+            ++buffer_offset;
+        }
+    }
+
     // index of first valid elemnt
     size_t start;
     // index of first invalid element
@@ -29,6 +29,7 @@
 
 #include "tools.h"
 
+#include <algorithm>
 #include <memory>
 
 #define MAX_URI_HANDLERS 128
@@ -367,6 +368,47 @@ WebServerRequestReturnProtect WebServerRequest::endChunkedResponse()
     return WebServerRequestReturnProtect{};
 }
 
+void WebServerChunkWriter::write(const char *s, size_t len)
+{
+    while (len > 0) {
+        if (used == sizeof(buf))
+            flush();
+
+        size_t to_copy = std::min(len, sizeof(buf) - used);
+        memcpy(buf + used, s, to_copy);
+        used += to_copy;
+        s += to_copy;
+        len -= to_copy;
+    }
+}
+
+void WebServerChunkWriter::writeInt(int32_t value)
+{
+    // Digits are produced from the back. 11 characters fit INT32_MIN.
+    char digits[11];
+    char *p = digits + sizeof(digits);
+    uint32_t u = value < 0 ? -(uint32_t)value : (uint32_t)value;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    if (value < 0)
+        *--p = '-';
+
+    write(p, digits + sizeof(digits) - p);
+}
+
+void WebServerChunkWriter::flush()
+{
+    if (used == 0)
+        return;
+
+    request->sendChunk(buf, used);
+    used = 0;
+}
+
 void WebServerRequest::addResponseHeader(const char *field, const char *value)
 {
     auto result = httpd_resp_set_hdr(req, field, value);
@@ -401,6 +443,19 @@ String WebServerRequest::header(const char *header_name)
     return result;
 }
 
+bool WebServerRequest::queryValue(const char *key, char *buf, size_t buf_len)
+{
+    size_t query_len = httpd_req_get_url_query_len(req);
+    if (query_len == 0)
+        return false;
+
+    std::unique_ptr<char[]> query{new char[query_len + 1]};
+    if (httpd_req_get_url_query_str(req, query.get(), query_len + 1) != ESP_OK)
+        return false;
+
+    return httpd_query_key_value(query.get(), key, buf, buf_len) == ESP_OK;
+}
+
 size_t WebServerRequest::contentLength()
 {
     return req->content_len;
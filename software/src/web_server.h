@@ -51,6 +51,10 @@ public:
 
     String header(const char *header_name);
 
+    // Copies the value of key in the query string to buf.
+    // Returns false if the URI has no such key or the value does not fit into buf.
+    bool queryValue(const char *key, char *buf, size_t buf_len);
+
     size_t contentLength();
 
     char *receive();
@@ -90,6 +94,43 @@ private:
     httpd_req_t *req;
 };
 
+#define CHUNK_WRITER_BUF_SIZE 512
+
+// Collects the small pieces of a chunked response and sends them in chunks
+// of up to CHUNK_WRITER_BUF_SIZE bytes. The response needs only this buffer,
+// no matter how long it is. beginChunkedResponse has to be called first,
+// flush before endChunkedResponse.
+class WebServerChunkWriter
+{
+public:
+    WebServerChunkWriter(WebServerRequest *request) : request(request)
+    {
+    }
+
+    void write(const char *s, size_t len);
+
+    void write(const char *s)
+    {
+        write(s, strlen(s));
+    }
+
+    void write(char c)
+    {
+        if (used == sizeof(buf))
+            flush();
+        buf[used++] = c;
+    }
+
+    void writeInt(int32_t value);
+
+    void flush();
+
+private:
+    WebServerRequest *request;
+    char buf[CHUNK_WRITER_BUF_SIZE];
+    size_t used = 0;
+};
+
 using wshCallback = std::function<WebServerRequestReturnProtect(WebServerRequest)>;
 using wshUploadCallback = std::function<bool(WebServerRequest request, String filename, size_t index, uint8_t *data, size_t len, bool final)>;
 
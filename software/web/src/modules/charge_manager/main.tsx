@@ -42,7 +42,10 @@ type ChargeManagerConfig = API.getType['charge_manager/config'];
 type ChargerConfig = ChargeManagerConfig["chargers"][0];
 type ScanCharger = Exclude<API.getType['charge_manager/scan_result'], string>[0];
 
-const MAX_CONTROLLED_CHARGERS = 10;
+// Keep in sync with MAX_CLIENTS in cm_networking.h
+function max_controlled_chargers() {
+    return API.hasModule("esp32_ethernet_brick") ? 64 : 10;
+}
 
 let charger_add_symbol = <svg xmlns="http://www.w3.org/2000/svg" width="24" height="24" viewBox="0 0 24 24" fill="none" stroke="currentColor" stroke-width="2" stroke-linecap="round" stroke-linejoin="round" class="feather feather-server" style=""><rect x="2" y="14" width="20" height="8" rx="2" ry="2"></rect><line y1="18" y2="18" x1="18" x2="18.01"></line><line x1="19" x2="19" y1="3" y2="9"></line><line x1="22" x2="16" y1="6" y2="6"></line></svg>
 let charger_delete_symbol = <svg xmlns="http://www.w3.org/2000/svg" width="24" height="24" viewBox="0 0 24 24" fill="none" stroke="currentColor" stroke-width="2" stroke-linecap="round" stroke-linejoin="round" class="feather feather-server mr-2" style=""><rect x="2" y="14" width="20" height="8" rx="2" ry="2"></rect><line y1="18" y2="18" x1="18" x2="18.01"></line><line x1="17" x2="22" y1="4" y2="9"></line><line x1="22" x2="17" y1="4" y2="9"></line></svg>
@@ -188,8 +191,8 @@ export class ChargeManager extends ConfigComponent<'charge_manager/config', {},
                     </Button>
                 </div>
                 <Card.Body>
-                    {state.chargers.length >= MAX_CONTROLLED_CHARGERS
-                        ? <span>{__("charge_manager.script.add_charger_disabled_prefix") + MAX_CONTROLLED_CHARGERS + __("charge_manager.script.add_charger_disabled_suffix")}</span>
+                    {state.chargers.length >= max_controlled_chargers()
+                        ? <span>{__("charge_manager.script.add_charger_disabled_prefix") + max_controlled_chargers() + __("charge_manager.script.add_charger_disabled_suffix")}</span>
                         : <Button variant="light" size="lg" block style="height: 100%;" onClick={() => this.setState({showModal: true})}>{__("charge_manager.script.add_charger")}</Button>}
                 </Card.Body>
             </Card>
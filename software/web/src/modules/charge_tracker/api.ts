@@ -20,6 +20,7 @@ export interface current_charge {
 
 export interface state {
     tracked_charges: number,
+    max_tracked_charges: number,
     first_charge_timestamp: number,
 }
 
@@ -187,7 +187,7 @@ export class ChargeTracker extends ConfigComponent<'charge_tracker/config', {},
                 <FormSeparator heading={__("charge_tracker.content.tracked_charges")}/>
 
                 <FormRow label={__("charge_tracker.content.tracked_charges")} label_muted={__("charge_tracker.content.tracked_charges_muted")}>
-                    <InputText value={state.tracked_charges}/>
+                    <InputText value={state.max_tracked_charges > 0 ? state.tracked_charges + " / " + state.max_tracked_charges : state.tracked_charges}/>
                 </FormRow>
 
                 <FormRow label={__("charge_tracker.content.first_charge_timestamp")} label_muted={__("charge_tracker.content.first_charge_timestamp_muted")}>
@@ -6,7 +6,18 @@ export interface config {
     broker_password: string,
     global_topic_prefix: string
     client_name: string,
-    interval: number
+    interval: number,
+    wildcard_subscription: boolean
+}
+
+// Intervals in milliseconds. A max_interval or deadband of 0 disables the heartbeat or the deadband.
+export interface publish_policies {
+    policies: {
+        path: string,
+        min_interval: number,
+        max_interval: number,
+        deadband: number
+    }[]
 }
 
 export interface auto_discovery_config {
@@ -17,4 +28,6 @@ export interface auto_discovery_config {
 export interface state {
     connection_state: number
     last_error: number
+    pending_publishes: number
+    outbox_size: number
 }
@@ -124,6 +124,12 @@ export class Mqtt extends ConfigComponent<'mqtt/config', {}, MqttState> {
                                      onValue={this.set("interval")}/>
                     </FormRow>
 
+                    <FormRow label={__("mqtt.content.wildcard_subscription")}>
+                        <Switch desc={__("mqtt.content.wildcard_subscription_desc")}
+                                checked={state.wildcard_subscription}
+                                onClick={this.toggle('wildcard_subscription')}/>
+                    </FormRow>
+
                     {API.hasModule('mqtt_auto_discovery') ? <>
                         <FormRow label={__("mqtt.content.auto_discovery_mode")} label_muted={__("mqtt.content.auto_discovery_mode_muted")}>
                             <InputSelect
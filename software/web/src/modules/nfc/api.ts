@@ -15,3 +15,19 @@ interface SeenTag {
 }
 
 export type seen_tags = SeenTag[];
+
+export interface tag_table {
+    tags: number,
+    max_tags: number
+}
+
+export interface add_tag {
+    tag_type: number,
+    tag_id: string,
+    user_id: number
+}
+
+export interface remove_tag {
+    tag_type: number,
+    tag_id: string
+}
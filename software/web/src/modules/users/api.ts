@@ -19,11 +19,13 @@ export interface add {
     current: number,
     display_name: string,
     username: string,
-    digest_hash: string
+    digest_hash: string,
+    token: number
 }
 
 export interface remove {
-    id: number
+    id: number,
+    token: number
 }
 
 export interface modify {
@@ -32,9 +34,21 @@ export interface modify {
     current: number,
     display_name: string,
     username: string,
-    digest_hash: string
+    digest_hash: string,
+    token?: number
 }
 
 export interface http_auth {
     enabled: boolean
 }
+
+export interface operations {
+    pending: number,
+    results: {
+        id: number,
+        token: number,
+        type: number,
+        user_id: number,
+        error: string
+    }[]
+}
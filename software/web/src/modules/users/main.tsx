@@ -51,8 +51,8 @@ interface UsersState {
     newUser: User
 }
 
- // This is a bit hacky: the user modification API can take some time because it writes the changed user/display name to flash
-// The API will block up to five seconds, but just to be sure we try this twice.
+// The user modification API only queues the operation, the main loop applies it and writes the changed users to flash later.
+// Queueing fails if too many operations are pending, so we try this twice.
 function retry_once<T>(fn: () => Promise<T>, topic: string) {
     return fn().catch(() => {
         util.remove_alert(topic);
@@ -60,30 +60,56 @@ function retry_once<T>(fn: () => Promise<T>, topic: string) {
     });
 }
 
+let next_token = Math.floor(Math.random() * 0x7FFFFFFF) + 1;
+
+// Queues the operation and waits until the main loop applied it.
+// The result of the operation is found in users/operations by the token sent with it.
+async function run_operation(topic: "users/add" | "users/remove" | "users/modify", payload: any) {
+    let token = next_token;
+    next_token = next_token % 0x7FFFFFFF + 1;
+
+    let alert_id = topic.replace("/", "_") + "_failed";
+
+    await retry_once(() => API.call(topic, {...payload, "token": token}, __("users.script.save_failed")), alert_id);
+
+    for (let i = 0; i < 100; ++i) {
+        let result = API.get('users/operations').results.find(r => r.token == token);
+        if (result !== undefined) {
+            if (result.error != "") {
+                util.add_alert(alert_id, 'alert-danger', __("users.script.save_failed"), result.error);
+                throw new Error(result.error);
+            }
+            return;
+        }
+        await util.wait(100);
+    }
+
+    util.add_alert(alert_id, 'alert-danger', __("users.script.save_failed"), __("users.script.operation_timeout"));
+    throw new Error(__("users.script.operation_timeout"));
+}
+
 function remove_user(id: number) {
-    return retry_once(() => API.call("users/remove", {"id": id}, __("users.script.save_failed")), "users_remove_failed");
+    return run_operation("users/remove", {"id": id});
 }
 
 function modify_user(user: User) {
     let {password, ...u} = user;
-    return retry_once(() => API.call("users/modify", u, __("users.script.save_failed")), "users_modify_failed");
+    return run_operation("users/modify", u);
 }
 
 function modify_unknown_user(name: string) {
-    return retry_once(() => API.call("users/modify",
-                                    {"id": 0,
-                                     "display_name": name,
-                                     "username": null,
-                                     "current": null,
-                                     "digest_hash": null,
-                                     "roles": null},
-                                    __("users.script.save_failed")),
-                      "users_modify_failed");
+    return run_operation("users/modify",
+                         {"id": 0,
+                          "display_name": name,
+                          "username": null,
+                          "current": null,
+                          "digest_hash": null,
+                          "roles": null});
 }
 
 function add_user(user: User) {
     let {password, ...u} = user;
-    return retry_once(() => API.call("users/add", u, __("users.script.save_failed")), "users_add_failed");
+    return run_operation("users/add", u);
 }
 
 export class Users extends ConfigComponent<'users/config', {}, UsersState> {